@@ -33,13 +33,13 @@
 #include "tcp_vs_http_trans.h"
 
 static inline tcp_vs_dest_t *
-__first_active_schedule(struct list_head *destinations)
+__first_active_schedule(struct tcp_vs_route_rule *rr)
 {
-	register struct list_head *e;
 	tcp_vs_dest_t *dest;
+	int i;
 
-	list_for_each(e, destinations) {
-		dest = list_entry(e, tcp_vs_dest_t, r_list);
+	for (i = 0; i < rr->ndests; i++) {
+		dest = rr->dests[i];
 		if ( dest->active ) 
 			return dest;
 	}
@@ -50,19 +50,19 @@ __first_active_schedule(struct list_head *destinations)
 static tcp_vs_dest_t *
 active_dest_get(struct tcp_vs_service *svc)
 {
-	struct list_head *l;
-	struct tcp_vs_rule *r;
+	struct tcp_vs_route *route;
 	tcp_vs_dest_t *dest = NULL;
+	int i;
 
-	read_lock(&svc->lock);
-	list_for_each(l, &svc->rule_list) {
-		r = list_entry(l, struct tcp_vs_rule, list);
+	rcu_read_lock();
+	route = tcp_vs_route_get(svc);
+	for (i = 0; i < route->nrules; i++) {
 		dest =
-		    __first_active_schedule(&r->destinations);
+		    __first_active_schedule(&route->rules[i]);
 		if ( dest ) 
 			break;
 	}
-	read_unlock(&svc->lock);
+	rcu_read_unlock();
 
 	return dest;
 }
@@ -97,7 +97,7 @@ fault_redirect(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 		return -1;
 	}
 
-	atomic_inc(&dest->conns);
+	tcp_vs_dest_inc_conns(dest);
 	conn->dest = dest;
 	conn->dsock = dsock;
 
@@ -188,6 +188,72 @@ tcp_vs_xmit(struct socket *sock, const char *buffer,
 }
 
 
+/*
+ * tcp_vs_xmitv is to send the bytes of an iovec array to the socket in
+ * as few sock_sendmsg calls as possible.
+ *
+ * A positive return-value indicates the number of bytes sent, a negative
+ * value indicates an error-condition.
+ *
+ * Note: tcp_vs_xmitv will xmit all the bytes or fail, the iovec array is
+ *       modified on a partial send.
+ */
+int
+tcp_vs_xmitv(struct socket *sock, struct iovec *iov, int iovlen,
+	     unsigned long flags)
+{
+	struct msghdr msg;
+	mm_segment_t oldfs;
+	int nbytes = 0;
+	int len, i;
+	int ret;
+
+	EnterFunction(6);
+
+	for (i = 0; i < iovlen; i++)
+		nbytes += iov[i].iov_len;
+	ret = nbytes;
+
+	msg.msg_name = 0;
+	msg.msg_namelen = 0;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovlen;
+	msg.msg_control = NULL;
+	msg.msg_controllen = 0;
+	msg.msg_flags = MSG_NOSIGNAL | flags;
+
+	while (nbytes > 0) {
+		oldfs = get_fs();
+		set_fs(KERNEL_DS);
+		len = sock_sendmsg(sock, &msg, nbytes);
+		set_fs(oldfs);
+
+		if (len < 0) {
+			ret = -1;
+			break;
+		}
+
+		nbytes -= len;
+
+		/* skip the bytes already sent */
+		while (len > 0) {
+			if (len >= msg.msg_iov->iov_len) {
+				len -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			} else {
+				msg.msg_iov->iov_base += len;
+				msg.msg_iov->iov_len -= len;
+				len = 0;
+			}
+		}
+	}
+
+	LeaveFunction(6);
+	return ret;
+}
+
+
 /*
  * tcp_vs_sendbuffer is to send bytes from the buffer to the socket.
  *
@@ -224,6 +290,135 @@ tcp_vs_sendbuffer(struct socket *sock, const char *buffer,
 }
 
 
+/*
+ * tcp_vs_sendpage sends a part of a page to the socket, the page is
+ * referenced by the socket instead of copied if the device can do
+ * scatter-gather. It will xmit all the bytes or fail.
+ */
+static int
+tcp_vs_sendpage(struct socket *sock, struct page *page, int offset,
+		size_t size, int flags)
+{
+	int len;
+
+	while (size > 0) {
+		len = sock->ops->sendpage(sock, page, offset, size, flags);
+		if (len <= 0)
+			return -1;
+		offset += len;
+		size -= len;
+	}
+	return 0;
+}
+
+
+/*
+ * tcp_vs_sendskb sends len bytes of the skb data from offset on, the
+ * linear part by copy and the page fragments by reference.
+ */
+static int
+tcp_vs_sendskb(struct socket *sock, struct sk_buff *skb, int offset,
+	       int len, int flags)
+{
+	struct sk_buff *list;
+	int start = skb_headlen(skb);
+	int i, end, copy;
+
+	if ((copy = start - offset) > 0) {
+		if (copy > len)
+			copy = len;
+		if (tcp_vs_xmit(sock, skb->data + offset, copy, flags) < 0)
+			return -1;
+		offset += copy;
+		len -= copy;
+	}
+
+	for (i = 0; len > 0 && i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+		end = start + frag->size;
+		if ((copy = end - offset) > 0) {
+			if (copy > len)
+				copy = len;
+			if (tcp_vs_sendpage(sock, frag->page,
+					    frag->page_offset + offset - start,
+					    copy, flags) < 0)
+				return -1;
+			offset += copy;
+			len -= copy;
+		}
+		start = end;
+	}
+
+	for (list = skb_shinfo(skb)->frag_list; len > 0 && list;
+	     list = list->next) {
+		end = start + list->len;
+		if ((copy = end - offset) > 0) {
+			if (copy > len)
+				copy = len;
+			if (tcp_vs_sendskb(sock, list, offset - start, copy,
+					   flags) < 0)
+				return -1;
+			offset += copy;
+			len -= copy;
+		}
+		start = end;
+	}
+
+	return 0;
+}
+
+
+static int
+tcp_vs_forward_actor(read_descriptor_t * desc, struct sk_buff *skb,
+		     unsigned int offset, size_t len)
+{
+	if (len > desc->count)
+		len = desc->count;
+
+	if (tcp_vs_sendskb(desc->arg.data, skb, offset, len,
+			   MSG_MORE | MSG_NOSIGNAL) < 0) {
+		desc->error = -1;
+		desc->count = 0;
+		return 0;
+	}
+
+	desc->count -= len;
+	desc->written += len;
+	return len;
+}
+
+
+/*
+ * tcp_vs_forward is to move at most length bytes queued on the source
+ * socket to the destination socket, the skbs are dequeued and their
+ * data is sent without being copied through a buffer.
+ *
+ * A positive return-value indicates the number of bytes forwarded, 0
+ * means that nothing is queued, a negative value indicates an error.
+ */
+int
+tcp_vs_forward(struct socket *ssock, struct socket *dsock,
+	       const size_t length)
+{
+	read_descriptor_t desc;
+
+	EnterFunction(6);
+
+	desc.written = 0;
+	desc.count = length;
+	desc.arg.data = dsock;
+	desc.error = 0;
+
+	lock_sock(ssock->sk);
+	tcp_read_sock(ssock->sk, &desc, tcp_vs_forward_actor);
+	release_sock(ssock->sk);
+
+	LeaveFunction(6);
+	return desc.error < 0 ? -1 : desc.written;
+}
+
+
 int
 tcp_vs_recvbuffer(struct socket *sock, char *buffer,
 		  const size_t buflen, unsigned long flags)
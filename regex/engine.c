@@ -12,6 +12,9 @@
 #define	dissect	sdissect
 #define	backref	sbackref
 #define	step	sstep
+#define	edges	sedges
+#define	lazy	slazy
+#define	dfastep	sdfastep
 #define	print	sprint
 #define	at	sat
 #define	match	smat
@@ -23,6 +26,9 @@
 #define	dissect	ldissect
 #define	backref	lbackref
 #define	step	lstep
+#define	edges	ledges
+#define	lazy	llazy
+#define	dfastep	ldfastep
 #define	print	lprint
 #define	at	lat
 #define	match	lmat
@@ -38,6 +44,7 @@ struct match {
 	char *endp;		/* end of string -- virtual NUL here */
 	char *coldp;		/* can be no match starting before here */
 	char **lastpos;		/* [nplus+1] */
+	struct regex_scratch *scratch;	/* for the above and the states */
 	STATEVARS;
 	states st;		/* current states */
 	states fresh;		/* states for a fresh start */
@@ -60,15 +67,17 @@ struct match {
 /*
  - matcher - the actual matching engine
  == static int matcher(register struct re_guts *g, char *string, \
- ==	size_t nmatch, regmatch_t pmatch[], int eflags);
+ ==	size_t nmatch, regmatch_t pmatch[], int eflags, \
+ ==	struct regex_scratch *scratch);
  */
 static int			/* 0 success, REG_NOMATCH failure */
-matcher(g, string, nmatch, pmatch, eflags)
+matcher(g, string, nmatch, pmatch, eflags, scratch)
 register struct re_guts *g;
 char *string;
 size_t nmatch;
 regmatch_t pmatch[];
 int eflags;
+struct regex_scratch *scratch;
 {
 	register char *endp;
 	register int i;
@@ -108,6 +117,7 @@ int eflags;
 	m->eflags = eflags;
 	m->pmatch = NULL;
 	m->lastpos = NULL;
+	m->scratch = scratch;
 	m->offp = string;
 	m->beginp = start;
 	m->endp = stop;
@@ -118,6 +128,15 @@ int eflags;
 	SETUP(m->empty);
 	CLEAR(m->empty);
 
+	/* if only yes or no is wanted, the cached DFA may tell */
+	if (nmatch == 0 && !g->backrefs) {
+		i = lazy(m, start, stop, gf, gl);
+		if (i >= 0) {
+			STATETEARDOWN(m);
+			return((i) ? 0 : REG_NOMATCH);
+		}
+	}
+
 	/* this loop does only one repetition except for backrefs */
 	for (;;) {
 		endp = fast(m, start, stop, gf, gl);
@@ -143,8 +162,8 @@ int eflags;
 
 		/* oh my, he wants the subexpressions... */
 		if (m->pmatch == NULL)
-			m->pmatch = (regmatch_t *)malloc((m->g->nsub + 1) *
-							sizeof(regmatch_t));
+			m->pmatch = (regmatch_t *)scratch_malloc(m->scratch,
+					(m->g->nsub + 1) * sizeof(regmatch_t));
 		if (m->pmatch == NULL) {
 			STATETEARDOWN(m);
 			return(REG_ESPACE);
@@ -156,10 +175,10 @@ int eflags;
 			dp = dissect(m, m->coldp, endp, gf, gl);
 		} else {
 			if (g->nplus > 0 && m->lastpos == NULL)
-				m->lastpos = (char **)malloc((g->nplus+1) *
-							sizeof(char *));
+				m->lastpos = (char **)scratch_malloc(m->scratch,
+					(g->nplus+1) * sizeof(char *));
 			if (g->nplus > 0 && m->lastpos == NULL) {
-				free(m->pmatch);
+				scratch_free(m->scratch, m->pmatch);
 				STATETEARDOWN(m);
 				return(REG_ESPACE);
 			}
@@ -216,9 +235,9 @@ int eflags;
 	}
 
 	if (m->pmatch != NULL)
-		free((char *)m->pmatch);
+		scratch_free(m->scratch, m->pmatch);
 	if (m->lastpos != NULL)
-		free((char *)m->lastpos);
+		scratch_free(m->scratch, m->lastpos);
 	STATETEARDOWN(m);
 	return(0);
 }
@@ -635,8 +654,6 @@ sopno stopst;
 	register char *p = start;
 	register int c = (start == m->beginp) ? OUT : *(start-1);
 	register int lastc;	/* previous c */
-	register int flagch;
-	register int i;
 	register char *coldp;	/* last p after which no match was underway */
 
 	CLEAR(st);
@@ -652,38 +669,7 @@ sopno stopst;
 		if (EQ(st, fresh))
 			coldp = p;
 
-		/* is there an EOL and/or BOL between lastc and c? */
-		flagch = '\0';
-		i = 0;
-		if ( (lastc == '\n' && m->g->cflags&REG_NEWLINE) ||
-				(lastc == OUT && !(m->eflags&REG_NOTBOL)) ) {
-			flagch = BOL;
-			i = m->g->nbol;
-		}
-		if ( (c == '\n' && m->g->cflags&REG_NEWLINE) ||
-				(c == OUT && !(m->eflags&REG_NOTEOL)) ) {
-			flagch = (flagch == BOL) ? BOLEOL : EOL;
-			i += m->g->neol;
-		}
-		if (i != 0) {
-			for (; i > 0; i--)
-				st = step(m->g, startst, stopst, st, flagch, st);
-			SP("boleol", st, c);
-		}
-
-		/* how about a word boundary? */
-		if ( (flagch == BOL || (lastc != OUT && !ISWORD(lastc))) &&
-					(c != OUT && ISWORD(c)) ) {
-			flagch = BOW;
-		}
-		if ( (lastc != OUT && ISWORD(lastc)) &&
-				(flagch == EOL || (c != OUT && !ISWORD(c))) ) {
-			flagch = EOW;
-		}
-		if (flagch == BOW || flagch == EOW) {
-			st = step(m->g, startst, stopst, st, flagch, st);
-			SP("boweow", st, c);
-		}
+		st = edges(m, startst, stopst, st, lastc, c);
 
 		/* are we done? */
 		if (ISSET(st, stopst) || p == stop)
@@ -707,6 +693,165 @@ sopno stopst;
 		return(NULL);
 }
 
+/*
+ - edges - take the BOL, EOL, BOW and EOW steps between lastc and c
+ == static states edges(register struct match *m, sopno startst, \
+ ==	sopno stopst, register states st, int lastc, int c);
+ */
+static states
+edges(m, startst, stopst, st, lastc, c)
+register struct match *m;
+sopno startst;
+sopno stopst;
+register states st;
+int lastc;
+int c;
+{
+	register int flagch;
+	register int i;
+
+	/* is there an EOL and/or BOL between lastc and c? */
+	flagch = '\0';
+	i = 0;
+	if ( (lastc == '\n' && m->g->cflags&REG_NEWLINE) ||
+			(lastc == OUT && !(m->eflags&REG_NOTBOL)) ) {
+		flagch = BOL;
+		i = m->g->nbol;
+	}
+	if ( (c == '\n' && m->g->cflags&REG_NEWLINE) ||
+			(c == OUT && !(m->eflags&REG_NOTEOL)) ) {
+		flagch = (flagch == BOL) ? BOLEOL : EOL;
+		i += m->g->neol;
+	}
+	if (i != 0) {
+		for (; i > 0; i--)
+			st = step(m->g, startst, stopst, st, flagch, st);
+		SP("boleol", st, c);
+	}
+
+	/* how about a word boundary? */
+	if ( (flagch == BOL || (lastc != OUT && !ISWORD(lastc))) &&
+				(c != OUT && ISWORD(c)) ) {
+		flagch = BOW;
+	}
+	if ( (lastc != OUT && ISWORD(lastc)) &&
+			(flagch == EOL || (c != OUT && !ISWORD(c))) ) {
+		flagch = EOW;
+	}
+	if (flagch == BOW || flagch == EOW) {
+		st = step(m->g, startst, stopst, st, flagch, st);
+		SP("boweow", st, c);
+	}
+
+	return(st);
+}
+
+/*
+ - lazy - fast() with its steps cached in a DFA
+ == static int lazy(register struct match *m, char *start, char *stop, \
+ ==	sopno startst, sopno stopst);
+ *
+ * Only tells whether there is a match.  Once the DFA has the states a
+ * string runs through, matching costs a table lookup per character.
+ * The DFA is shared by all CPUs; one that finds it busy does not wait
+ * for it but runs fast() instead.
+ */
+static int			/* 1 match, 0 no match, -1 use fast() */
+lazy(m, start, stop, startst, stopst)
+register struct match *m;
+char *start;
+char *stop;
+sopno startst;
+sopno stopst;
+{
+	register struct re_guts *g = m->g;
+	register struct re_dfa *d;
+	register char *p;
+	register int s;
+	register int n;
+	states st = m->st;
+	int ret;
+
+	if (start != m->beginp || (m->eflags&(REG_NOTBOL|REG_NOTEOL)))
+		return(-1);
+	if (!spin_trylock(&g->dfalock))
+		return(-1);
+	d = dfaget(g, STATEBYTES(g));
+	if (d == NULL) {
+		spin_unlock(&g->dfalock);
+		return(-1);
+	}
+	if (d->nstates == 0) {
+		/* the start state, its set is also fast()'s fresh */
+		CLEAR(st);
+		SET1(st, startst);
+		st = step(g, startst, stopst, st, NOTHING, st);
+		dfaadd(d, STATEPTR(st), OUT);
+	}
+
+	s = 0;
+	for (p = start; p < stop; p++) {
+		n = d->next[s*d->nclasses + d->class[(uch)*p]];
+		if (n == DFA_UNKNOWN)
+			n = dfastep(m, d, startst, stopst, s, *p);
+		if (n == DFA_MATCH)
+			break;
+		s = n;
+	}
+
+	if (p < stop)
+		ret = 1;
+	else {
+		if (d->final[s] == DFA_END) {
+			memcpy(STATEPTR(st), d->sets + s*d->ssize, d->ssize);
+			st = edges(m, startst, stopst, st, d->lastc[s], OUT);
+			d->final[s] = (ISSET(st, stopst)) ? 1 : 0;
+		}
+		ret = d->final[s];
+	}
+	spin_unlock(&g->dfalock);
+	return(ret);
+}
+
+/*
+ - dfastep - compute and cache a DFA transition
+ == static int dfastep(register struct match *m, register struct re_dfa *d, \
+ ==	sopno startst, sopno stopst, int s, int c);
+ */
+static int			/* next DFA state or DFA_MATCH */
+dfastep(m, d, startst, stopst, s, c)
+register struct match *m;
+register struct re_dfa *d;
+sopno startst;
+sopno stopst;
+int s;
+int c;
+{
+	states st = m->st;
+	states tmp = m->tmp;
+	register int k = d->class[(uch)c];
+	register int n;
+
+	memcpy(STATEPTR(st), d->sets + s*d->ssize, d->ssize);
+	st = edges(m, startst, stopst, st, d->lastc[s], c);
+	if (ISSET(st, stopst))
+		n = DFA_MATCH;
+	else {
+		/* as in fast(), a fresh start is made at every character */
+		ASSIGN(tmp, st);
+		memcpy(STATEPTR(st), d->sets, d->ssize);
+		st = step(m->g, startst, stopst, tmp, c, st);
+		n = dfaadd(d, STATEPTR(st), d->rep[k]);
+		if (n == DFA_UNKNOWN) {
+			/* full; s is gone with the rest */
+			dfaflush(d);
+			return(dfaadd(d, STATEPTR(st), d->rep[k]));
+		}
+	}
+	d->next[s*d->nclasses + k] = n;
+	return(n);
+}
+
 /*
  - slow - step through the string more deliberately
  == static char *slow(register struct match *m, char *start, \
@@ -1014,6 +1159,9 @@ int ch;
 #undef	dissect
 #undef	backref
 #undef	step
+#undef	edges
+#undef	lazy
+#undef	dfastep
 #undef	print
 #undef	at
 #undef	match
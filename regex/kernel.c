@@ -14,81 +14,37 @@
 #include <linux/config.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/list.h>                 /* for list_head */
+#include <linux/string.h>
 #include <linux/slab.h>
 
-
-typedef struct memblock_s
-{
-	struct list_head	list;
-	void			*ptr;
-	size_t			size;
-} memblock_t;
+#include "kernel.h"
 
 
 /*
- * The list of memory blocks (one simple list)
+ * Every block starts with its size, so that free and realloc find it
+ * without a lookup.
  */
-static LIST_HEAD(memblock_list);
-static rwlock_t memblock_lock = RW_LOCK_UNLOCKED;
-
-static int memblock_add(void *ptr, size_t size)
-{
-	memblock_t *m;
-
-	if (!(m = kmalloc(sizeof(memblock_t), GFP_ATOMIC)))
-		return -ENOMEM;
-	m->ptr = ptr;
-	m->size = size;
-
-	write_lock(&memblock_lock);
-	list_add(&m->list, &memblock_list);
-	write_unlock(&memblock_lock);
-
-	return 0;
-}
-
-static void memblock_del(memblock_t *m)
-{
-	write_lock(&memblock_lock);
-	list_del(&m->list);
-	write_unlock(&memblock_lock);
-	kfree(m);
-}
-
-static memblock_t *memblock_get(void *ptr)
+typedef struct memblock_s
 {
-	struct list_head *l;
-	memblock_t *m;
+	size_t			size;
+	unsigned long		magic;
+} memblock_t;
 
-	read_lock(&memblock_lock);
-	list_for_each(l, &memblock_list) {
-		m = list_entry(l, memblock_t, list);
-		if (m->ptr == ptr) {
-			/* HIT */
-			read_unlock(&memblock_lock);
-			return m;
-		}
-	}
-	read_unlock(&memblock_lock);
-	return NULL;
-}
+#define MEMBLOCK_MAGIC		0x52584d42UL
 
 
 void *malloc(size_t size)
 {
-	void *ptr;
+	memblock_t *m;
 
 	if (size == 0)
 		return NULL;
 
-	if (!(ptr = kmalloc(size, GFP_ATOMIC)))
-		return NULL;
-	if (memblock_add(ptr, size)) {
-		kfree(ptr);
+	if (!(m = kmalloc(sizeof(memblock_t) + size, GFP_ATOMIC)))
 		return NULL;
-	}
-	return ptr;
+	m->size = size;
+	m->magic = MEMBLOCK_MAGIC;
+	return m + 1;
 }
 
 void free(void *ptr)
@@ -97,49 +53,61 @@ void free(void *ptr)
 
 	if (!ptr)
 		return;
-	if (!(m = memblock_get(ptr))) {
+	m = (memblock_t *)ptr - 1;
+	if (m->magic != MEMBLOCK_MAGIC) {
 		printk(KERN_ERR "bug: free non-exist memory\n");
 		return;
 	}
-	memblock_del(m);
-	kfree(ptr);
+	m->magic = 0;
+	kfree(m);
 }
 
 void *realloc(void *ptr, size_t size)
 {
 	memblock_t *m;
-	void *new = NULL;
+	void *new;
 
-	if (ptr) {
-		if (!(m = memblock_get(ptr))) {
-			printk(KERN_ERR "bug: realloc non-exist memory\n");
-			return NULL;
-		}
-
-		if (size == m->size)
-			return ptr;
-		if (size != 0) {
-			if (!(new = kmalloc(size, GFP_ATOMIC)))
-				return NULL;
-			memmove(new, ptr, min(size, m->size));
-			if (memblock_add(new, size)) {
-				kfree(new);
-				return NULL;
-			}
-		}
-
-		memblock_del(m);
-		kfree(ptr);
-	} else {
-		if (size != 0) {
-			if (!(new = kmalloc(size, GFP_ATOMIC)))
-				return NULL;
-			if (memblock_add(new, size)) {
-				kfree(new);
-				return NULL;
-			}
-		}
+	if (!ptr)
+		return malloc(size);
+
+	m = (memblock_t *)ptr - 1;
+	if (m->magic != MEMBLOCK_MAGIC) {
+		printk(KERN_ERR "bug: realloc non-exist memory\n");
+		return NULL;
 	}
+	if (size == m->size)
+		return ptr;
 
+	new = NULL;
+	if (size != 0) {
+		if (!(new = malloc(size)))
+			return NULL;
+		memcpy(new, ptr, min(size, m->size));
+	}
+	free(ptr);
 	return new;
 }
+
+
+/*
+ * Scratch space of regexec, blocks that do not fit are malloced. The
+ * space is reset when regexec starts, so only those are freed.
+ */
+void *scratch_malloc(struct regex_scratch *s, size_t size)
+{
+	void *ptr;
+
+	size = (size + sizeof(long) - 1) & ~(sizeof(long) - 1);
+	if (s->used + size > sizeof(s->space))
+		return malloc(size);
+	ptr = (char *)s->space + s->used;
+	s->used += size;
+	return ptr;
+}
+
+void scratch_free(struct regex_scratch *s, void *ptr)
+{
+	if ((char *)ptr < (char *)s->space
+	    || (char *)ptr >= (char *)s->space + sizeof(s->space))
+		free(ptr);
+}
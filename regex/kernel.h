@@ -6,6 +6,7 @@
 #include <linux/module.h>
 #include <linux/types.h>
 #include <linux/ctype.h>
+#include <linux/spinlock.h>
 #include <asm/string.h>
 
 /* These assume 8-bit `char's, 16-bit `short int's,
@@ -58,4 +59,16 @@ extern void free(void *ptr);
 #endif
 extern void *realloc(void *ptr, size_t size);
 
+
+/* scratch space of one regexec call, there is one for each CPU */
+#define REGEX_SCRATCH_SIZE	1024
+
+struct regex_scratch {
+	size_t used;
+	long space[REGEX_SCRATCH_SIZE / sizeof(long)];
+};
+
+extern void *scratch_malloc(struct regex_scratch *s, size_t size);
+extern void scratch_free(struct regex_scratch *s, void *ptr);
+
 #endif
@@ -143,6 +143,8 @@ int cflags;
 	g->categories = &g->catspace[-(CHAR_MIN)];
 	(void) memset((char *)g->catspace, 0, NC*sizeof(cat_t));
 	g->backrefs = 0;
+	spin_lock_init(&g->dfalock);
+	g->dfa = NULL;
 
 	/* do it */
 	EMIT(OEND, 0);
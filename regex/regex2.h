@@ -116,6 +116,7 @@ struct re_guts {
 #		define	USEBOL	01	/* used ^ */
 #		define	USEEOL	02	/* used $ */
 #		define	BAD	04	/* something wrong */
+#		define	NODFA	010	/* too big for a cached DFA */
 	int nbol;		/* number of ^ used */
 	int neol;		/* number of $ used */
 	int ncategories;	/* how many character categories */
@@ -125,10 +126,34 @@ struct re_guts {
 	size_t nsub;		/* copy of re_nsub */
 	int backrefs;		/* does it use back references? */
 	sopno nplus;		/* how deep does it nest +s? */
+	spinlock_t dfalock;	/* guards dfa */
+	struct re_dfa *dfa;	/* built by regexec as it goes */
 	/* catspace must be last */
 	cat_t catspace[1];	/* actually [NC] */
 };
 
+/*
+ * The DFA that regexec builds while it matches.  A DFA state is a
+ * state set of fast() after a character, together with that character,
+ * which decides the BOL, EOL, BOW and EOW steps before the next one.
+ * The character is kept as the representative of its class; all
+ * characters of a class take the same steps.  A transition is computed
+ * the first time it is taken; when no state is left, all but the start
+ * state are dropped and the DFA is built up again.
+ */
+struct re_dfa {
+	int ssize;			/* bytes of one state set */
+	int nclasses;			/* number of character classes */
+	int nstates;			/* DFA states in use */
+	uch class[NC];			/* character -> class */
+	short rep[NC];			/* class -> one of its characters */
+	unsigned short *next;		/* [DFA_STATES][nclasses], all tables */
+	short *lastc;			/* [DFA_STATES] character before */
+	char *sets;			/* [DFA_STATES][ssize] */
+	uch *final;			/* [DFA_STATES] does the end match? */
+};
+
+
 /* misc utilities */
 #define	OUT	(CHAR_MAX+1)	/* a non-character value */
 #define	ISWORD(c)	(isalnum(c) || (c) == '_')
@@ -7,6 +7,7 @@
  */
 
 #include "kernel.h"
+#include <linux/percpu.h>
 
 #include "regex.h"
 #include "utils.h"
@@ -14,6 +15,115 @@
 
 static int nope = 0;		/* for use in asserts; shuts lint up */
 
+/* the match state of regexec comes from here, not from malloc */
+static DEFINE_PER_CPU(struct regex_scratch, regex_scratch);
+
+/* the DFA of lazy(), see struct re_dfa */
+#define	DFA_STATES	64		/* states kept at most */
+#define	DFA_MAXSIZE	32768		/* bytes of tables at most */
+#define	DFA_UNKNOWN	0xffff		/* transition not taken yet */
+#define	DFA_MATCH	0xfffe		/* matched before the character */
+#define	DFA_END		2		/* final[] not known yet */
+
+/* characters of a class take the same steps in step() and fast() */
+#define	SAMECLASS(g, a, b)	((g)->categories[a] == (g)->categories[b] && \
+				!ISWORD(a) == !ISWORD(b) && \
+				((a) == '\n') == ((b) == '\n'))
+
+/*
+ - dfaget - find or make the DFA of a regex, called with dfalock held
+ == static struct re_dfa *dfaget(register struct re_guts *g, int ssize);
+ */
+static struct re_dfa *		/* NULL if there is none */
+dfaget(g, ssize)
+register struct re_guts *g;
+int ssize;
+{
+	register struct re_dfa *d = g->dfa;
+	register int c;
+	register int k;
+	size_t size;
+
+	if (d != NULL)
+		return((d->ssize == ssize) ? d : NULL);
+	if (g->iflags&NODFA)
+		return(NULL);
+
+	d = (struct re_dfa *)malloc(sizeof(struct re_dfa));
+	if (d == NULL)
+		return(NULL);
+	d->nclasses = 0;
+	for (c = CHAR_MIN; c <= CHAR_MAX; c++) {
+		for (k = 0; k < d->nclasses; k++)
+			if (SAMECLASS(g, c, d->rep[k]))
+				break;
+		if (k == d->nclasses)
+			d->rep[d->nclasses++] = c;
+		d->class[(uch)c] = k;
+	}
+
+	size = DFA_STATES * (d->nclasses*sizeof(unsigned short) +
+					sizeof(short) + ssize + 1);
+	if (size > DFA_MAXSIZE) {
+		g->iflags |= NODFA;
+		free((char *)d);
+		return(NULL);
+	}
+	d->next = (unsigned short *)malloc(size);
+	if (d->next == NULL) {
+		free((char *)d);
+		return(NULL);
+	}
+	d->lastc = (short *)(d->next + DFA_STATES*d->nclasses);
+	d->sets = (char *)(d->lastc + DFA_STATES);
+	d->final = (uch *)(d->sets + DFA_STATES*ssize);
+	d->ssize = ssize;
+	d->nstates = 0;
+	g->dfa = d;
+	return(d);
+}
+
+/*
+ - dfaadd - find or add the DFA state of a state set
+ == static int dfaadd(register struct re_dfa *d, char *set, int lastc);
+ */
+static int			/* DFA_UNKNOWN if the DFA is full */
+dfaadd(d, set, lastc)
+register struct re_dfa *d;
+char *set;
+int lastc;
+{
+	register int s;
+
+	/* few states, no hashing */
+	for (s = 0; s < d->nstates; s++)
+		if (d->lastc[s] == lastc &&
+		    memcmp(d->sets + s*d->ssize, set, d->ssize) == 0)
+			return(s);
+	if (s == DFA_STATES)
+		return(DFA_UNKNOWN);
+
+	memcpy(d->sets + s*d->ssize, set, d->ssize);
+	d->lastc[s] = lastc;
+	d->final[s] = DFA_END;
+	memset(d->next + s*d->nclasses, 0xff,
+				d->nclasses*sizeof(unsigned short));
+	d->nstates++;
+	return(s);
+}
+
+/*
+ - dfaflush - drop all DFA states but the start state
+ == static void dfaflush(register struct re_dfa *d);
+ */
+static void
+dfaflush(d)
+register struct re_dfa *d;
+{
+	d->nstates = 1;
+	memset(d->next, 0xff, d->nclasses*sizeof(unsigned short));
+}
+
 /* macros for manipulating states, small version */
 #define	states	unsigned
 #define	states1	unsigned	/* for later use in regexec() decision */
@@ -36,6 +146,9 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #define	FWD(dst, src, n)	((dst) |= ((unsigned)(src)&(here)) << (n))
 #define	BACK(dst, src, n)	((dst) |= ((unsigned)(src)&(here)) >> (n))
 #define	ISSETBACK(v, n)	((v) & ((unsigned)here >> (n)))
+/* state sets as bytes, for the DFA */
+#define	STATEBYTES(g)	sizeof(unsigned)
+#define	STATEPTR(v)	((char *)&(v))
 /* function names */
 #define SNAMES			/* engine.c looks after details */
 
@@ -60,6 +173,8 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #undef	FWD
 #undef	BACK
 #undef	ISSETBACK
+#undef	STATEBYTES
+#undef	STATEPTR
 #undef	SNAMES
 
 /* macros for manipulating states, large version */
@@ -71,10 +186,11 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #define	ASSIGN(d, s)	memcpy(d, s, m->g->nstates)
 #define	EQ(a, b)	(memcmp(a, b, m->g->nstates) == 0)
 #define	STATEVARS	int vn; char *space
-#define	STATESETUP(m, nv)	{ (m)->space = malloc((nv)*(m)->g->nstates); \
+#define	STATESETUP(m, nv)	{ (m)->space = scratch_malloc((m)->scratch, \
+					(nv)*(m)->g->nstates); \
 				if ((m)->space == NULL) return(REG_ESPACE); \
 				(m)->vn = 0; }
-#define	STATETEARDOWN(m)	{ free((m)->space); }
+#define	STATETEARDOWN(m)	{ scratch_free((m)->scratch, (m)->space); }
 #define	SETUP(v)	((v) = &m->space[m->vn++ * m->g->nstates])
 #define	onestate	int
 #define	INIT(o, n)	((o) = (n))
@@ -85,6 +201,9 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #define	FWD(dst, src, n)	((dst)[here+(n)] |= (src)[here])
 #define	BACK(dst, src, n)	((dst)[here-(n)] |= (src)[here])
 #define	ISSETBACK(v, n)	((v)[here - (n)])
+/* state sets as bytes, for the DFA */
+#define	STATEBYTES(g)	((g)->nstates)
+#define	STATEPTR(v)	(v)
 /* function names */
 #define	LNAMES			/* flag */
 
@@ -114,6 +233,8 @@ regmatch_t pmatch[];
 int eflags;
 {
 	register struct re_guts *g = preg->re_g;
+	struct regex_scratch *scratch;
+	int ret;
 #ifdef REDEBUG
 #	define	GOODFLAGS(f)	(f)
 #else
@@ -127,8 +248,15 @@ int eflags;
 		return(REG_BADPAT);
 	eflags = GOODFLAGS(eflags);
 
+	/* no sleeping in the matcher, the scratch space stays ours */
+	scratch = &get_cpu_var(regex_scratch);
+	scratch->used = 0;
 	if (g->nstates <= CHAR_BIT*sizeof(states1) && !(eflags&REG_LARGE))
-		return(smatcher(g, (char *)string, nmatch, pmatch, eflags));
+		ret = smatcher(g, (char *)string, nmatch, pmatch, eflags,
+			       scratch);
 	else
-		return(lmatcher(g, (char *)string, nmatch, pmatch, eflags));
+		ret = lmatcher(g, (char *)string, nmatch, pmatch, eflags,
+			       scratch);
+	put_cpu_var(regex_scratch);
+	return(ret);
 }
@@ -31,5 +31,9 @@ regex_t *preg;
 		free((char *)g->setbits);
 	if (g->must != NULL)
 		free(g->must);
+	if (g->dfa != NULL) {
+		free((char *)g->dfa->next);
+		free((char *)g->dfa);
+	}
 	free((char *)g);
 }
@@ -58,6 +58,8 @@ EXPORT_SYMBOL(unregister_tcp_vs_scheduler);
 EXPORT_SYMBOL(tcp_vs_connect2dest);
 EXPORT_SYMBOL(tcp_vs_sendbuffer);
 EXPORT_SYMBOL(tcp_vs_xmit);
+EXPORT_SYMBOL(tcp_vs_xmitv);
+EXPORT_SYMBOL(tcp_vs_forward);
 EXPORT_SYMBOL(tcp_vs_recvbuffer);
 EXPORT_SYMBOL(tcp_vs_getword);
 EXPORT_SYMBOL(tcp_vs_getline);
@@ -67,10 +69,20 @@ EXPORT_SYMBOL(tcp_vs_get_debug_level);
 EXPORT_SYMBOL(sysctl_ktcpvs_unload);
 EXPORT_SYMBOL(sysctl_ktcpvs_keepalive_timeout);
 EXPORT_SYMBOL(sysctl_ktcpvs_read_timeout);
+EXPORT_SYMBOL(sysctl_ktcpvs_multipart_limit);
+EXPORT_SYMBOL(sysctl_ktcpvs_pipeline_depth);
 EXPORT_SYMBOL(tcp_vs_srvconn_get);
 EXPORT_SYMBOL(tcp_vs_srvconn_put);
 EXPORT_SYMBOL(tcp_vs_srvconn_new);
 EXPORT_SYMBOL(tcp_vs_srvconn_free);
+EXPORT_SYMBOL(tcp_vs_match_rule);
+EXPORT_SYMBOL(tcp_vs_rule_exec);
+EXPORT_SYMBOL(tcp_vs_rule_subject);
+EXPORT_SYMBOL(tcp_vs_hash_key);
+EXPORT_SYMBOL(tcp_vs_hash_addr);
+EXPORT_SYMBOL(tcp_vs_dest_inc_conns);
+EXPORT_SYMBOL(tcp_vs_dest_inc_cpu);
+EXPORT_SYMBOL(tcp_vs_dest_conns);
 EXPORT_SYMBOL(tcp_vs_add_slowtimer);
 EXPORT_SYMBOL(tcp_vs_del_slowtimer);
 EXPORT_SYMBOL(tcp_vs_mod_slowtimer);
@@ -113,8 +125,10 @@ tcp_vs_conn_release(struct tcp_vs_conn *conn)
 	/* release the cloned socket */
 	sock_release(conn->csock);
 
-	if (conn->dest)
-		atomic_dec(&conn->dest->conns);
+	if (conn->dest && (conn->flags & TCP_VS_CONN_F_CPU))
+		tcp_vs_dest_dec_cpu(conn->dest);
+	else if (conn->dest)
+		tcp_vs_dest_dec_conns(conn->dest);
 
 	kfree(conn);
 
@@ -789,6 +803,9 @@ master_daemon(void *unused)
 		/* run the slowtimer collection */
 		tcp_vs_slowtimer_collect();
 
+		/* try the rules left to regexec by their hits */
+		tcp_vs_reorder_rules();
+
 		if (signal_pending(current))
 			break;
 
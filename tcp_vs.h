@@ -26,6 +26,7 @@
 #define KTCPVS_IDENTNAME_MAXLEN		16
 #define KTCPVS_SCHEDNAME_MAXLEN		16
 #define KTCPVS_PATTERN_MAXLEN           256
+#define KTCPVS_RULE_NAMELEN		32
 
 /*
  *      KTCPVS socket options
@@ -45,7 +46,8 @@
 #define TCP_VS_SO_SET_DELRULE	(TCP_VS_BASE_CTL+10)
 #define TCP_VS_SO_SET_START	(TCP_VS_BASE_CTL+11)
 #define TCP_VS_SO_SET_STOP	(TCP_VS_BASE_CTL+12)
-#define TCP_VS_SO_SET_MAX	TCP_VS_SO_SET_STOP
+#define TCP_VS_SO_SET_PREFIXES	(TCP_VS_BASE_CTL+13)
+#define TCP_VS_SO_SET_MAX	TCP_VS_SO_SET_PREFIXES
 
 #define TCP_VS_SO_GET_VERSION	TCP_VS_BASE_CTL
 #define TCP_VS_SO_GET_INFO	(TCP_VS_BASE_CTL+1)
@@ -97,9 +99,47 @@ struct tcp_vs_dest_u {
 };
 
 
+/* http header rewriting of the requests that match a rule */
+#define TCP_VS_REWRITE_XFF		0x0001	/* add X-Forwarded-For */
+#define TCP_VS_REWRITE_CONNECTION	0x0002	/* one Connection header */
+#define TCP_VS_REWRITE_HOPBYHOP		0x0004	/* drop hop-by-hop headers */
+
+/* what a rule looks at in the request */
+#define TCP_VS_RULE_URI			0	/* the request URI */
+#define TCP_VS_RULE_HOST		1	/* the Host header */
+#define TCP_VS_RULE_HEADER		2	/* the header called name */
+#define TCP_VS_RULE_COOKIE		3	/* the cookie called name */
+#define TCP_VS_RULE_METHOD		4	/* the request method */
+#define TCP_VS_RULE_SRC			5	/* the client address, the
+						   pattern is address/bits
+						   or @tag of the prefix
+						   table */
+#define TCP_VS_RULE_MAX			5
+
+/* how the kernel matches a rule */
+#define TCP_VS_RULE_F_PREFIX		0x0001	/* literal prefix, in the trie */
+#define TCP_VS_RULE_F_EXACT		0x0002	/* literal path, in the trie */
+#define TCP_VS_RULE_F_DFA		0x0004	/* in a rule automaton */
+#define TCP_VS_RULE_F_REORDER		0x0008	/* tried by its hits */
+
+/* how the hhttp and phttp schedulers spread the matches of a rule */
+#define TCP_VS_HASH_MODULO		0	/* sum of the bytes modulo the
+						   number of servers */
+#define TCP_VS_HASH_MAGLEV		1	/* weighted Maglev table */
+#define TCP_VS_HASH_RENDEZVOUS		2	/* weighted highest random
+						   weight */
+#define TCP_VS_HASH_MAX			2
+
+/* rule options set by the admin */
+#define TCP_VS_RULE_O_ANYORDER		0x0001	/* matches no request another
+						   such rule matches */
+#define TCP_VS_RULE_O_RR		0x0002	/* servers taken by weighted
+						   round robin */
+
 struct tcp_vs_rule_u {
 	/* rule pattern */
 	int type;
+	char name[KTCPVS_RULE_NAMELEN];	/* header or cookie name */
 	char pattern[KTCPVS_PATTERN_MAXLEN];
 	size_t len;
 
@@ -109,6 +149,41 @@ struct tcp_vs_rule_u {
 
 	/* special entry for hhttp module */
 	int match_num;
+
+	/* TCP_VS_REWRITE_* flags */
+	int rewrite;
+
+	/* TCP_VS_RULE_F_* flags, set by the kernel */
+	int flags;
+
+	/* TCP_VS_RULE_O_* options */
+	int options;
+
+	/* TCP_VS_HASH_* method */
+	int hash;
+
+	/* requests routed by the rule, while the rules are reordered */
+	unsigned int hits;
+};
+
+
+/* the most prefixes in the prefix table of a service */
+#define KTCPVS_PREFIXES_MAX		65536
+
+/* an entry of the prefix table, the tag is from 1 to 65535 */
+struct tcp_vs_prefix_u {
+	__u32 addr;		/* network order */
+	__u16 tag;
+	__u8 bits;
+};
+
+/* The argument to TCP_VS_SO_SET_PREFIXES, after the ident */
+struct tcp_vs_set_prefixes {
+	/* number of prefixes, 0 drops the table */
+	unsigned int num_prefixes;
+
+	/* prefix table */
+	struct tcp_vs_prefix_u entrytable[0];
 };
 
 
@@ -138,6 +213,13 @@ struct tcp_vs_service_u {
 	/* run-time variables */
 	unsigned int conns;	/* connection counter */
 	unsigned int running;	/* running flag */
+
+	/* rule cache counters of all the CPUs */
+	unsigned int rule_hits;
+	unsigned int rule_misses;
+
+	/* number of prefixes in the prefix table */
+	unsigned int num_prefixes;
 };
 
 /* The argument to TCP_VS_SO_GET_SERVICES */
@@ -181,6 +263,7 @@ struct tcp_vs_get_rules {
 #include <asm/atomic.h>		/* for atomic_t */
 #include <linux/sysctl.h>	/* for ctl_table */
 #include <linux/slab.h>		/* for kmalloc */
+#include <linux/rcupdate.h>	/* for rcu_read_lock */
 
 #include "regex/regex.h"
 
@@ -251,6 +334,9 @@ enum {
 	NET_KTCPVS_ZEROCOPY_SEND = 4,
 	NET_KTCPVS_KEEPALIVE_TIMEOUT = 5,
 	NET_KTCPVS_READ_TIMEOUT = 6,
+	NET_KTCPVS_MULTIPART_LIMIT = 7,
+	NET_KTCPVS_PIPELINE_DEPTH = 8,
+	NET_KTCPVS_RULE_REORDER = 9,
 };
 
 
@@ -269,14 +355,90 @@ struct tcp_vs_rule {
 	struct list_head list;
 
 	int type;
+	char name[KTCPVS_RULE_NAMELEN];
 	char *pattern;
 	size_t len;
-	regex_t rx;
+	regex_t rx;		/* not for TCP_VS_RULE_SRC */
+	__u32 addr, mask;	/* TCP_VS_RULE_SRC, network order */
+	int tag;		/* or the tag in the prefix table */
 
 	struct list_head destinations;
 
 	/* special field for hhttp module */
 	int match_num;
+
+	/* TCP_VS_REWRITE_* flags */
+	int rewrite;
+
+	/* TCP_VS_RULE_F_* flags */
+	int flags;
+
+	/* TCP_VS_RULE_O_* options */
+	int options;
+
+	/* TCP_VS_HASH_* method */
+	int hash;
+
+	/* requests routed by it while the rules are reordered, counted
+	   per CPU, see tcp_vs_rule_hits */
+	unsigned int *hits;
+};
+
+/* the rules of a service compiled together, see tcp_vs_rule.c */
+struct tcp_vs_rule_set;
+struct tcp_vs_rule_cache;
+
+/* the prefix table of a service, see tcp_vs_lpm.c */
+struct tcp_vs_lpm;
+
+/* the parsed request the rules look at, see tcp_vs_http_parser.h */
+struct http_request_s;
+
+/* the servers of a list by conns/weight, see tcp_vs_heap.c */
+struct tcp_vs_heap {
+	int n;
+	struct tcp_vs_dest **dests;	/* the list */
+	int *e;			/* indexes into dests, e[0] the least loaded */
+	spinlock_t lock;	/* for e and the counts of its servers */
+};
+
+/* the smooth weighted round robin order of a list, see tcp_vs_sched.c */
+struct tcp_vs_wrr {
+	int n;			/* length of the order, 0 for none */
+	unsigned int next;	/* the next turn, bumped without locking */
+	unsigned short *seq;	/* indexes into the list */
+};
+
+/* a rule with its servers, as the schedulers see it */
+struct tcp_vs_route_rule {
+	struct tcp_vs_rule *rule;
+	int ndests;
+	struct tcp_vs_dest **dests;
+	struct tcp_vs_heap heap;
+	struct tcp_vs_wrr wrr;	/* with TCP_VS_RULE_O_RR */
+
+	/* lookup table into dests for TCP_VS_HASH_MAGLEV, or NULL */
+	int tsize;
+	unsigned short *table;
+};
+
+/*
+ *	The routing data of a service: the rules in list order with their
+ *	servers, and all the servers. It is never changed once published.
+ *	The control path builds a new one whenever the lists change, and
+ *	frees the old one after an RCU grace period, so the schedulers read
+ *	it under rcu_read_lock without taking svc->lock.
+ */
+struct tcp_vs_route {
+	unsigned int gen;	/* generation, for the rule cache */
+	unsigned int types;	/* 1 << TCP_VS_RULE_* of its rules */
+	struct tcp_vs_rule_set *rule_set;	/* or NULL, see tcp_vs_rule.c */
+	int nrules;
+	struct tcp_vs_route_rule *rules;
+	int ndests;
+	struct tcp_vs_dest **dests;
+	struct tcp_vs_heap heap;
+	struct tcp_vs_wrr wrr;	/* with TCP_VS_SCHED_F_RR */
 };
 
 
@@ -304,8 +466,18 @@ struct tcp_vs_service {
 	/* rule list */
 	struct list_head rule_list;
 	__u32 num_rules;
+	struct tcp_vs_rule_cache *rule_cache;	/* per CPU */
+
+	/* the lists as the schedulers see them */
+	struct tcp_vs_route *route;
+	unsigned int route_gen;	/* generation of the last route built */
+
+	/* the client prefix table, replaced like the route */
+	struct tcp_vs_lpm *lpm;
+	__u32 num_prefixes;
 
-	/* locking for the destination list and the rule list */
+	/* locking for the destination list and the rule list, the
+	   schedulers read the route instead */
 	rwlock_t lock;
 
 	/* server control */
@@ -335,6 +507,12 @@ typedef struct tcp_vs_dest {
 	unsigned flags;		/* dest status flags */
 	atomic_t conns;		/* active connections */
 	int active;		/* status of the destination */
+
+	struct tcp_vs_service *svc;	/* service it belongs to */
+	struct tcp_vs_heap *heap;	/* the heap it is counted in, or NULL */
+	int hpos;		/* its place there */
+	int *cpu_conns;		/* connections counted per CPU, not in
+				   the heaps */
 } tcp_vs_dest_t;
 
 
@@ -361,6 +539,8 @@ typedef struct server_conn_struct {
 /*
  *      TCPVS connection object
  */
+#define TCP_VS_CONN_F_CPU	0x0001	/* counted in dest->cpu_conns */
+
 struct tcp_vs_conn {
 	struct list_head n_list;	/* d-linked list head */
 	__u32 addr;		/* client address */
@@ -394,8 +574,18 @@ struct tcp_vs_scheduler {
 	/* select a server and connect to it */
 	int (*schedule) (struct tcp_vs_conn * conn,
 			 struct tcp_vs_service * svc);
+
+	/* TCP_VS_SCHED_F_* */
+	unsigned int flags;
 };
 
+#define TCP_VS_SCHED_F_RR	0x0001	/* takes the round robin order of
+					   the servers of the service */
+#define TCP_VS_SCHED_F_HEAP	0x0002	/* takes the least connection heap
+					   of the servers of the service */
+#define TCP_VS_SCHED_F_RULE_HEAP 0x0004	/* takes the least connection heaps
+					   of the servers of each rule */
+
 
 /*
  *	TCPVS service child
@@ -417,6 +607,10 @@ extern int tcp_vs_recvbuffer(struct socket *sock, char *buffer,
 			     const size_t buflen, unsigned long flags);
 extern int tcp_vs_xmit(struct socket *sock, const char *buffer,
 		       const size_t length, unsigned long flags);
+extern int tcp_vs_xmitv(struct socket *sock, struct iovec *iov,
+			int iovlen, unsigned long flags);
+extern int tcp_vs_forward(struct socket *ssock, struct socket *dsock,
+			  const size_t length);
 
 
 #ifndef strdup
@@ -447,9 +641,13 @@ extern int sysctl_ktcpvs_max_backlog;
 extern int sysctl_ktcpvs_zerocopy_send;
 extern int sysctl_ktcpvs_keepalive_timeout;
 extern int sysctl_ktcpvs_read_timeout;
+extern int sysctl_ktcpvs_multipart_limit;
+extern int sysctl_ktcpvs_pipeline_depth;
+extern int sysctl_ktcpvs_rule_reorder;
 
 extern int tcp_vs_flush(void);
 extern int tcp_vs_control_start(void);
+extern void tcp_vs_reorder_rules(void);
 extern void tcp_vs_control_stop(void);
 
 /* from tcp_vs_sched.c */
@@ -460,6 +658,9 @@ extern int tcp_vs_bind_scheduler(struct tcp_vs_service *svc,
 extern int tcp_vs_unbind_scheduler(struct tcp_vs_service *svc);
 extern struct tcp_vs_scheduler *tcp_vs_scheduler_get(const char *name);
 extern void tcp_vs_scheduler_put(struct tcp_vs_scheduler *sched);
+extern int tcp_vs_wrr_build(struct tcp_vs_wrr *wrr,
+			    struct tcp_vs_dest **dests, int n);
+extern void tcp_vs_wrr_free(struct tcp_vs_wrr *wrr);
 
 /* from redirect.c */
 extern int redirect_to_local(struct tcp_vs_conn *conn, __u32 addr,
@@ -475,6 +676,129 @@ extern void tcp_vs_srvconn_free(server_conn_t * sc);
 extern int tcp_vs_srvconn_init(void);
 extern void tcp_vs_srvconn_cleanup(void);
 
+/* from tcp_vs_rule.c */
+extern struct tcp_vs_rule_set *tcp_vs_rule_compile(struct list_head *rule_list);
+extern void tcp_vs_rule_free(struct tcp_vs_rule_set *set);
+extern struct tcp_vs_route *tcp_vs_route_build(struct tcp_vs_service *svc);
+extern void tcp_vs_route_free(struct tcp_vs_route *route);
+extern int tcp_vs_rule_reorder_due(struct tcp_vs_route *route);
+extern int tcp_vs_route_reordered(struct tcp_vs_route *route);
+extern unsigned int tcp_vs_rule_hits(struct tcp_vs_rule *r);
+extern void tcp_vs_rule_halve_hits(struct tcp_vs_rule *r);
+extern int tcp_vs_rule_prefix(const char *pattern, __u32 *addr, __u32 *mask,
+			      int *tag);
+extern int tcp_vs_rule_exec(struct tcp_vs_rule *r, const char *uri, int len,
+			    size_t nmatch, regmatch_t *pmatch);
+extern const char *tcp_vs_rule_subject(struct tcp_vs_rule *r,
+				       struct tcp_vs_conn *conn,
+				       struct http_request_s *req, int *len);
+extern struct tcp_vs_route_rule *tcp_vs_match_rule(struct tcp_vs_service *svc,
+						   struct tcp_vs_conn *conn,
+						   struct http_request_s *req);
+extern struct tcp_vs_rule_cache *tcp_vs_rule_cache_new(void);
+extern void tcp_vs_rule_cache_free(struct tcp_vs_rule_cache *cache);
+extern void tcp_vs_rule_cache_stats(struct tcp_vs_service *svc,
+				    unsigned int *hits, unsigned int *misses);
+
+/* the routing data of a service, to be used under rcu_read_lock */
+static inline struct tcp_vs_route *
+tcp_vs_route_get(struct tcp_vs_service *svc)
+{
+	struct tcp_vs_route *route = svc->route;
+
+	smp_read_barrier_depends();
+	return route;
+}
+
+/* a rule of svc looks at the header fields of a request, so the request
+   must be parsed past its first line */
+static inline int
+tcp_vs_route_headers(struct tcp_vs_service *svc)
+{
+	unsigned int types;
+
+	rcu_read_lock();
+	types = tcp_vs_route_get(svc)->types;
+	rcu_read_unlock();
+	return (types & ((1 << TCP_VS_RULE_HOST) | (1 << TCP_VS_RULE_HEADER)
+			 | (1 << TCP_VS_RULE_COOKIE))) != 0;
+}
+
+/* from tcp_vs_heap.c */
+extern void tcp_vs_heap_init(struct tcp_vs_heap *h,
+			     struct tcp_vs_dest **dests, int n, int *e);
+extern void tcp_vs_heap_switch(struct tcp_vs_service *svc,
+			       struct tcp_vs_route *old,
+			       struct tcp_vs_route *route);
+extern void tcp_vs_dest_inc_conns(struct tcp_vs_dest *dest);
+extern void tcp_vs_dest_dec_conns(struct tcp_vs_dest *dest);
+extern void tcp_vs_dest_inc_cpu(struct tcp_vs_dest *dest);
+extern void tcp_vs_dest_dec_cpu(struct tcp_vs_dest *dest);
+extern int tcp_vs_dest_conns(struct tcp_vs_dest *dest);
+
+/*
+ *	The server of weight above 0 with the least conns/weight, the first
+ *	one in the list of equal ones, NULL if there is none. Called with
+ *	the route read locked.
+ */
+static inline struct tcp_vs_dest *
+tcp_vs_heap_least(struct tcp_vs_heap *h)
+{
+	struct tcp_vs_dest *dest;
+
+	if (h->n == 0)
+		return NULL;
+	dest = h->dests[h->e[0]];
+	return dest->weight > 0 ? dest : NULL;
+}
+
+/*
+ *	The server whose turn it is in the round robin order of a list, NULL
+ *	if it has none. Two schedulers taking the same turn at once only
+ *	send one server two connections. Called with the route read locked.
+ */
+static inline struct tcp_vs_dest *
+tcp_vs_wrr_next(struct tcp_vs_wrr *wrr, struct tcp_vs_dest **dests)
+{
+	if (wrr->n == 0)
+		return NULL;
+	return dests[wrr->seq[wrr->next++ % wrr->n]];
+}
+
+/* the server of a rule for the content schedulers, by least connection
+   or by round robin */
+static inline struct tcp_vs_dest *
+tcp_vs_rule_dest(struct tcp_vs_route_rule *rr)
+{
+	if (rr->rule->options & TCP_VS_RULE_O_RR)
+		return tcp_vs_wrr_next(&rr->wrr, rr->dests);
+	return tcp_vs_heap_least(&rr->heap);
+}
+
+/* from tcp_vs_hash.c */
+extern int tcp_vs_hash_build(struct tcp_vs_route_rule *rr);
+extern void tcp_vs_hash_free(struct tcp_vs_route_rule *rr);
+extern struct tcp_vs_dest *tcp_vs_hash_key(struct tcp_vs_route_rule *rr,
+					   const char *key, int len);
+extern struct tcp_vs_dest *tcp_vs_hash_addr(struct tcp_vs_route_rule *rr,
+					    __u32 addr);
+
+/* from tcp_vs_lpm.c */
+extern struct tcp_vs_lpm *tcp_vs_lpm_build(const struct tcp_vs_prefix_u *p,
+					   int n);
+extern void tcp_vs_lpm_free(struct tcp_vs_lpm *lpm);
+extern int tcp_vs_lpm_lookup(const struct tcp_vs_lpm *lpm, __u32 addr);
+
+/* the prefix table of a service or NULL, to be used under rcu_read_lock */
+static inline struct tcp_vs_lpm *
+tcp_vs_lpm_get(struct tcp_vs_service *svc)
+{
+	struct tcp_vs_lpm *lpm = svc->lpm;
+
+	smp_read_barrier_depends();
+	return lpm;
+}
+
 /* from tcp_vs_timer.c */
 void assert_slowtimer(int pos);
 extern void tcp_vs_add_slowtimer(slowtimer_t * timer);
@@ -85,67 +85,25 @@ tcp_vs_chttp_update_svc(struct tcp_vs_service *svc)
 	return 0;
 }
 
-static inline struct tcp_vs_dest *
-__tcp_vs_chttp_wlc_schedule(struct list_head *destinations)
-{
-	register struct list_head *e;
-	struct tcp_vs_dest *dest, *least;
-
-	list_for_each(e, destinations) {
-		least = list_entry(e, struct tcp_vs_dest, r_list);
-
-		if (least->weight > 0) {
-			goto nextstage;
-		}
-	}
-	return NULL;
-
-	/*
-	 *      Find the destination with the least load.
-	 */
-      nextstage:
-	for (e = e->next; e != destinations; e = e->next) {
-		dest = list_entry(e, struct tcp_vs_dest, r_list);
-
-		if (atomic_read(&least->conns) * dest->weight >
-		    atomic_read(&dest->conns) * least->weight) {
-			least = dest;
-		}
-	}
-
-	return least;
-}
-
-
 static struct tcp_vs_dest *
-tcp_vs_chttp_matchrule(struct tcp_vs_service *svc, http_request_t * req)
+tcp_vs_chttp_matchrule(struct tcp_vs_service *svc, struct tcp_vs_conn *conn,
+		       http_request_t * req, int *rewrite)
 {
-	struct list_head *l;
-	struct tcp_vs_rule *r;
+	struct tcp_vs_route_rule *rr;
 	struct tcp_vs_dest *dest = NULL;
-	char *uri;
 
-	if (!(uri = kmalloc(req->uri_len + 1, GFP_KERNEL))) {
-		TCP_VS_ERR("No memory!\n");
-		return NULL;
-	}
-	memcpy(uri, req->uri_str, req->uri_len);
-	uri[req->uri_len] = '\0';
-	TCP_VS_DBG(5, "matching request URI: %s\n", uri);
-
-	read_lock(&svc->lock);
-	list_for_each(l, &svc->rule_list) {
-		r = list_entry(l, struct tcp_vs_rule, list);
-		if (!regexec(&r->rx, uri, 0, NULL, 0)) {
-			/* HIT */
-			dest =
-			    __tcp_vs_chttp_wlc_schedule(&r->destinations);
-			break;
-		}
+	TCP_VS_DBG(5, "matching request URI: %.*s\n",
+		   (int) req->uri_len, req->uri_str);
+
+	rcu_read_lock();
+	rr = tcp_vs_match_rule(svc, conn, req);
+	if (rr) {
+		/* HIT */
+		dest = tcp_vs_rule_dest(rr);
+		*rewrite = rr->rule->rewrite;
 	}
-	read_unlock(&svc->lock);
+	rcu_read_unlock();
 
-	kfree(uri);
 	return dest;
 }
 
@@ -153,11 +111,11 @@ tcp_vs_chttp_matchrule(struct tcp_vs_service *svc, http_request_t * req)
 /****************************************************************************
 *  Inject a cookie with a unique session id to the http client.
 *
+*  The Set-Cookie line is written to buf (at least 80 bytes).
 */
 static ulong
-inject_session_id_cookie(struct socket *sock, int set_cookie2)
+inject_session_id_cookie(char *buf, int set_cookie2)
 {
-	char buf[80];		/* avoid kmalloc */
 	ulong id;
 
 	spin_lock(&session_id_lock);
@@ -174,10 +132,6 @@ inject_session_id_cookie(struct socket *sock, int set_cookie2)
 
 	}
 
-	if (tcp_vs_xmit(sock, buf, strlen(buf), MSG_MORE) < 0) {
-		TCP_VS_ERR("Error in injecting session id.\n");
-	}
-
 	return id;
 }
 
@@ -287,12 +241,18 @@ find_server_by_session_id(ulong sid)
 *
 */
 static struct tcp_vs_dest *
-tcp_vs_chttp_match(struct tcp_vs_service *svc, http_request_t * req)
+tcp_vs_chttp_match(struct tcp_vs_service *svc, struct tcp_vs_conn *conn,
+		   http_request_t * req, int *rewrite)
 {
 	struct tcp_vs_dest *dest = NULL;
+	struct tcp_vs_dest *rdest;
 
 	EnterFunction(5);
 
+	/* the matched rule also tells how to rewrite the header */
+	*rewrite = 0;
+	rdest = tcp_vs_chttp_matchrule(svc, conn, req, rewrite);
+
 	if (req->mime.session_id != 0) {
 		dest = find_server_by_session_id(req->mime.session_id);
 		TCP_VS_DBG(5,
@@ -300,7 +260,7 @@ tcp_vs_chttp_match(struct tcp_vs_service *svc, http_request_t * req)
 	}
 
 	if (dest == NULL) {
-		dest = tcp_vs_chttp_matchrule(svc, req);
+		dest = rdest;
 		/* FIXME: if session id is not 0 ??? */
 	}
 
@@ -522,19 +482,21 @@ http_set_cookie_handler(struct list_head *cookie_list,
 
 
 /****************************************************************************
-*	get response from the specified server
+*	get the response to a request from its server
 */
 static int
-chttp_get_response(struct socket *csock, server_conn_t * sc,
-		   http_request_t * req, char *buffer,
-		   int buflen, int *close)
+chttp_get_response(struct socket *csock, http_inflight_t * rq,
+		   http_parser_t * parser, char *buffer, int buflen,
+		   int *close)
 {
 	http_read_ctl_block_t read_ctl_blk;
 	http_buf_t	buff;
 	http_response_t resp;
-	int len, ret = -1;
+	int len, eoh, ret = -1;
+	server_conn_t *sc = rq->sc;
 	struct socket *dsock = sc->sock;
 	ulong sid = 0;
+	char cookie[80];	/* avoid kmalloc */
 
 
 	EnterFunction(5);
@@ -557,54 +519,38 @@ chttp_get_response(struct socket *csock, server_conn_t * sc,
 		interruptible_sleep_on_timeout(&dsock->wait, HZ);
 	}
 
-	/* read status line from server */
-	len = http_read_line(&read_ctl_blk, 0);
+	/* read the whole response header from server */
+	http_parser_init(parser, HTTP_PARSE_RESPONSE);
+	len = http_read_header(&read_ctl_blk, parser);
 	if (len < 0) {
-		TCP_VS_ERR("Error in reading status line from server\n");
-		goto exit;
-	}
-
-	/* xmit status line to client (2 more bytes for CRLF) */
-	if (tcp_vs_xmit(csock, read_ctl_blk.info, len + 2, MSG_MORE) < 0) {
-		TCP_VS_ERR("Error in sending status line\n");
+		TCP_VS_ERR("Error in reading response header from server\n");
 		goto exit;
 	}
 
-	/* parse status line */
 	memset(&resp, 0, sizeof(resp));
-	if (parse_http_status_line(read_ctl_blk.info, len, &resp) ==
-	    PARSE_ERROR) {
-		goto exit;
-	}
-
-	/* parse MIME header */
-	do {
-		if ((len = http_read_line(&read_ctl_blk, 0)) < 0) {
-			goto exit;
-		}
-
+	http_parser_response(parser, read_ctl_blk.info, &resp);
 
-		/*inject a cookie with session id at the end of the http header */
-		if ((len == 0) && resp.mime.cookie) {
-			sid = req->mime.session_id;
-			if ((sid == 0) || (sid > ktcpvs_session_id)) {
-				sid = inject_session_id_cookie(csock,
-							       resp.mime.
-							       set_cookie2);
-			}
-		}
-
-		/* xmit MIME header (2 more bytes for CRLF) */
-		if (tcp_vs_xmit
-		    (csock, read_ctl_blk.info, len + 2, MSG_MORE) < 0) {
-			TCP_VS_ERR("Error in sending status line\n");
-			goto exit;
-		}
-
-		/* http_line_unescape (read_ctl_blk.info, len); */
-		http_mime_parse(read_ctl_blk.info, len, &resp.mime);
-	}
-	while (len != 0);	/* http header end with CRLF,CRLF */
+	/*
+	 * The header is sent to client with the first bytes of the body.
+	 * Inject a cookie with session id at the end of the http header.
+	 */
+	eoh = (len >= 2 && read_ctl_blk.info[len - 2] == CR) ? 2 : 1;
+	if (resp.mime.cookie) {
+		sid = rq->session_id;
+		if ((sid == 0) || (sid > ktcpvs_session_id)) {
+			sid = inject_session_id_cookie(cookie,
+						       resp.mime.set_cookie2);
+			http_queue_header(&read_ctl_blk, read_ctl_blk.info,
+					  len - eoh);
+			http_queue_header(&read_ctl_blk, cookie,
+					  strlen(cookie));
+			http_queue_header(&read_ctl_blk,
+					  read_ctl_blk.info + len - eoh, eoh);
+		} else
+			http_queue_header(&read_ctl_blk, read_ctl_blk.info,
+					  len);
+	} else
+		http_queue_header(&read_ctl_blk, read_ctl_blk.info, len);
 
 	*close = resp.mime.connection_close;
 
@@ -623,80 +569,56 @@ chttp_get_response(struct socket *csock, server_conn_t * sc,
 	 * header fields, regardless of the entity-header fields present in
 	 * the message.
 	 */
-	if (req->method != HTTP_M_HEAD) {
-		if ((resp.status_code < 200)
-		    || (resp.status_code == 204
-			|| resp.status_code == 304)) {
-			ret = 0;
-			goto exit;
-		}
+	if (rq->method == HTTP_M_HEAD || resp.status_code < 200
+	    || resp.status_code == 204 || resp.status_code == 304) {
+		ret = http_xmit_pending(csock, &read_ctl_blk, 0);
+		goto exit;
+	}
 
-		ret =
-		    relay_http_message_body(csock, &read_ctl_blk,
-					    &resp.mime);
-		if (resp.mime.sep) {
-			kfree(resp.mime.sep);
-		}
+	ret = relay_http_message_body(csock, &read_ctl_blk, &resp.mime);
+	if (resp.mime.sep) {
+		kfree(resp.mime.sep);
 	}
 
       exit:
+	http_read_release(&read_ctl_blk);
 	LeaveFunction(5);
 	return ret;
 }
 
 
 /****************************************************************************
-*	Transmit http message header to destination socket
+*	return the response to the oldest request in flight to the client
 *
+*   The server connection is put back, or freed if the server closes it;
+*   then no more requests are read from the client.
 */
 static int
-xmit_http_message_header(struct socket *dsock,
-			 http_read_ctl_block_t * read_ctl)
+chttp_complete(struct tcp_vs_conn *conn, http_pipeline_t * pl,
+	       http_parser_t * parser, int *closing)
 {
-	struct list_head *l, *temp;
-	http_buf_t *buf_entry;
-	int ret = 0;
-
-	EnterFunction(5);
-
-	TCP_VS_DBG(5, "HTTP Message Header:\n");
-
-	list_for_each_safe(l, temp, &read_ctl->buf_entry_list) {
-		buf_entry = list_entry(l, http_buf_t, b_list);
-
-		if (tcp_vs_xmit(dsock, buf_entry->buf,
-				buf_entry->data_len, MSG_MORE) < 0) {
-			TCP_VS_ERR("Error in xmitting message header\n");
-			ret = -1;
-			break;
-		}
+	http_inflight_t *rq = http_pipeline_pop(pl);
+	int close_server;
 
-		if (buf_entry != read_ctl->cur_buf) {
-			list_del(l);
-			free_page((unsigned long) buf_entry->buf);
-			kfree(buf_entry);
-		}
+	if (chttp_get_response(conn->csock, rq, parser, conn->buffer,
+			       conn->buflen, &close_server) < 0) {
+		tcp_vs_srvconn_free(rq->sc);
+		return -1;
 	}
 
-	LeaveFunction(5);
-	return ret;
-}
-
-/****************************************************************************
-*
-* http_read_reset - reset read buffer
-*
-*/
-int
-http_read_reset (http_read_ctl_block_t *ctl_blk)
-{
-	char* buf = ctl_blk->cur_buf->buf;
+	if (close_server) {
+		TCP_VS_DBG(5, "Close server connection.\n");
+		tcp_vs_srvconn_free(rq->sc);
+		*closing = 1;	/* close the connection? tbd */
+		return 0;
+	}
 
-	memmove(buf, buf + ctl_blk->offset, ctl_blk->remaining);
-	ctl_blk->offset = 0;
+	/* have to put back the server connection when it is not used */
+	tcp_vs_srvconn_put(rq->sc);
 	return 0;
 }
 
+
 /****************************************************************************
 *	HTTP content-based scheduling with cookie support:
 *	Read and parse the whole http message header, and direct each http
@@ -715,10 +637,16 @@ tcp_vs_chttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 	int ret = 1;		/* scheduler has done all the jobs */
 	int len;
 	unsigned long last_read;
-	int close_server = 0;
+	int closing = 0;
 	struct tcp_vs_dest *dest;
 	struct socket *dsock;
 	server_conn_t *sc;
+	http_parser_t *parser, *rparser;
+	http_pipeline_t *pl;
+	http_inflight_t *rq;
+	int rewrite;
+	http_rewrite_t rw;
+	char rwbuf[HTTP_RW_BUFLEN];
 
 	DECLARE_WAITQUEUE(wait, current);
 
@@ -727,6 +655,22 @@ tcp_vs_chttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 	conn->dest = NULL;
 	conn->dsock = NULL;
 
+	/* the responses get a parser of their own, a request waiting for
+	   the responses before it keeps its header index */
+	if (!(parser = kmalloc(2 * sizeof(http_parser_t), GFP_KERNEL))) {
+		TCP_VS_ERR("Out of memory!\n");
+		LeaveFunction(5);
+		return -2;
+	}
+	if (!(pl = kmalloc(sizeof(http_pipeline_t), GFP_KERNEL))) {
+		TCP_VS_ERR("Out of memory!\n");
+		kfree(parser);
+		LeaveFunction(5);
+		return -2;
+	}
+	http_pipeline_init(pl);
+	rparser = parser + 1;
+
 	/* init buffer for http message header */
 	if (http_read_init(&read_ctl_blk, conn->csock) != 0) {
 		TCP_VS_ERR("Out of memory!\n");
@@ -741,6 +685,19 @@ tcp_vs_chttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 
 	last_read = jiffies;
 	do {
+		/*
+		 * With responses outstanding, only a request that has
+		 * already come in is sent on, else the response to the
+		 * oldest request is returned first.
+		 */
+		if (pl->count > 0
+		    && (pl->count == pl->depth || closing
+			|| data_available(&read_ctl_blk) != 1)) {
+			if (chttp_complete(conn, pl, rparser, &closing) < 0)
+				goto out;
+			continue;
+		}
+
 		switch (data_available(&read_ctl_blk)) {
 		case -1:
 			TCP_VS_DBG(5,
@@ -778,37 +735,36 @@ tcp_vs_chttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 			break;
 		}
 
-		/* read request line from client socket */
-		len = http_read_line(&read_ctl_blk, 1);
+		/* read and index the whole http message header */
+		http_parser_init(parser, 0);
+		len = http_read_header(&read_ctl_blk, parser);
 		if (len < 0) {
 			TCP_VS_ERR
-			    ("Error reading request line from client\n");
+			    ("Error reading request header from client\n");
 			ret = -2;
 			goto out;
 		}
 
-		/* parse the http request line */
+		/* fill in the request from the header index */
 		memset(&req, 0, sizeof(req));
-		if (parse_http_request_line(read_ctl_blk.info, len, &req)
+		if (http_parser_request(parser, read_ctl_blk.info, &req)
 		    != PARSE_OK) {
 			TCP_VS_ERR("Cannot parse http request\n");
 			ret = -2;
 			goto out;
 		}
 
-		/* Process MIME header */
-		do {
-			len = http_read_line(&read_ctl_blk, 1);
-			if (len < 0) {
+
+		/* a request with side effects waits for the responses to
+		   all the requests before it; it has been read from the
+		   client, so it goes out even if a server closes meanwhile */
+		while (pl->count > 0 && !HTTP_PIPELINE_SAFE(req.method)) {
+			if (chttp_complete(conn, pl, rparser, &closing) < 0)
 				goto out;
-			}
-			http_mime_parse(read_ctl_blk.info, len, &req.mime);
 		}
-		while (len != 0);	/* http header end with CRLF,CRLF */
-
 
 		/* select a server */
-		dest = tcp_vs_chttp_match(svc, &req);
+		dest = tcp_vs_chttp_match(svc, conn, &req, &rewrite);
 		if (!dest) {
 			TCP_VS_DBG(5, "Can't find a right server\n");
 			ret = -2;
@@ -832,36 +788,34 @@ tcp_vs_chttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 			goto lookup_again;
 		}
 
-		if (xmit_http_message_header(dsock, &read_ctl_blk) != 0) {
-			goto out_free;
-		}
-
+		/* the request header goes out with the body */
+		http_queue_request(&read_ctl_blk, parser, &req, len, rewrite,
+				   inet_sk(conn->csock->sk)->daddr, &rw,
+				   rwbuf);
 		if (relay_http_message_body
 		    (dsock, &read_ctl_blk, &req.mime) != 0) {
 			TCP_VS_ERR("Error in sending http message body\n");
 			goto out_free;
 		}
 
-		if (chttp_get_response(conn->csock, sc, &req, conn->buffer,
-				       conn->buflen, &close_server) < 0) {
-			goto out;
-		}
-
-		if (close_server) {
-			TCP_VS_DBG(5, "Close server connection.\n");
-			goto out_free;	/* close the connection? tbd */
-		}
-
-		/* have to put back the server connection when
-		   it is not used */
-		tcp_vs_srvconn_put(sc);
+		/* the response is returned when its turn comes */
+		rq = http_pipeline_push(pl);
+		rq->sc = sc;
+		rq->method = req.method;
+		rq->session_id = req.mime.session_id;
 
-		http_read_reset(&read_ctl_blk);
+		if (req.mime.connection_close)
+			closing = 1;
 	}
-	while (req.mime.connection_close != 1);
+	while (!closing || pl->count > 0);
 
       out:
+	/* drop the requests whose responses are not returned */
+	while (pl->count > 0)
+		tcp_vs_srvconn_free(http_pipeline_pop(pl)->sc);
+	kfree(pl);
 	http_read_free(&read_ctl_blk);
+	kfree(parser);
 	LeaveFunction(5);
 	return ret;
 
@@ -878,6 +832,7 @@ static struct tcp_vs_scheduler tcp_vs_chttp_scheduler = {
 	tcp_vs_chttp_done_svc,	/* done */
 	tcp_vs_chttp_update_svc,	/* update */
 	tcp_vs_chttp_schedule,	/* select a server by http request */
+	TCP_VS_SCHED_F_RULE_HEAP,	/* flags */
 };
 
 static int __init
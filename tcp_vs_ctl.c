@@ -22,6 +22,8 @@
 #include <linux/spinlock.h>
 #include <linux/sysctl.h>
 #include <linux/proc_fs.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
 
 #include <net/ip.h>
 #include <net/sock.h>
@@ -64,6 +66,9 @@ int sysctl_ktcpvs_max_backlog = 2048;
 int sysctl_ktcpvs_zerocopy_send = 0;
 int sysctl_ktcpvs_keepalive_timeout = 30;
 int sysctl_ktcpvs_read_timeout = 180;
+int sysctl_ktcpvs_multipart_limit = 64 * 1024 * 1024;
+int sysctl_ktcpvs_pipeline_depth = 4;
+int sysctl_ktcpvs_rule_reorder = 0;
 
 #ifdef CONFIG_TCP_VS_DEBUG
 static int sysctl_ktcpvs_debug_level = 0;
@@ -83,6 +88,74 @@ struct proc_dir_entry *proc_net_ktcpvs_vs_create(struct tcp_vs_service
 void proc_net_ktcpvs_vs_release(struct tcp_vs_service *svc);
 
 
+/* some route may try its rules by their hits, under the control mutex */
+static int tcp_vs_rules_ordered;
+
+/*
+ *  Publish new routing data after the lists of the service changed,
+ *  and free the old one once no scheduler can still be using it.
+ *  Called with the control mutex held, it may sleep.
+ */
+static int
+tcp_vs_update_route(struct tcp_vs_service *svc)
+{
+	struct tcp_vs_route *old = svc->route;
+	struct tcp_vs_route *route;
+
+	route = tcp_vs_route_build(svc);
+	if (route == NULL)
+		return -ENOMEM;
+	if (tcp_vs_route_reordered(route))
+		tcp_vs_rules_ordered = 1;
+
+	/* the connections are counted in the new heaps from now on, and
+	   the schedulers must see it filled in before they see it */
+	tcp_vs_heap_switch(svc, old, route);
+	smp_wmb();
+	svc->route = route;
+
+	synchronize_kernel();
+	tcp_vs_route_free(old);
+	return 0;
+}
+
+
+/*
+ *  Replace the client prefix table of the service, the rules on a tag
+ *  of the table see the new one at once. An empty table drops it.
+ *  Called with the control mutex held, it may sleep.
+ */
+static int
+tcp_vs_set_prefixes(struct tcp_vs_service *svc,
+		    const struct tcp_vs_prefix_u *p, int n)
+{
+	struct tcp_vs_lpm *old = svc->lpm;
+	struct tcp_vs_lpm *lpm = NULL;
+	int i;
+
+	EnterFunction(2);
+
+	for (i = 0; i < n; i++)
+		if (p[i].bits > 32 || p[i].tag == 0) {
+			TCP_VS_ERR("illegal prefix %u.%u.%u.%u/%u\n",
+				   NIPQUAD(p[i].addr), p[i].bits);
+			return -EINVAL;
+		}
+	if (n > 0 && !(lpm = tcp_vs_lpm_build(p, n)))
+		return -ENOMEM;
+
+	/* the schedulers must see it filled in before they see it */
+	smp_wmb();
+	svc->lpm = lpm;
+	svc->num_prefixes = n;
+
+	synchronize_kernel();
+	tcp_vs_lpm_free(old);
+	LeaveFunction(2);
+	return 0;
+}
+
+
 /*
  *  Lookup destination by {addr,port} in the given service
  */
@@ -144,10 +217,17 @@ tcp_vs_add_dest(struct tcp_vs_service *svc,
 		return -EFAULT;
 	}
 	memset(dest, 0, sizeof(tcp_vs_dest_t));
+	dest->cpu_conns = alloc_percpu(int);
+	if (dest->cpu_conns == NULL) {
+		TCP_VS_ERR("alloc_percpu failed.\n");
+		kfree(dest);
+		return -ENOMEM;
+	}
 
 	dest->addr = daddr;
 	dest->port = dport;
 	dest->weight = weight;
+	dest->svc = svc;
 
 	atomic_set(&dest->conns, 0);
 	atomic_set(&dest->refcnt, 0);
@@ -162,6 +242,16 @@ tcp_vs_add_dest(struct tcp_vs_service *svc,
 
 	write_unlock_bh(&svc->lock);
 
+	if (tcp_vs_update_route(svc)) {
+		write_lock_bh(&svc->lock);
+		list_del(&dest->n_list);
+		svc->num_dests--;
+		write_unlock_bh(&svc->lock);
+		free_percpu(dest->cpu_conns);
+		kfree(dest);
+		return -ENOMEM;
+	}
+
 	TCP_VS_DBG(2, "Add dest addr=%u.%u.%u.%u port=%u weight=%d\n",
 		   NIPQUAD(daddr), ntohs(dport), weight);
 
@@ -179,6 +269,7 @@ tcp_vs_edit_dest(struct tcp_vs_service *svc,
 		 __u32 daddr, __u16 dport, int weight)
 {
 	tcp_vs_dest_t *dest;
+	int old;
 
 	EnterFunction(2);
 
@@ -197,9 +288,19 @@ tcp_vs_edit_dest(struct tcp_vs_service *svc,
 	}
 
 	write_lock_bh(&svc->lock);
+	old = dest->weight;
 	dest->weight = weight;
 	write_unlock_bh(&svc->lock);
 
+	/* the heaps and the hash tables are built on the weights */
+	if (weight != old && tcp_vs_update_route(svc)) {
+		write_lock_bh(&svc->lock);
+		dest->weight = old;
+		write_unlock_bh(&svc->lock);
+		LeaveFunction(2);
+		return -ENOMEM;
+	}
+
 	LeaveFunction(2);
 
 	return 0;
@@ -218,20 +319,27 @@ __tcp_vs_del_dest(struct tcp_vs_service *svc, tcp_vs_dest_t * dest)
 	list_del(&dest->n_list);
 	/*  list_del(&dest->r_list); */
 	svc->num_dests--;
+}
 
+static inline void
+__tcp_vs_put_dest(tcp_vs_dest_t * dest)
+{
 	/*
 	 *  Decrease the refcnt of the dest, and free the dest
 	 *  if nobody refers to it (refcnt=0). Otherwise, throw
 	 *  the destination into the trash.
 	 */
-	if (atomic_dec_and_test(&dest->refcnt))
+	if (atomic_dec_and_test(&dest->refcnt)) {
+		free_percpu(dest->cpu_conns);
 		kfree(dest);
+	}
 }
 
 static int
 tcp_vs_del_dest(struct tcp_vs_service *svc, __u32 daddr, __u16 dport)
 {
 	tcp_vs_dest_t *dest;
+	struct list_head *prev;
 
 	EnterFunction(2);
 
@@ -256,33 +364,71 @@ tcp_vs_del_dest(struct tcp_vs_service *svc, __u32 daddr, __u16 dport)
 	/*
 	 *  Remove dest from the destination list
 	 */
+	prev = dest->n_list.prev;
 	__tcp_vs_del_dest(svc, dest);
 
+	write_unlock_bh(&svc->lock);
+
+	/*
+	 *  The schedulers may be using it until the new route is in
+	 */
+	if (tcp_vs_update_route(svc)) {
+		write_lock_bh(&svc->lock);
+		list_add(&dest->n_list, prev);
+		svc->num_dests++;
+		write_unlock_bh(&svc->lock);
+		return -ENOMEM;
+	}
+
 	/*
 	 *  Called the update_service function of its scheduler
 	 */
+	write_lock_bh(&svc->lock);
 	svc->scheduler->update_service(svc);
-
 	write_unlock_bh(&svc->lock);
 
+	__tcp_vs_put_dest(dest);
+
 	LeaveFunction(2);
 
 	return 0;
 }
 
 
+/* the rule of the given type, name and pattern */
+static inline int
+__tcp_vs_rule_is(struct tcp_vs_rule *r, int type, char *name, char *pattern)
+{
+	return r->type == type && !strcmp(r->name, name)
+	    && !strncmp(pattern, r->pattern, r->len);
+}
+
+
 static int
-tcp_vs_add_rule(struct tcp_vs_service *svc,
-		char *pattern, int matchnum, __u32 addr, __u16 port)
+tcp_vs_add_rule(struct tcp_vs_service *svc, int type, char *name,
+		char *pattern, int matchnum, int rewrite, int options,
+		int hash, __u32 addr, __u16 port)
 {
 	tcp_vs_dest_t *dest;
 	struct tcp_vs_rule *r;
 	struct list_head *l;
+	unsigned int *hits;
 	int rc = 0;
 
 	EnterFunction(2);
-	TCP_VS_DBG(2, "pattern=%s addr=%u.%u.%u.%u port=%u\n",
-		   pattern, NIPQUAD(addr), ntohs(port));
+	TCP_VS_DBG(2, "type=%d name=%s pattern=%s addr=%u.%u.%u.%u port=%u\n",
+		   type, name, pattern, NIPQUAD(addr), ntohs(port));
+
+	if (type < 0 || type > TCP_VS_RULE_MAX
+	    || ((type == TCP_VS_RULE_HEADER || type == TCP_VS_RULE_COOKIE)
+		!= (name[0] != '\0'))) {
+		TCP_VS_ERR("illegal rule type %d\n", type);
+		return -EINVAL;
+	}
+	if (hash < 0 || hash > TCP_VS_HASH_MAX) {
+		TCP_VS_ERR("illegal hash method %d\n", hash);
+		return -EINVAL;
+	}
 
 	/*
 	 *    Lookup the destination list
@@ -299,16 +445,33 @@ tcp_vs_add_rule(struct tcp_vs_service *svc,
 		return -EBUSY;
 	}
 
+	/* the hits of a new rule, alloc_percpu may sleep */
+	hits = alloc_percpu(unsigned int);
+	if (hits == NULL) {
+		TCP_VS_ERR("alloc_percpu failed.\n");
+		return -ENOMEM;
+	}
+
 	write_lock_bh(&svc->lock);
 
 	list_for_each(l, &svc->rule_list) {
 		r = list_entry(l, struct tcp_vs_rule, list);
-		if (!strncmp(pattern, r->pattern, r->len)) {
+		if (__tcp_vs_rule_is(r, type, name, pattern)) {
 			TCP_VS_DBG(2,
 				   "add server into an existing rule\n");
 			list_add(&dest->r_list, &r->destinations);
 			svc->num_rules++;
-			goto out;
+			write_unlock_bh(&svc->lock);
+			free_percpu(hits);
+			if (tcp_vs_update_route(svc)) {
+				write_lock_bh(&svc->lock);
+				list_del_init(&dest->r_list);
+				svc->num_rules--;
+				write_unlock_bh(&svc->lock);
+				rc = -ENOMEM;
+			}
+			LeaveFunction(2);
+			return rc;
 		}
 	}
 
@@ -320,17 +483,30 @@ tcp_vs_add_rule(struct tcp_vs_service *svc,
 	}
 	memset(r, 0, sizeof(struct tcp_vs_rule));
 	INIT_LIST_HEAD(&r->destinations);
+	r->hits = hits;
 
-	if (regcomp(&r->rx, pattern, REG_EXTENDED)) {
+	if (type == TCP_VS_RULE_SRC) {
+		if (tcp_vs_rule_prefix(pattern, &r->addr, &r->mask, &r->tag)) {
+			TCP_VS_ERR("illegal address/bits %s\n", pattern);
+			kfree(r);
+			rc = -EINVAL;
+			goto out;
+		}
+	} else if (regcomp(&r->rx, pattern, REG_EXTENDED)) {
 		TCP_VS_ERR("pattern compiling failed\n");
 		kfree(r);
 		rc = -EFAULT;
 		goto out;
 	}
 
+	r->type = type;
+	strcpy(r->name, name);
 	r->pattern = strdup(pattern);
 	r->len = strlen(pattern);
 	r->match_num = matchnum;
+	r->rewrite = rewrite;
+	r->options = options;
+	r->hash = hash;
 	list_add(&dest->r_list, &r->destinations);
 
 	/* add this new rule to rule_list finally */
@@ -339,53 +515,94 @@ tcp_vs_add_rule(struct tcp_vs_service *svc,
 	else
 		list_add_tail(&r->list, &svc->rule_list);
 	svc->num_rules++;
+	write_unlock_bh(&svc->lock);
+
+	if (tcp_vs_update_route(svc)) {
+		write_lock_bh(&svc->lock);
+		list_del(&r->list);
+		list_del_init(&dest->r_list);
+		svc->num_rules--;
+		write_unlock_bh(&svc->lock);
+		regfree(&r->rx);
+		free_percpu(r->hits);
+		kfree(r->pattern);
+		kfree(r);
+		rc = -ENOMEM;
+	}
+	LeaveFunction(2);
+	return rc;
 
       out:
 	write_unlock_bh(&svc->lock);
+	free_percpu(hits);
 	LeaveFunction(2);
 	return rc;
 }
 
 
 static int
-tcp_vs_del_rule(struct tcp_vs_service *svc,
+tcp_vs_del_rule(struct tcp_vs_service *svc, int type, char *name,
 		char *pattern, __u32 addr, __u16 port)
 {
 	tcp_vs_dest_t *dest;
 	struct tcp_vs_rule *r;
-	struct list_head *l, *d;
+	struct list_head *l, *d, *prev;
+	int release;
 
 	EnterFunction(2);
 
-	write_lock_bh(&svc->lock);
+	/* the control mutex keeps the lists from changing here */
 	list_for_each(l, &svc->rule_list) {
 		r = list_entry(l, struct tcp_vs_rule, list);
-		if (!strncmp(pattern, r->pattern, r->len)) {
+		if (__tcp_vs_rule_is(r, type, name, pattern)) {
 			TCP_VS_DBG(2, "found the rule\n");
 			goto hit;
 		}
 	}
-	write_unlock_bh(&svc->lock);
 	return -EEXIST;
 
       hit:
 	list_for_each(d, &r->destinations) {
 		dest = list_entry(d, tcp_vs_dest_t, r_list);
-		if (dest->addr == addr && dest->port == port) {
-			TCP_VS_DBG(2, "found the dest\n");
-			svc->num_rules--;
-			list_del_init(&dest->r_list);
-			if (list_empty(&r->destinations)) {
-				TCP_VS_DBG(2, "release the rule\n");
-				list_del(&r->list);
-				//regfree(&r->rx);
-				kfree(r->pattern);
-				kfree(r);
-			}
-			break;
-		}
+		if (dest->addr == addr && dest->port == port)
+			goto found;
 	}
+	LeaveFunction(2);
+	return 0;
+
+      found:
+	TCP_VS_DBG(2, "found the dest\n");
+
+	/* the rule goes away with its last server */
+	release = (d->next == &r->destinations
+		   && d->prev == &r->destinations);
+	prev = r->list.prev;
+
+	write_lock_bh(&svc->lock);
+	svc->num_rules--;
+	list_del_init(&dest->r_list);
+	if (release)
+		list_del(&r->list);
 	write_unlock_bh(&svc->lock);
+
+	if (tcp_vs_update_route(svc)) {
+		write_lock_bh(&svc->lock);
+		if (release)
+			list_add(&r->list, prev);
+		list_add(&dest->r_list, &r->destinations);
+		svc->num_rules++;
+		write_unlock_bh(&svc->lock);
+		LeaveFunction(2);
+		return -ENOMEM;
+	}
+
+	if (release) {
+		TCP_VS_DBG(2, "release the rule\n");
+		regfree(&r->rx);
+		free_percpu(r->hits);
+		kfree(r->pattern);
+		kfree(r);
+	}
 	LeaveFunction(2);
 	return 0;
 }
@@ -408,7 +625,8 @@ __tcp_vs_flush_rule(struct tcp_vs_service *svc)
 			dest = list_entry(d->next, tcp_vs_dest_t, r_list);
 			list_del_init(&dest->r_list);
 		}
-		//regfree(&r->rx);
+		regfree(&r->rx);
+		free_percpu(r->hits);
 		kfree(r->pattern);
 		kfree(r);
 	}
@@ -466,12 +684,18 @@ tcp_vs_add_service(struct tcp_vs_ident *ident, struct tcp_vs_config *conf)
 		svc->conf.maxClients = KTCPVS_CHILD_HARD_LIMIT;
 	svc->lock = RW_LOCK_UNLOCKED;
 
-	ret = tcp_vs_bind_scheduler(svc, sched);
-	if (ret != 0) {
-		kfree(svc);
-		goto out;
+	svc->route = tcp_vs_route_build(svc);
+	svc->rule_cache = tcp_vs_rule_cache_new();
+	if (!svc->route || !svc->rule_cache) {
+		TCP_VS_ERR("no available memory\n");
+		ret = -ENOMEM;
+		goto out_free;
 	}
 
+	ret = tcp_vs_bind_scheduler(svc, sched);
+	if (ret != 0)
+		goto out_free;
+
 	write_lock_bh(&__tcp_vs_svc_lock);
 	list_add(&svc->list, &tcp_vs_svc_list);
 	tcp_vs_num_services++;
@@ -481,13 +705,19 @@ tcp_vs_add_service(struct tcp_vs_ident *ident, struct tcp_vs_config *conf)
 	//tcp_vs_scheduler_put(sched);
 	LeaveFunction(2);
 	return ret;
+
+      out_free:
+	tcp_vs_rule_cache_free(svc->rule_cache);
+	tcp_vs_route_free(svc->route);
+	kfree(svc);
+	goto out;
 }
 
 
 static int
 tcp_vs_edit_service(struct tcp_vs_service *svc, struct tcp_vs_config *conf)
 {
-	struct tcp_vs_scheduler *sched;
+	struct tcp_vs_scheduler *sched, *old;
 
 	EnterFunction(2);
 
@@ -500,9 +730,21 @@ tcp_vs_edit_service(struct tcp_vs_service *svc, struct tcp_vs_config *conf)
 			     conf->sched_name);
 			return -ENOENT;
 		}
+		old = svc->scheduler;
 		tcp_vs_unbind_scheduler(svc);
 		tcp_vs_bind_scheduler(svc, sched);
 		//tcp_vs_scheduler_put(sched);
+
+		/* the round robin order and the heaps of the servers come
+		   with the route */
+		if (((old->flags ^ sched->flags)
+		     & (TCP_VS_SCHED_F_RR | TCP_VS_SCHED_F_HEAP
+			| TCP_VS_SCHED_F_RULE_HEAP))
+		    && tcp_vs_update_route(svc)) {
+			tcp_vs_unbind_scheduler(svc);
+			tcp_vs_bind_scheduler(svc, old);
+			return -ENOMEM;
+		}
 	}
 
 	memcpy(&svc->conf, conf, sizeof(*conf));
@@ -533,11 +775,16 @@ __tcp_vs_del_service(struct tcp_vs_service *svc)
 	for (l = &svc->destinations; l->next != l;) {
 		dest = list_entry(l->next, tcp_vs_dest_t, n_list);
 		__tcp_vs_del_dest(svc, dest);
+		__tcp_vs_put_dest(dest);
 	}
 	tcp_vs_unbind_scheduler(svc);
 	write_unlock_bh(&svc->lock);
 
+	/* it is not running, nobody is reading the route, the prefix
+	   table is freed by the caller once the lock is dropped */
 	list_del(&svc->list);
+	tcp_vs_route_free(svc->route);
+	tcp_vs_rule_cache_free(svc->rule_cache);
 	kfree(svc);
 	return 0;
 }
@@ -545,6 +792,7 @@ __tcp_vs_del_service(struct tcp_vs_service *svc)
 static int
 tcp_vs_del_service(struct tcp_vs_service *svc)
 {
+	struct tcp_vs_lpm *lpm = svc->lpm;
 	int ret;
 
 	EnterFunction(2);
@@ -552,6 +800,8 @@ tcp_vs_del_service(struct tcp_vs_service *svc)
 	write_lock_bh(&__tcp_vs_svc_lock);
 	ret = __tcp_vs_del_service(svc);
 	write_unlock_bh(&__tcp_vs_svc_lock);
+	if (!ret)
+		tcp_vs_lpm_free(lpm);
 
 	LeaveFunction(2);
 	return ret;
@@ -563,6 +813,7 @@ tcp_vs_flush(void)
 {
 	struct list_head *l;
 	struct tcp_vs_service *svc;
+	struct tcp_vs_lpm *lpm;
 	int ret = 0;
 
 	EnterFunction(2);
@@ -570,8 +821,14 @@ tcp_vs_flush(void)
 	write_lock_bh(&__tcp_vs_svc_lock);
 	for (l = &tcp_vs_svc_list; l->next != l;) {
 		svc = list_entry(l->next, struct tcp_vs_service, list);
+		lpm = svc->lpm;
 		if ((ret = __tcp_vs_del_service(svc)))
 			break;
+
+		/* vfree may not be called under the lock */
+		write_unlock_bh(&__tcp_vs_svc_lock);
+		tcp_vs_lpm_free(lpm);
+		write_lock_bh(&__tcp_vs_svc_lock);
 	}
 	write_unlock_bh(&__tcp_vs_svc_lock);
 
@@ -579,6 +836,53 @@ tcp_vs_flush(void)
 	return 0;
 }
 
+/*
+ *  Rebuild the routes whose rules left to regexec are no longer tried
+ *  in the order of their hits, every rule_reorder seconds, and halve
+ *  the hits so that the order follows the recent requests. Once
+ *  rule_reorder is switched off, the routes are rebuilt in list order
+ *  one last time and nothing is done after that. Called by the master
+ *  daemon, it may sleep.
+ */
+void
+tcp_vs_reorder_rules(void)
+{
+	static unsigned long last;
+	int reorder = sysctl_ktcpvs_rule_reorder;
+	struct tcp_vs_service *svc;
+	struct tcp_vs_rule *r;
+	struct list_head *l, *e;
+
+	if (reorder <= 0 && !tcp_vs_rules_ordered)
+		return;
+	if (time_before(jiffies, last + reorder * HZ))
+		return;
+
+	/* the control path goes first, try again on the next round */
+	if (down_trylock(&__tcp_vs_mutex))
+		return;
+	last = jiffies;
+
+	tcp_vs_rules_ordered = 0;
+	list_for_each(l, &tcp_vs_svc_list) {
+		svc = list_entry(l, struct tcp_vs_service, list);
+		if (tcp_vs_rule_reorder_due(svc->route)) {
+			TCP_VS_DBG(3, "reordering the rules of %s\n",
+				   svc->ident.name);
+			tcp_vs_update_route(svc);
+		}
+		if (tcp_vs_route_reordered(svc->route))
+			tcp_vs_rules_ordered = 1;
+		if (reorder > 0)
+			list_for_each(e, &svc->rule_list) {
+				r = list_entry(e, struct tcp_vs_rule, list);
+				tcp_vs_rule_halve_hits(r);
+			}
+	}
+	up(&__tcp_vs_mutex);
+}
+
+
 static int
 tcp_vs_start_all(void)
 {
@@ -621,12 +925,15 @@ do_tcp_vs_set_ctl(struct sock *sk, int cmd, void *user, unsigned int len)
 	struct tcp_vs_config *conf = NULL;
 	struct tcp_vs_dest_u *dest = NULL;
 	struct tcp_vs_rule_u *rule = NULL;
+	struct tcp_vs_set_prefixes set;
+	struct tcp_vs_prefix_u *prefixes = NULL;
 
 	if (!capable(CAP_NET_ADMIN))
 		return -EPERM;
 
-	/* len > 128000 is a sanity check */
-	if (len > 128000) {
+	/* len > 128000 is a sanity check, the prefix table is checked
+	   against its number of entries below */
+	if (len > 128000 && cmd != TCP_VS_SO_SET_PREFIXES) {
 		TCP_VS_ERR("do_tcp_vs_set_ctl: len > 128000\n");
 		return -EINVAL;
 	}
@@ -701,6 +1008,36 @@ do_tcp_vs_set_ctl(struct sock *sk, int cmd, void *user, unsigned int len)
 			ret = -EFAULT;
 			goto out;
 		}
+		rule->name[KTCPVS_RULE_NAMELEN - 1] = '\0';
+		break;
+
+	case TCP_VS_SO_SET_PREFIXES:
+		if (len < sizeof(ident) + sizeof(set)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (copy_from_user(&set, user, sizeof(set))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (set.num_prefixes > KTCPVS_PREFIXES_MAX
+		    || len != sizeof(ident) + sizeof(set)
+		    + set.num_prefixes * sizeof(*prefixes)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (set.num_prefixes == 0)
+			break;
+		if (!(prefixes = vmalloc(set.num_prefixes
+					 * sizeof(*prefixes)))) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (copy_from_user(prefixes, user + sizeof(set),
+				   set.num_prefixes * sizeof(*prefixes))) {
+			ret = -EFAULT;
+			goto out;
+		}
 		break;
 	}
 
@@ -738,13 +1075,15 @@ do_tcp_vs_set_ctl(struct sock *sk, int cmd, void *user, unsigned int len)
 		break;
 
 	case TCP_VS_SO_SET_ADDRULE:
-		ret = tcp_vs_add_rule(svc, rule->pattern, rule->match_num,
-				      rule->addr, rule->port);
+		ret = tcp_vs_add_rule(svc, rule->type, rule->name,
+				      rule->pattern, rule->match_num,
+				      rule->rewrite, rule->options,
+				      rule->hash, rule->addr, rule->port);
 		break;
 
 	case TCP_VS_SO_SET_DELRULE:
-		ret = tcp_vs_del_rule(svc, rule->pattern,
-				      rule->addr, rule->port);
+		ret = tcp_vs_del_rule(svc, rule->type, rule->name,
+				      rule->pattern, rule->addr, rule->port);
 		break;
 
 	case TCP_VS_SO_SET_START:
@@ -755,6 +1094,10 @@ do_tcp_vs_set_ctl(struct sock *sk, int cmd, void *user, unsigned int len)
 		svc->stop = 1;
 		break;
 
+	case TCP_VS_SO_SET_PREFIXES:
+		ret = tcp_vs_set_prefixes(svc, prefixes, set.num_prefixes);
+		break;
+
 	default:
 		ret = -EINVAL;
 	}
@@ -766,6 +1109,8 @@ do_tcp_vs_set_ctl(struct sock *sk, int cmd, void *user, unsigned int len)
 		kfree(dest);
 	if (rule)
 		kfree(rule);
+	if (prefixes)
+		vfree(prefixes);
 	up(&__tcp_vs_mutex);
 	//MOD_DEC_USE_COUNT;
 	return ret;
@@ -796,6 +1141,9 @@ __tcp_vs_get_service_entries(const struct tcp_vs_get_services *get,
 		entry.num_rules = svc->num_rules;
 		entry.conns = atomic_read(&svc->conns);
 		entry.running = atomic_read(&svc->running);
+		entry.num_prefixes = svc->num_prefixes;
+		tcp_vs_rule_cache_stats(svc, &entry.rule_hits,
+					&entry.rule_misses);
 		if (copy_to_user(&uptr->entrytable[count],
 				 &entry, sizeof(entry))) {
 			ret = -EFAULT;
@@ -830,7 +1178,7 @@ __tcp_vs_get_dest_entries(const struct tcp_vs_get_dests *get,
 			entry.addr = dest->addr;
 			entry.port = dest->port;
 			entry.weight = dest->weight;
-			entry.conns = atomic_read(&dest->conns);
+			entry.conns = tcp_vs_dest_conns(dest);
 			if (copy_to_user(&uptr->entrytable[count],
 					 &entry, sizeof(entry))) {
 				ret = -EFAULT;
@@ -872,9 +1220,16 @@ __tcp_vs_get_rule_entries(const struct tcp_vs_get_rules *get,
 			if (count >= get->num_rules)
 				goto out;
 			dest = list_entry(e, tcp_vs_dest_t, r_list);
+			entry.type = rule->type;
+			memcpy(entry.name, rule->name, sizeof(entry.name));
 			strcpy(entry.pattern, rule->pattern);
 			entry.len = rule->len;
 			entry.match_num = rule->match_num;
+			entry.rewrite = rule->rewrite;
+			entry.flags = rule->flags;
+			entry.options = rule->options;
+			entry.hash = rule->hash;
+			entry.hits = tcp_vs_rule_hits(rule);
 			entry.addr = dest->addr;
 			entry.port = dest->port;
 			if (copy_to_user(&uptr->entrytable[count],
@@ -974,6 +1329,9 @@ do_tcp_vs_get_ctl(struct sock *sk, int cmd, void *user, int *len)
 				get.num_rules = svc->num_rules;
 				get.conns = atomic_read(&svc->conns);
 				get.running = atomic_read(&svc->running);
+				get.num_prefixes = svc->num_prefixes;
+				tcp_vs_rule_cache_stats(svc, &get.rule_hits,
+							&get.rule_misses);
 				if (copy_to_user(user, &get, *len) != 0)
 					ret = -EFAULT;
 			} else
@@ -1065,6 +1423,15 @@ static ctl_table ktcpvs_table[] = {
 	{NET_KTCPVS_READ_TIMEOUT, "read_timeout",
 	 &sysctl_ktcpvs_read_timeout,
 	 sizeof(int), 0644, NULL, &proc_dointvec},
+	{NET_KTCPVS_MULTIPART_LIMIT, "multipart_limit",
+	 &sysctl_ktcpvs_multipart_limit,
+	 sizeof(int), 0644, NULL, &proc_dointvec},
+	{NET_KTCPVS_PIPELINE_DEPTH, "pipeline_depth",
+	 &sysctl_ktcpvs_pipeline_depth,
+	 sizeof(int), 0644, NULL, &proc_dointvec},
+	{NET_KTCPVS_RULE_REORDER, "rule_reorder",
+	 &sysctl_ktcpvs_rule_reorder,
+	 sizeof(int), 0644, NULL, &proc_dointvec},
 	{0}
 };
 
@@ -0,0 +1,305 @@
+/*
+ * KTCPVS       An implementation of the TCP Virtual Server daemon inside
+ *              kernel for the LINUX operating system. KTCPVS can be used
+ *              to build a moderately scalable and highly available server
+ *              based on a cluster of servers, with more flexibility.
+ *
+ * tcp_vs_hash.c: spreading the matches of a rule over its servers
+ *
+ * Version:     $Id: tcp_vs_hash.c,v 1.1 2005/03/02 10:14:21 wensong Exp $
+ *
+ * Authors:     Wensong Zhang <wensong@linuxvirtualserver.org>
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/in.h>
+#include <linux/jhash.h>
+#include <asm/div64.h>
+
+#include "tcp_vs.h"
+
+
+/*
+ * The hhttp and phttp schedulers send the requests with the same match
+ * of a rule to the same server, see TCP_VS_HASH_*. The modulo hash adds
+ * up the bytes of the match and takes the server by the sum modulo the
+ * number of servers, so adding or removing a server moves almost every
+ * match.
+ *
+ * The maglev hash is the lookup table of Maglev: every server of the
+ * rule fills the slots of a prime sized table in the order of its own
+ * permutation of them, taking turns with the others until the table is
+ * full, and a match goes to the server of the slot its jhash falls in.
+ * A server gets slots in proportion to its weight, and one coming or
+ * going only moves about its share of the slots. The table is built
+ * with the route whenever the servers of the rule or their weights
+ * change, a lookup is one jhash and one read.
+ *
+ * The rendezvous hash needs no table, it suits the rules with a few
+ * servers. The match gets a 64 bit hash, mixed with each server in turn
+ * into a number u in (0,1], and the server with the lowest -log2(u)
+ * divided by its weight wins, which is the highest random weight method
+ * with the weights of Schindelhauer and Schomaker. A server takes the
+ * matches in proportion to its weight, and one going away only moves
+ * its own matches, but a lookup costs a log2 for every server.
+ */
+#define HASH_EMPTY		0xffff
+#define HASH_SLOTS_PER_DEST	100	/* table size over number of servers */
+#define HASH_TURNS_MAX		64	/* most slots of a server per round */
+
+/* prime table sizes, each about twice the one before */
+static const int hash_primes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521, 0
+};
+
+
+/* the finalizer of MurmurHash3, every bit of x flips half of the result */
+static inline __u64
+hash_fmix64(__u64 x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* FNV-1a over 64 bits, then the finalizer to spread the last bytes */
+static __u64
+hash_key64(const char *key, int len)
+{
+	__u64 h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) key[i];
+		h *= 0x100000001b3ULL;
+	}
+	return hash_fmix64(h);
+}
+
+/*
+ *	-log2(h / 2^64) as a fixed point number with 32 bits of fraction,
+ *	h being taken as 1 if it is 0. The fraction of log2 of the mantissa
+ *	is found bit by bit by squaring it.
+ */
+static __u64
+hash_neglog2(__u64 h)
+{
+	__u64 m;
+	__u32 frac = 0;
+	int msb, i;
+
+	if (h == 0)
+		h = 1;
+	msb = (h >> 32) ? fls((__u32) (h >> 32)) + 31 : fls((__u32) h) - 1;
+	/* the mantissa in [1,2) with 31 bits of fraction */
+	m = (h << (63 - msb)) >> 32;
+	for (i = 31; i >= 0; i--) {
+		m = (m * m) >> 31;
+		if (m >= 1ULL << 32) {
+			m >>= 1;
+			frac |= 1U << i;
+		}
+	}
+	return ((__u64) (64 - msb) << 32) - frac;
+}
+
+/*
+ *	The server of weight above 0 with the lowest -log2(u)/weight, u
+ *	being the 64 bit hash k mixed with the server.
+ */
+static tcp_vs_dest_t *
+hash_rendezvous(struct tcp_vs_route_rule *rr, __u64 k)
+{
+	tcp_vs_dest_t *dest, *best = NULL;
+	__u64 score, low = 0;
+	int i;
+
+	for (i = 0; i < rr->ndests; i++) {
+		dest = rr->dests[i];
+		if (dest->weight <= 0)
+			continue;
+		/* below 2^38, room for 24 more bits before dividing */
+		score = hash_neglog2(hash_fmix64(k ^ ((__u64) dest->addr << 16
+						      ^ dest->port))) << 24;
+		do_div(score, dest->weight);
+		if (best == NULL || score < low) {
+			best = dest;
+			low = score;
+		}
+	}
+	return best;
+}
+
+
+static int
+hash_gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+
+/****************************************************************************
+*	Build the lookup table of a rule using TCP_VS_HASH_MAGLEV, the
+*	servers of weight 0 get no slots. Returns -ENOMEM if there is no
+*	memory, a rule without servers of weight above 0 gets no table.
+*/
+int
+tcp_vs_hash_build(struct tcp_vs_route_rule *rr)
+{
+	unsigned int *pos, *skip;
+	int *turns;
+	unsigned short *table;
+	tcp_vs_dest_t *dest;
+	int i, j, n = 0, g = 0, top = 0, size, filled, shift = 0;
+
+	EnterFunction(5);
+
+	rr->table = NULL;
+	rr->tsize = 0;
+	for (i = 0; i < rr->ndests; i++)
+		if (rr->dests[i]->weight > 0) {
+			n++;
+			g = hash_gcd(rr->dests[i]->weight, g);
+			if (rr->dests[i]->weight > top)
+				top = rr->dests[i]->weight;
+		}
+	if (n == 0)
+		return 0;
+
+	for (i = 0; hash_primes[i + 1]; i++)
+		if (hash_primes[i] >= n * HASH_SLOTS_PER_DEST)
+			break;
+	size = hash_primes[i];
+
+	/* keep the rounds short, the weights only matter relatively */
+	while ((top / g) >> shift > HASH_TURNS_MAX)
+		shift++;
+
+	table = kmalloc(size * sizeof(*table), GFP_KERNEL);
+	pos = kmalloc(rr->ndests * sizeof(*pos), GFP_KERNEL);
+	skip = kmalloc(rr->ndests * sizeof(*skip), GFP_KERNEL);
+	turns = kmalloc(rr->ndests * sizeof(*turns), GFP_KERNEL);
+	if (!table || !pos || !skip || !turns) {
+		TCP_VS_ERR("no memory for the hash table of rule %s\n",
+			   rr->rule->pattern);
+		kfree(table);
+		kfree(pos);
+		kfree(skip);
+		kfree(turns);
+		return -ENOMEM;
+	}
+
+	/* the permutation of a server only depends on its address, the
+	   skip is never 0 and the size is prime, so it visits every slot */
+	for (i = 0; i < rr->ndests; i++) {
+		dest = rr->dests[i];
+		pos[i] = jhash_2words(dest->addr, dest->port, 0x4d41474c)
+		    % size;
+		skip[i] = jhash_2words(dest->addr, dest->port, 0x534b4950)
+		    % (size - 1) + 1;
+		turns[i] = 0;
+		if (dest->weight > 0)
+			turns[i] = max((dest->weight / g) >> shift, 1);
+	}
+
+	for (i = 0; i < size; i++)
+		table[i] = HASH_EMPTY;
+	for (filled = 0; filled < size;) {
+		for (i = 0; i < rr->ndests && filled < size; i++) {
+			for (j = 0; j < turns[i] && filled < size; j++) {
+				while (table[pos[i]] != HASH_EMPTY)
+					pos[i] = (pos[i] + skip[i]) % size;
+				table[pos[i]] = i;
+				filled++;
+			}
+		}
+	}
+
+	kfree(pos);
+	kfree(skip);
+	kfree(turns);
+	rr->table = table;
+	rr->tsize = size;
+	TCP_VS_DBG(5, "hash table of %d slots for %d servers\n", size, n);
+	LeaveFunction(5);
+	return 0;
+}
+
+
+void
+tcp_vs_hash_free(struct tcp_vs_route_rule *rr)
+{
+	if (rr->table)
+		kfree(rr->table);
+	rr->table = NULL;
+}
+
+
+/****************************************************************************
+*	The server of the rule for the match key of len bytes, NULL if
+*	the rule has none.
+*/
+tcp_vs_dest_t *
+tcp_vs_hash_key(struct tcp_vs_route_rule *rr, const char *key, int len)
+{
+	unsigned int hash = 0;
+	int i;
+
+	if (rr->rule->hash == TCP_VS_HASH_MAGLEV) {
+		if (rr->table == NULL)
+			return NULL;
+		return rr->dests[rr->table[jhash(key, len, 0) % rr->tsize]];
+	}
+	if (rr->rule->hash == TCP_VS_HASH_RENDEZVOUS)
+		return hash_rendezvous(rr, hash_key64(key, len));
+
+	if (rr->ndests == 0)
+		return NULL;
+	for (i = 0; i < len; i++)
+		hash += (unsigned char) key[i];
+	TCP_VS_DBG(5, "hash value %u (c=%d)\n", hash, rr->ndests);
+	return rr->dests[hash % rr->ndests];
+}
+
+/*
+ *	The server of a rule on the client address, for the client addr in
+ *	network order.
+ */
+tcp_vs_dest_t *
+tcp_vs_hash_addr(struct tcp_vs_route_rule *rr, __u32 addr)
+{
+	if (rr->rule->hash == TCP_VS_HASH_MAGLEV) {
+		if (rr->table == NULL)
+			return NULL;
+		return rr->dests[rr->table[jhash_1word(addr, 0)
+					   % rr->tsize]];
+	}
+	if (rr->rule->hash == TCP_VS_HASH_RENDEZVOUS)
+		return hash_rendezvous(rr, hash_fmix64(addr));
+
+	if (rr->ndests == 0)
+		return NULL;
+	return rr->dests[ntohl(addr) % rr->ndests];
+}
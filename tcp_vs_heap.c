@@ -0,0 +1,275 @@
+/*
+ * KTCPVS       An implementation of the TCP Virtual Server daemon inside
+ *              kernel for the LINUX operating system. KTCPVS can be used
+ *              to build a moderately scalable and highly available server
+ *              based on a cluster of servers, with more flexibility.
+ *
+ * tcp_vs_heap.c: the connection counts of the servers and the least
+ *               connection heaps of the server lists
+ *
+ * Version:     $Id: tcp_vs_heap.c,v 1.1 2005/03/02 10:14:21 wensong Exp $
+ *
+ * Authors:     Wensong Zhang <wensong@linuxvirtualserver.org>
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/smp.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+
+#include "tcp_vs.h"
+
+
+/*
+ * Every server list of the route, the one of the service and the one
+ * of each rule, has room for a binary heap of its servers ordered by
+ * conns/weight, the least loaded on top, so the weighted least
+ * connection schedulers take it instead of scanning the list. Equal
+ * loads are ordered by the place in the list and the servers of weight
+ * 0 come last, the top is then the very server the scan found.
+ *
+ * Only the heaps the scheduler reads are kept, the one of the service
+ * for TCP_VS_SCHED_F_HEAP or those of the rules for
+ * TCP_VS_SCHED_F_RULE_HEAP, so a server is in one heap at most and
+ * knows its place there. Its connections are counted under the lock of
+ * that heap, which moves it up or down; the servers of other heaps are
+ * not held up. A server in no heap is counted with a bare atomic_inc.
+ * The heaps are built on the counts when the route is published; the
+ * heaps of the old route are left as they are for the schedulers still
+ * using it. Reading the top takes no lock, it is always some server of
+ * the list, if maybe not the least loaded while it is being moved.
+ */
+
+/* is the server at a less loaded than the one at b, a and b indexes of
+   the list, c1/w1 < c2/w2 being compared as c1*w2 < c2*w1 */
+static inline int
+heap_less(struct tcp_vs_heap *h, int a, int b)
+{
+	tcp_vs_dest_t *x = h->dests[a];
+	tcp_vs_dest_t *y = h->dests[b];
+	int lx, ly;
+
+	if (x->weight <= 0 || y->weight <= 0) {
+		if ((x->weight > 0) != (y->weight > 0))
+			return x->weight > 0;
+		return a < b;
+	}
+	lx = atomic_read(&x->conns) * y->weight;
+	ly = atomic_read(&y->conns) * x->weight;
+	if (lx != ly)
+		return lx < ly;
+	return a < b;
+}
+
+static inline void
+heap_set(struct tcp_vs_heap *h, int pos, int i)
+{
+	h->e[pos] = i;
+	h->dests[i]->hpos = pos;
+}
+
+/* move the entry at pos down to its place */
+static void
+heap_down(struct tcp_vs_heap *h, int pos)
+{
+	int i = h->e[pos];
+	int child;
+
+	while ((child = 2 * pos + 1) < h->n) {
+		if (child + 1 < h->n
+		    && heap_less(h, h->e[child + 1], h->e[child]))
+			child++;
+		if (!heap_less(h, h->e[child], i))
+			break;
+		heap_set(h, pos, h->e[child]);
+		pos = child;
+	}
+	heap_set(h, pos, i);
+}
+
+/* move the entry at pos up or down to its place */
+static void
+heap_fix(struct tcp_vs_heap *h, int pos)
+{
+	int i = h->e[pos];
+	int parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!heap_less(h, i, h->e[parent]))
+			break;
+		heap_set(h, pos, h->e[parent]);
+		pos = parent;
+	}
+	heap_set(h, pos, i);
+	heap_down(h, pos);
+}
+
+
+void
+tcp_vs_heap_init(struct tcp_vs_heap *h, tcp_vs_dest_t **dests, int n,
+		 int *e)
+{
+	int i;
+
+	h->n = n;
+	h->dests = dests;
+	h->e = e;
+	h->lock = SPIN_LOCK_UNLOCKED;
+	for (i = 0; i < n; i++)
+		e[i] = i;
+}
+
+/* take the servers of the list into the heap, from any heap of the old
+   route they were in, and order them */
+static void
+heap_build(struct tcp_vs_heap *h)
+{
+	struct tcp_vs_heap *o;
+	tcp_vs_dest_t *dest;
+	int i;
+
+	spin_lock(&h->lock);
+	for (i = 0; i < h->n; i++) {
+		dest = h->dests[i];
+		o = dest->heap;
+		if (o)
+			spin_lock(&o->lock);
+		dest->heap = h;
+		heap_set(h, i, i);
+		if (o)
+			spin_unlock(&o->lock);
+	}
+	for (i = h->n / 2 - 1; i >= 0; i--)
+		heap_down(h, i);
+	spin_unlock(&h->lock);
+}
+
+/* drop the servers still counted in a heap of the old route */
+static void
+heap_drop(struct tcp_vs_heap *h)
+{
+	int i;
+
+	spin_lock(&h->lock);
+	for (i = 0; i < h->n; i++)
+		if (h->dests[i]->heap == h)
+			h->dests[i]->heap = NULL;
+	spin_unlock(&h->lock);
+}
+
+
+/****************************************************************************
+*	Hand the servers over from the heaps of the old route to those of
+*	the new one the scheduler of the service reads, before the new
+*	route is published. Called with the control mutex held.
+*/
+void
+tcp_vs_heap_switch(struct tcp_vs_service *svc, struct tcp_vs_route *old,
+		   struct tcp_vs_route *route)
+{
+	unsigned int flags = svc->scheduler ? svc->scheduler->flags : 0;
+	int i;
+
+	if (flags & TCP_VS_SCHED_F_HEAP)
+		heap_build(&route->heap);
+	else if (flags & TCP_VS_SCHED_F_RULE_HEAP)
+		for (i = 0; i < route->nrules; i++)
+			heap_build(&route->rules[i].heap);
+	if (old) {
+		heap_drop(&old->heap);
+		for (i = 0; i < old->nrules; i++)
+			heap_drop(&old->rules[i].heap);
+	}
+}
+
+
+/*
+ *	Count a connection to the server, or one less, the schedulers
+ *	use these rather than touching dest->conns. The heap is looked up
+ *	under rcu_read_lock, the old route and its heaps are only freed
+ *	after a grace period; if the server changed heaps meanwhile, it
+ *	is looked up again. A count taken in no heap just as the server
+ *	is taken into one leaves it out of place until its next one.
+ */
+static inline void
+heap_count(tcp_vs_dest_t *dest, int delta)
+{
+	struct tcp_vs_heap *h;
+
+	rcu_read_lock();
+	for (;;) {
+		h = dest->heap;
+		if (h == NULL) {
+			atomic_add(delta, &dest->conns);
+			break;
+		}
+		spin_lock(&h->lock);
+		if (dest->heap == h) {
+			atomic_add(delta, &dest->conns);
+			heap_fix(h, dest->hpos);
+			spin_unlock(&h->lock);
+			break;
+		}
+		spin_unlock(&h->lock);
+	}
+	rcu_read_unlock();
+}
+
+void
+tcp_vs_dest_inc_conns(tcp_vs_dest_t *dest)
+{
+	heap_count(dest, 1);
+}
+
+void
+tcp_vs_dest_dec_conns(tcp_vs_dest_t *dest)
+{
+	heap_count(dest, -1);
+}
+
+
+/*
+ * A scheduler that does not look at the heaps can count its connections
+ * per CPU instead, with neither the lock nor the shared counter, and mark
+ * the connection with TCP_VS_CONN_F_CPU so that it is taken off the same
+ * way. A connection may end on another CPU than it started on, so the
+ * count of one CPU means nothing, only the sum does.
+ */
+void
+tcp_vs_dest_inc_cpu(tcp_vs_dest_t *dest)
+{
+	(*per_cpu_ptr(dest->cpu_conns, get_cpu()))++;
+	put_cpu();
+}
+
+void
+tcp_vs_dest_dec_cpu(tcp_vs_dest_t *dest)
+{
+	(*per_cpu_ptr(dest->cpu_conns, get_cpu()))--;
+	put_cpu();
+}
+
+/* all the connections to the server, however they are counted */
+int
+tcp_vs_dest_conns(tcp_vs_dest_t *dest)
+{
+	int cpu, n = atomic_read(&dest->conns);
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		n += *per_cpu_ptr(dest->cpu_conns, cpu);
+	}
+	return n;
+}
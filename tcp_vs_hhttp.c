@@ -36,6 +36,7 @@
 
 #include "tcp_vs.h"
 #include "tcp_vs_http_parser.h"
+#include "tcp_vs_http_trans.h"
 
 static int
 tcp_vs_hhttp_init_svc(struct tcp_vs_service *svc)
@@ -58,215 +59,50 @@ tcp_vs_hhttp_update_svc(struct tcp_vs_service *svc)
 }
 
 
-typedef enum http_methods {
-	METHOD_NONE,
-	METHOD_GET,
-	METHOD_HEAD,
-	METHOD_POST,
-	METHOD_PUT,
-	NR_METHODS
-} http_method_t;
-
-typedef enum http_versions {
-	NOTKNOWN,
-	HTTP_1_0,
-	HTTP_1_1
-} http_version_t;
-
-#define GOTO_INCOMPLETE							\
-do {									\
-	TCP_VS_DBG(5, "incomplete at %s:%d.\n", __FILE__, __LINE__);	\
-	goto incomplete_message;					\
-} while (0)
-
-#define GOTO_ERROR							\
-do {									\
-	TCP_VS_DBG(5, "parse error at %s:%d.\n", __FILE__, __LINE__);	\
-	goto error;							\
-} while (0)
-
-#define get_c(ptr,eob)				\
-({						\
-	if (ptr >= eob)				\
-		GOTO_INCOMPLETE;		\
-	*((ptr)++);				\
-})
-
-#define PARSE_TOKEN(ptr,str,eob)		\
-({						\
-	int __ret;				\
-						\
-	if (ptr+sizeof(str)-1 > eob) {		\
-		GOTO_INCOMPLETE;		\
-	}					\
-						\
-	if (memcmp(ptr, str, sizeof(str)-1))	\
-		__ret = 0;			\
-	else {					\
-		ptr += sizeof(str)-1;		\
-		__ret = 1;			\
-	}					\
-	__ret;					\
-})
-
-
-/*
- *      Parse HTTP header
- */
-int
-parse_hhttp_header(const char *buffer, size_t buflen, http_request_t * req)
-{
-	const char *curr, *eob;
-	char c;
-
-	EnterFunction(5);
-
-	TCP_VS_DBG(5, "parsing request:\n");
-	TCP_VS_DBG(5, "--------------------\n");
-	TCP_VS_DBG(5, "%s\n", buffer);
-	TCP_VS_DBG(5, "--------------------\n");
-
-	/* parse only the first header if multiple headers are present */
-
-	curr = buffer;
-	eob = buffer + buflen;
-
-	req->message = buffer;
-	req->message_len = buflen;
-
-	/*
-	 * RFC 2616, 5.1:
-	 *      Request-Line = Method SP Request-URI SP HTTP-Version CRLF
-	 */
-	switch (get_c(curr, eob)) {
-	case 'G':
-		if (PARSE_TOKEN(curr, "ET ", eob)) {
-			req->method = METHOD_GET;
-			break;
-		}
-		GOTO_ERROR;
-
-	case 'H':
-		if (PARSE_TOKEN(curr, "EAD ", eob)) {
-			req->method = METHOD_HEAD;
-			break;
-		}
-		GOTO_ERROR;
-
-	case 'P':
-		if (PARSE_TOKEN(curr, "OST ", eob)) {
-			req->method = METHOD_POST;
-			break;
-		}
-		if (PARSE_TOKEN(curr, "UT ", eob)) {
-			req->method = METHOD_PUT;
-			break;
-		}
-		GOTO_ERROR;
-
-	default:
-		GOTO_ERROR;
-	}
-	req->method_str = buffer;
-	req->method_len = curr - buffer - 1;
-
-	req->uri_str = curr;
-	while (1) {
-		c = get_c(curr, eob);
-		if (isspace(c))
-			break;
-	}
-	req->uri_len = curr - req->uri_str - 1;
-
-	req->version_str = curr;
-	if (PARSE_TOKEN(curr, "HTTP/1.", eob)) {
-		switch (get_c(curr, eob)) {
-		case '0':
-			req->version = HTTP_1_0;
-			break;
-		case '1':
-			req->version = HTTP_1_1;
-			break;
-		default:
-			GOTO_ERROR;
-		}
-	} else
-		GOTO_ERROR;
-
-	LeaveFunction(5);
-	return PARSE_OK;
-
-  incomplete_message:
-	LeaveFunction(5);
-	return PARSE_INCOMPLETE;
-
-  error:
-	LeaveFunction(5);
-	return PARSE_ERROR;
-}
-
-
 static tcp_vs_dest_t *
-tcp_vs_hhttp_matchrule(struct tcp_vs_service *svc, http_request_t * req)
+tcp_vs_hhttp_matchrule(struct tcp_vs_service *svc, struct tcp_vs_conn *conn,
+		       http_request_t * req)
 {
-	struct list_head *l;
+	struct tcp_vs_route_rule *rr;
 	struct tcp_vs_rule *r;
 	tcp_vs_dest_t *dest = NULL;
-	char *uri;
 	regmatch_t matches[10];
-	int hashvalue, num_dest;
 	int reg_err;
-	regoff_t start, end, p;
-	register struct list_head *e;
+	regoff_t start, end;
+	const char *s;
+	int len;
 
-	if (!(uri = kmalloc(req->uri_len + 1, GFP_KERNEL))) {
-		TCP_VS_ERR("No memory!\n");
-		return NULL;
+	TCP_VS_DBG(5, "matching request URI: %.*s\n",
+		   (int) req->uri_len, req->uri_str);
+
+	rcu_read_lock();
+	/* find the rule first, then get the submatches of that rule only */
+	rr = tcp_vs_match_rule(svc, conn, req);
+	if (rr == NULL)
+		goto found;
+	r = rr->rule;
+	/* a rule on the client address has no match, hash the address */
+	s = tcp_vs_rule_subject(r, conn, req, &len);
+	if (s == NULL) {
+		dest = tcp_vs_hash_addr(rr, conn->addr);
+		goto found;
 	}
-	memcpy(uri, req->uri_str, req->uri_len);
-	uri[req->uri_len] = '\0';
-	TCP_VS_DBG(5, "matching request URI: %s\n", uri);
-
-	read_lock(&svc->lock);
-	list_for_each(l, &svc->rule_list) {
-		r = list_entry(l, struct tcp_vs_rule, list);
-		memset(matches, 0, sizeof(regmatch_t) * 10); /* initialise the values */
-		reg_err = regexec(&r->rx, uri, 10, matches, 0); 
-		if (!reg_err) {
-			/* HIT */
-			TCP_VS_DBG(5, "URI matched pattern %s\n", r->pattern);
-			start = matches[r->match_num].rm_so;
-			end = matches[r->match_num].rm_eo;
-			if (start && end) {
-				num_dest = 0;
-				list_for_each(e, &r->destinations) {
-					num_dest++;
-				}
-				hashvalue = 0;
-				for (p = start; p < end; p++) {
-					hashvalue += uri[p];
-				}
-				TCP_VS_DBG(5, "hash value %d (c=%d)\n", hashvalue, num_dest);
-				if (num_dest) {
-					hashvalue %= num_dest;
-					list_for_each(e, &r->destinations) {
-						if (hashvalue == 0) {
-							dest = list_entry(e, tcp_vs_dest_t,  r_list);
-							goto found;
-						}
-						hashvalue--;
-					}
-				}
-			}
-			break;
-		} else {
-			TCP_VS_DBG(6,"regexec return code is <%d>\n", reg_err);
-		}
+	memset(matches, 0, sizeof(regmatch_t) * 10); /* initialise the values */
+	reg_err = tcp_vs_rule_exec(r, s, len, 10, matches);
+	if (!reg_err) {
+		/* HIT */
+		TCP_VS_DBG(5, "request matched pattern %s\n", r->pattern);
+		start = matches[r->match_num].rm_so;
+		end = matches[r->match_num].rm_eo;
+		/* rm_so is -1 if the subexpression took no part */
+		if (start >= 0)
+			dest = tcp_vs_hash_key(rr, s + start, end - start);
+	} else {
+		TCP_VS_DBG(6,"regexec return code is <%d>\n", reg_err);
 	}
   found:
-	read_unlock(&svc->lock);
+	rcu_read_unlock();
 
-	kfree(uri);
 	return dest;
 }
 
@@ -281,15 +117,14 @@ tcp_vs_hhttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 {
 	tcp_vs_dest_t *dest;
 	struct socket *csock, *dsock;
-	char *buffer;
-	size_t buflen;
-	int len;
+	http_read_ctl_block_t read_ctl_blk;
+	http_buf_t buff;
+	http_parser_t *parser;
 	http_request_t req;
+	int len, ret = -1;
 
 	EnterFunction(5);
 
-	buffer = conn->buffer;
-	buflen = conn->buflen;
 	csock = conn->csock;
 
 	/* Do we have data ? */
@@ -297,34 +132,52 @@ tcp_vs_hhttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 		interruptible_sleep_on_timeout(&csock->wait, HZ);
 	}
 
-	/* fixme: what if the request overlap this receiving buffer */
-	len = tcp_vs_recvbuffer(csock, buffer, buflen - 1, MSG_PEEK);
-	if (len < 0) {
-		TCP_VS_ERR_RL("error reading request from client\n");
+	if (!(parser = kmalloc(sizeof(http_parser_t), GFP_KERNEL))) {
+		TCP_VS_ERR("No memory!\n");
 		return -1;
-	} else if (len == 0) {
-		/* some clients may connect and disconnect immediately */
-		return 0;
 	}
 
-	/* make it zero-terminated string */
-	buffer[len] = '\0';
-
-	if (parse_hhttp_header(buffer, len, &req) != PARSE_OK) {
-		TCP_VS_ERR_RL("cannot parse http request\n");
-
-		/* should redirect it to a local port next time */
-		return -1;
+	/* peek the request into the connection buffer */
+	INIT_LIST_HEAD(&buff.b_list);
+	buff.buf = conn->buffer;
+	buff.data_len = 0;
+
+	memset(&read_ctl_blk, 0, sizeof(read_ctl_blk));
+	INIT_LIST_HEAD(&read_ctl_blk.buf_entry_list);
+	read_ctl_blk.cur_buf = &buff;
+	read_ctl_blk.buf_size = conn->buflen;
+	read_ctl_blk.sock = csock;
+	read_ctl_blk.flag = MSG_PEEK;
+	list_add(&buff.b_list, &read_ctl_blk.buf_entry_list);
+
+	/* the request line is enough to select a server, unless a rule
+	   looks at the Host, a header or a cookie */
+	http_parser_init(parser, tcp_vs_route_headers(svc)
+			 ? 0 : HTTP_PARSE_LINE_ONLY);
+	len = http_read_header(&read_ctl_blk, parser);
+	if (len < 0) {
+		if (read_ctl_blk.remaining == 0) {
+			/* some clients may connect and disconnect
+			   immediately */
+			ret = 0;
+		} else {
+			/* should redirect it to a local port next time */
+			TCP_VS_ERR_RL("cannot parse http request\n");
+		}
+		goto out;
 	}
 
+	memset(&req, 0, sizeof(req));
+	http_parser_request(parser, read_ctl_blk.info, &req);
+
 	/*  Head.RemoteHost.s_addr = sock->sk->daddr; */
 
-	dest = tcp_vs_hhttp_matchrule(svc, &req);
+	dest = tcp_vs_hhttp_matchrule(svc, conn, &req);
 	//if (!dest)
 	//	return -1;
 	if (!dest) {
 		TCP_VS_ERR_RL("Can't match regex, maybe is regex error!\n");
-		return -1;
+		goto out;
 	}
 
 	TCP_VS_DBG(5, "HTTP: server %d.%d.%d.%d:%d "
@@ -336,21 +189,26 @@ tcp_vs_hhttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 	dsock = tcp_vs_connect2dest(dest);
 	if (!dsock) {
 		TCP_VS_ERR_RL("The destination is not available\n");
-		return -1;
+		goto out;
 	}
 
-	atomic_inc(&dest->conns);
+	tcp_vs_dest_inc_conns(dest);
 	conn->dest = dest;
 	conn->dsock = dsock;
 
 /*
- *	if (tcp_vs_sendbuffer(dsock, buffer, len, 0) != len) {
+ *	if (tcp_vs_sendbuffer(dsock, conn->buffer, read_ctl_blk.remaining, 0)
+	    != read_ctl_blk.remaining) {
  *		TCP_VS_ERR_RL("Error HTTP sending buffer\n");
  *	}
  */
-	LeaveFunction(5);
+	ret = 0;
 
-	return 0;
+  out:
+	http_read_release(&read_ctl_blk);
+	kfree(parser);
+	LeaveFunction(5);
+	return ret;
 }
 
 
@@ -368,6 +226,7 @@ static struct tcp_vs_scheduler tcp_vs_hhttp_scheduler = {
 static int __init
 tcp_vs_hhttp_init(void)
 {
+	http_mime_parser_init();
 	INIT_LIST_HEAD(&tcp_vs_hhttp_scheduler.n_list);
 	return register_tcp_vs_scheduler(&tcp_vs_hhttp_scheduler);
 }
@@ -32,15 +32,25 @@ const char *http_version_header = "HTTP/";
 #define DEFAULT_MAX_COOKIE_AGE	1800
 #define MAX_MIME_HEADER_STRING_LEN	64
 
-typedef void (*HTTP_MIME_PARSER) (http_mime_header_t * mime, char *buffer);
+#define MAX_MIME_PARSERS	32	/* registered mime header parsers */
+#define MIME_HASH_MIN_SIZE	32
+#define MIME_HASH_MAX_SIZE	256	/* must be a power of 2 */
+#define MIME_HASH_SEED_TRIES	4096	/* seeds to try for each size */
 
 typedef struct http_mime_parse_s {
-	struct list_head plist;
 	HTTP_MIME_PARSER parser;
+	int len;
 	char mime_header_string[MAX_MIME_HEADER_STRING_LEN];
 } http_mime_parse_t;
 
-static http_mime_parse_t http_mime_parse_table[MAX_MIME_HEADER_STRING_LEN];
+static http_mime_parse_t http_mime_parsers[MAX_MIME_PARSERS];
+static int http_mime_nr_parsers;
+
+/* perfect hash over the registered mime header names */
+static http_mime_parse_t *http_mime_hash_table[MIME_HASH_MAX_SIZE];
+static unsigned int http_mime_hash_mask;
+static unsigned int http_mime_hash_seed;
+static int http_mime_hash_full;	/* hash all bytes of the names */
 
 
 /****************************************************************************
@@ -58,21 +68,97 @@ skip_lws(const char *buffer)
 }
 
 
+/****************************************************************************
+*	word-at-a-time byte search
+*
+*   A long is compared with a byte repeated in every position, a byte
+*   equal to it turns into zero, and a word contains a zero byte iff
+*   (x - 0x01..01) & ~x & 0x80..80 is not zero. Only the word that hits
+*   is looked at byte by byte, so the result does not depend on the byte
+*   order. Words are read aligned and never beyond the end of the data.
+*/
+#define WORD_ONES		(~0UL / 0xff)
+#define WORD_HIGHS		(WORD_ONES << 7)
+#define WORD_REPEAT(c)		(WORD_ONES * (unsigned char) (c))
+#define WORD_HAS_ZERO(x)	(((x) - WORD_ONES) & ~(x) & WORD_HIGHS)
+
+static inline const char *
+find_byte2(const char *s, const char *end, char c1, char c2)
+{
+	unsigned long m1, m2, w;
+
+	/* the bytes before the first aligned word */
+	for (; s < end && ((unsigned long) s & (sizeof(long) - 1)); s++) {
+		if (*s == c1 || *s == c2)
+			return s;
+	}
+
+	m1 = WORD_REPEAT(c1);
+	m2 = WORD_REPEAT(c2);
+	for (; s + sizeof(long) <= end; s += sizeof(long)) {
+		w = *(const unsigned long *) s;
+		if (WORD_HAS_ZERO(w ^ m1) | WORD_HAS_ZERO(w ^ m2))
+			break;
+	}
+
+	for (; s < end; s++) {
+		if (*s == c1 || *s == c2)
+			return s;
+	}
+	return NULL;
+}
+
+
+/****************************************************************************
+*	search the first CR or LF in a string
+*/
+char *
+http_find_eol(const char *s, int len)
+{
+	if (len <= 0)
+		return NULL;
+	return (char *) find_byte2(s, s + len, CR, LF);
+}
+
+
+/****************************************************************************
+*	search the first CRLF in a string
+*/
+char *
+http_find_crlf(const char *s, int len)
+{
+	const char *end = s + len - 1;	/* the last possible CR */
+
+	while (s < end) {
+		if (!(s = find_byte2(s, end, CR, CR)))
+			break;
+		if (s[1] == LF)
+			return (char *) s;
+		s++;
+	}
+	return NULL;
+}
+
+
 /****************************************************************************
 *	search the seperator in a string
 */
 char *
 search_sep(const char *s, int len, const char *sep)
 {
-	int l, ll;
+	const char *end;
+	int l;
 
 	l = strlen(sep);
 	if (!l)
 		return (char *) s;
 
-	ll = len;
-	while (ll >= l) {
-		ll--;
+	/* look for the first byte of the separator word-at-a-time, and
+	   compare the rest where it hits */
+	end = s + len - l + 1;
+	while (s < end) {
+		if (!(s = find_byte2(s, end, sep[0], sep[0])))
+			break;
 		if (!memcmp(s, sep, l))
 			return (char *) s;
 		s++;
@@ -81,6 +167,97 @@ search_sep(const char *s, int len, const char *sep)
 }
 
 
+/****************************************************************************
+*	Streaming search for a separator
+*
+*   The separator is looked for with Boyer-Moore-Horspool in each buffer
+*   as it is read. The last bytes of the previous buffer are carried, so
+*   a separator split across two buffers is found too.
+*/
+http_sep_t *
+http_sep_new(const char *sep, int len)
+{
+	http_sep_t *sp;
+	int i;
+
+	if (len <= 0)
+		return NULL;
+
+	/* the separator and room for the carried bytes and the start
+	   of the next buffer */
+	sp = kmalloc(sizeof(http_sep_t) + 3 * len, GFP_KERNEL);
+	if (sp == NULL)
+		return NULL;
+
+	sp->pat = (char *) (sp + 1);
+	sp->carry = sp->pat + len;
+	sp->len = len;
+	sp->carry_len = 0;
+	memcpy(sp->pat, sep, len);
+
+	for (i = 0; i < 256; i++)
+		sp->shift[i] = len;
+	for (i = 0; i < len - 1; i++)
+		sp->shift[(unsigned char) sep[i]] = len - 1 - i;
+	return sp;
+}
+
+
+static const char *
+horspool(http_sep_t * sp, const char *s, int len)
+{
+	const char *end = s + len - sp->len;
+	int last = sp->len - 1;
+	unsigned char c;
+
+	while (s <= end) {
+		c = s[last];
+		if (c == (unsigned char) sp->pat[last]
+		    && !memcmp(s, sp->pat, last))
+			return s;
+		s += sp->shift[c];
+	}
+	return NULL;
+}
+
+
+/*
+ *	Returns the number of bytes of data up to the end of the separator,
+ *	or -1 if the separator does not end in data.
+ */
+int
+http_sep_scan(http_sep_t * sp, const char *data, int len)
+{
+	const char *pos;
+	int n, keep;
+
+	/* a separator that starts in the carried bytes */
+	if (sp->carry_len > 0) {
+		n = MIN(len, sp->len - 1);
+		memcpy(sp->carry + sp->carry_len, data, n);
+		pos = horspool(sp, sp->carry, sp->carry_len + n);
+		if (pos != NULL)
+			return pos - sp->carry + sp->len - sp->carry_len;
+	}
+
+	if ((pos = horspool(sp, data, len)) != NULL)
+		return pos - data + sp->len;
+
+	/* carry the bytes that may start a separator */
+	keep = sp->len - 1;
+	if (len >= keep) {
+		memcpy(sp->carry, data + len - keep, keep);
+	} else {
+		n = MIN(sp->carry_len, keep - len);
+		memmove(sp->carry, sp->carry + sp->carry_len - n, n);
+		memcpy(sp->carry + n, data, len);
+		keep = n + len;
+	}
+	sp->carry_len = keep;
+	return -1;
+}
+
+
 /****************************************************************************
 *	extract the attribute-value pair
 *	The input string has the form: A = "V", and it will also accept
@@ -334,6 +511,152 @@ get_chunk_size(char *b)
 	return chunksize;
 }
 
+
+/****************************************************************************
+*  Incremental scanner for the chunked transfer-coding.
+*
+*  Only the framing bytes are looked at, the chunk data is skipped by
+*  its size, so a body can be relayed in the buffers it is read in.
+*/
+enum {
+	c_size = 0,		/* chunk-size digits */
+	c_ext,			/* chunk-extension, up to LF */
+	c_data_cr,		/* CRLF after chunk-data */
+	c_data_lf,
+	c_trailer,		/* start of a trailer line */
+	c_trailer_line,		/* trailer line, up to LF */
+	c_trailer_lf,		/* LF of the empty line */
+	c_data = HTTP_CHUNK_DATA,	/* chunk-data */
+	c_done = HTTP_CHUNK_DONE
+};
+
+/* the chunk-size has to stay below LONG_MAX */
+#define CHUNK_SIZE_OVERFLOW	(~0UL << (sizeof(long) * 8 - 5))
+
+void
+http_chunk_init(http_chunk_t * chunk)
+{
+	chunk->state = c_size;
+	chunk->size = 0;
+	chunk->digits = 0;
+}
+
+
+/****************************************************************************
+*  Account for n bytes of chunk-data passed on without scanning them,
+*  n must not be more than http_chunk_data().
+*/
+void
+http_chunk_skip(http_chunk_t * chunk, unsigned long n)
+{
+	chunk->size -= n;
+	if (chunk->size == 0)
+		chunk->state = c_data_cr;
+}
+
+
+/****************************************************************************
+*  Scan len bytes of a chunked body.
+*
+*  Returns the number of bytes that belong to the body, which is less
+*  than len only if the end of the body is in data, or -1 if the
+*  framing is broken. http_chunk_done() tells if the body is complete.
+*/
+int
+http_chunk_scan(http_chunk_t * chunk, const char *data, int len)
+{
+	const char *p = data, *end = data + len, *q;
+	unsigned long n;
+	int c;
+
+	while (p < end) {
+		switch (chunk->state) {
+		case c_size:
+			c = *p;
+			if (c >= '0' && c <= '9')
+				c -= '0';
+			else if (c >= 'a' && c <= 'f')
+				c -= 'a' - 10;
+			else if (c >= 'A' && c <= 'F')
+				c -= 'A' - 10;
+			else {
+				if (chunk->digits == 0)
+					return -1;
+				chunk->state = c_ext;
+				break;
+			}
+			if (chunk->size & CHUNK_SIZE_OVERFLOW)
+				return -1;
+			chunk->size = (chunk->size << 4) | c;
+			chunk->digits++;
+			p++;
+			break;
+
+		case c_ext:
+			if (!(q = memchr(p, LF, end - p)))
+				return len;
+			p = q + 1;
+			chunk->state = chunk->size ? c_data : c_trailer;
+			break;
+
+		case c_data:
+			n = end - p;
+			if (n > chunk->size)
+				n = chunk->size;
+			p += n;
+			chunk->size -= n;
+			if (chunk->size == 0)
+				chunk->state = c_data_cr;
+			break;
+
+		case c_data_cr:
+			if (*p == CR) {
+				p++;
+				chunk->state = c_data_lf;
+				break;
+			}
+			/* fall through, a bare LF is tolerated */
+		case c_data_lf:
+			if (*p++ != LF)
+				return -1;
+			chunk->digits = 0;
+			chunk->state = c_size;
+			break;
+
+		case c_trailer:
+			if (*p == CR) {
+				p++;
+				chunk->state = c_trailer_lf;
+				break;
+			}
+			if (*p == LF) {
+				p++;
+				chunk->state = c_done;
+				return p - data;
+			}
+			chunk->state = c_trailer_line;
+			/* fall through */
+		case c_trailer_line:
+			if (!(q = memchr(p, LF, end - p)))
+				return len;
+			p = q + 1;
+			chunk->state = c_trailer;
+			break;
+
+		case c_trailer_lf:
+			if (*p++ != LF)
+				return -1;
+			chunk->state = c_done;
+			return p - data;
+
+		default:
+			return p - data;
+		}
+	}
+
+	return len;
+}
+
 /****************************************************************************
  *
  *  This routine is borrowed from apache server
@@ -370,7 +693,7 @@ lookup_builtin_method(const char *method, int len)
 			return (method[1] == 'E'
 				&& method[2] == 'A'
 				&& method[3] == 'D'
-				? HTTP_M_GET : HTTP_M_UNKNOWN);
+				? HTTP_M_HEAD : HTTP_M_UNKNOWN);
 		case 'P':
 			return (method[1] == 'O'
 				&& method[2] == 'S'
@@ -716,44 +1039,168 @@ http_line_unescape(char *string,	/* escaped string to unescape */
 }
 #endif
 
+/****************************************************************************
+*
+* mime_hash - case-insensitive hash of a mime header name
+*
+*   FNV-1a over the bytes with the 0x20 bit set, which folds the case of
+*   letters and leaves '-' and digits alone. Usually the length with the
+*   first, middle and last bytes already tell the names apart, then only
+*   those are hashed; all bytes are hashed only when they do not.
+*/
+static inline unsigned int
+mime_hash(const char *name, int len, unsigned int seed)
+{
+	unsigned int h = seed ^ len;
+
+	if (http_mime_hash_full) {
+		while (len-- > 0)
+			h = (h ^ (*name++ | 0x20)) * 0x01000193;
+	} else {
+		h = (h ^ (name[0] | 0x20)) * 0x01000193;
+		h = (h ^ (name[len >> 1] | 0x20)) * 0x01000193;
+		h = (h ^ (name[len - 1] | 0x20)) * 0x01000193;
+	}
+	return h ^ (h >> 16);
+}
+
+
+/****************************************************************************
+*
+* build_mime_hash - find a seed that hashes every registered name into a
+*                   slot of its own
+*
+*   The table starts at four times the number of parsers and is doubled
+*   when no seed works. It is only rebuilt when a parser is registered.
+*/
+static int
+build_mime_hash(void)
+{
+	http_mime_parse_t *pe;
+	unsigned int size, seed, slot;
+	int i;
+
+	for (http_mime_hash_full = 0; http_mime_hash_full < 2;
+	     http_mime_hash_full++) {
+		for (size = MIME_HASH_MIN_SIZE; size <= MIME_HASH_MAX_SIZE;
+		     size <<= 1) {
+			/* keep most slots empty, misses are the common case */
+			if (size < 4 * http_mime_nr_parsers)
+				continue;
+			for (seed = 1; seed <= MIME_HASH_SEED_TRIES; seed++) {
+				memset(http_mime_hash_table, 0,
+				       sizeof(http_mime_hash_table));
+				for (i = 0; i < http_mime_nr_parsers; i++) {
+					pe = &http_mime_parsers[i];
+					slot = mime_hash(pe->mime_header_string,
+							 pe->len, seed)
+					    & (size - 1);
+					if (http_mime_hash_table[slot])
+						break;
+					http_mime_hash_table[slot] = pe;
+				}
+				if (i == http_mime_nr_parsers)
+					goto found;
+			}
+		}
+	}
+
+	TCP_VS_ERR("Cannot build the mime header hash table\n");
+	return -1;
+
+      found:
+	http_mime_hash_seed = seed;
+	http_mime_hash_mask = size - 1;
+	TCP_VS_DBG(5, "mime hash: %d names, size %u, seed %u, full %d\n",
+		   i, size, seed, http_mime_hash_full);
+	return 0;
+}
+
+
+/****************************************************************************
+*
+* http_mime_lookup - find the parser registered for a mime header name
+*
+*   One hash, one slot and one compare, there are no collision chains.
+*   The lengths are compared first, so most misses are not compared.
+*/
+static http_mime_parse_t *
+http_mime_lookup(const char *name, int len)
+{
+	http_mime_parse_t *pe;
+
+	if (len <= 0 || len >= MAX_MIME_HEADER_STRING_LEN)
+		return NULL;
+
+	pe = http_mime_hash_table[mime_hash(name, len, http_mime_hash_seed)
+				  & http_mime_hash_mask];
+	if (pe != NULL && pe->len == len
+	    && strnicmp(pe->mime_header_string, name, len) == 0)
+		return pe;
+	return NULL;
+}
+
 /****************************************************************************
 *
 * register_mime_parser - register a http mime header parser
 *
+*   The parser is called with the value of the header, leading and
+*   trailing LWS stripped. The value is not NUL terminated.
+*   Registering is not synchronized with parsing, it is meant to be
+*   done when a scheduler module is loaded.
+*
+*   Return 0 on success, or -1 if failed.
 */
-static void
-register_mime_parser(HTTP_MIME_PARSER parser, char *mime_str)
+int
+register_mime_parser(HTTP_MIME_PARSER parser, const char *mime_str)
 {
-	int index;
-	http_mime_parse_t *parse_entry, *new_entry;
+	http_mime_parse_t *parse_entry;
+	int len;
 
 	assert(parser != NULL);
 	assert(mime_str != NULL);
 
-	index = strlen(mime_str);
-	if (index >= MAX_MIME_HEADER_STRING_LEN)
-		return;
+	len = strlen(mime_str);
+	if (len == 0 || len >= MAX_MIME_HEADER_STRING_LEN)
+		return -1;
 
-	parse_entry = &http_mime_parse_table[index];
-	if (parse_entry->parser == NULL) {
-		INIT_LIST_HEAD(&parse_entry->plist);
-	} else {
-		if (strnicmp
-		    (mime_str, parse_entry->mime_header_string,
-		     index) == 0) {
-			return;
-		}
-		new_entry = kmalloc(sizeof(http_mime_parse_t), GFP_KERNEL);
-		if (new_entry == NULL) {
-			TCP_VS_ERR("Out of memory!\n");
-			return;
-		}
-		list_add_tail(&new_entry->plist, &parse_entry->plist);
-		parse_entry = new_entry;
+	if (http_mime_lookup(mime_str, len) != NULL)
+		return 0;	/* already registered */
+
+	if (http_mime_nr_parsers == MAX_MIME_PARSERS) {
+		TCP_VS_ERR("Too many mime header parsers\n");
+		return -1;
 	}
 
+	parse_entry = &http_mime_parsers[http_mime_nr_parsers++];
 	strcpy(parse_entry->mime_header_string, mime_str);
+	parse_entry->len = len;
 	parse_entry->parser = parser;
+
+	if (build_mime_hash() != 0) {
+		http_mime_nr_parsers--;
+		build_mime_hash();
+		return -1;
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+*
+* mime_value_dup - copy a header value into a NUL terminated string
+*
+*/
+static char *
+mime_value_dup(const char *value, int len)
+{
+	char *s;
+
+	if ((s = kmalloc(len + 1, GFP_KERNEL)) == NULL)
+		return NULL;
+	memcpy(s, value, len);
+	s[len] = 0;
+	return s;
 }
 
 /****************************************************************************
@@ -762,11 +1209,12 @@ register_mime_parser(HTTP_MIME_PARSER parser, char *mime_str)
 *
 */
 static void
-transfer_encoding_parser(http_mime_header_t * mime, char *buffer)
+transfer_encoding_parser(http_mime_header_t * mime, const char *value,
+			 int len)
 {
 	EnterFunction(6);
 
-	if (strnicmp(buffer, "chunked", 7) == 0) {
+	if (len >= 7 && strnicmp(value, "chunked", 7) == 0) {
 		mime->transfer_encoding = 1;
 		TCP_VS_DBG(6, "Transfer-Encoding: chunked\n");
 	}
@@ -782,11 +1230,16 @@ transfer_encoding_parser(http_mime_header_t * mime, char *buffer)
 *
 */
 static void
-content_length_parser(http_mime_header_t * mime, char *buffer)
+content_length_parser(http_mime_header_t * mime, const char *value,
+		      int len)
 {
+	int n = 0;
+
 	EnterFunction(6);
 
-	mime->content_length = strtol(buffer, NULL, 10);
+	while (len-- > 0 && isdigit(*value))
+		n = n * 10 + (*value++ - '0');
+	mime->content_length = n;
 	TCP_VS_DBG(6, "Content-Length: %d\n", mime->content_length);
 
 	LeaveFunction(6);
@@ -800,11 +1253,11 @@ content_length_parser(http_mime_header_t * mime, char *buffer)
 *
 */
 static void
-connection_parser(http_mime_header_t * mime, char *buffer)
+connection_parser(http_mime_header_t * mime, const char *value, int len)
 {
 	EnterFunction(6);
 
-	if (strnicmp(buffer, "close", 5) == 0) {
+	if (len >= 5 && strnicmp(value, "close", 5) == 0) {
 		mime->connection_close = 1;
 		TCP_VS_DBG(5, "Connection: close\n");
 	}
@@ -817,38 +1270,39 @@ connection_parser(http_mime_header_t * mime, char *buffer)
 *
 * content_type_parser - http mime header parser for "Content-type"
 *
-* Note: buffer should be a NULL terminated string.
 */
 static void
-content_type_parser(http_mime_header_t * mime, char *buffer)
+content_type_parser(http_mime_header_t * mime, const char *value, int len)
 {
+	const char *pos, *end = value + len;
 	int sep_len;
-	char *pos;
 
 	EnterFunction(6);
 
-	if (strnicmp(buffer, "multipart/byteranges", 20) == 0) {
+	if (len >= 20 && strnicmp(value, "multipart/byteranges", 20) == 0) {
 		TCP_VS_DBG(6, "multipart/byteranges\n");
-		pos = buffer + 20 + 1;	/* skip ';' */
-		pos = skip_lws(pos + 1);
-		if (strnicmp(pos, "boundary=", 9) != 0) {
+		pos = value + 20 + 1;	/* skip ';' */
+		while (pos < end && (*pos == ' ' || *pos == '\t'))
+			pos++;
+		if (end - pos < 9 || strnicmp(pos, "boundary=", 9) != 0) {
 			goto exit;
 		}
 
 		/* the rest of this line is THIS_STRING_SEPARATES */
 		pos += 9;
-		sep_len = strlen(pos);
-		if ((mime->sep = kmalloc(sep_len + 1, GFP_KERNEL)) == NULL) {
-			goto exit;
-		}
+		sep_len = end - pos;
 
 		/* RFC 2046 [40] permits the boundary string to be quoted */
-		if (pos[0] == '"' || pos[0] == '\'') {
+		if (sep_len > 0 && (pos[0] == '"' || pos[0] == '\'')) {
 			pos++;
 			sep_len--;
+			if (sep_len > 0 && (pos[sep_len - 1] == '"'
+					    || pos[sep_len - 1] == '\''))
+				sep_len--;
+		}
+		if ((mime->sep = mime_value_dup(pos, sep_len)) == NULL) {
+			goto exit;
 		}
-		strncpy(mime->sep, pos, sep_len);
-		mime->sep[sep_len] = 0;
 		TCP_VS_DBG(5, "THIS_STRING_SEPARATES : %s\n", mime->sep);
 	}
 
@@ -858,6 +1312,46 @@ content_type_parser(http_mime_header_t * mime, char *buffer)
 }
 
 
+/****************************************************************************
+*
+* host_parser - http mime header parser for "Host"
+*
+*   The value is kept as a reference into the message header.
+*/
+static void
+host_parser(http_mime_header_t * mime, const char *value, int len)
+{
+	mime->host = value;
+	mime->host_len = len;
+}
+
+
+/****************************************************************************
+*
+* user_agent_parser - http mime header parser for "User-Agent"
+*
+*/
+static void
+user_agent_parser(http_mime_header_t * mime, const char *value, int len)
+{
+	mime->user_agent = value;
+	mime->user_agent_len = len;
+}
+
+
+/****************************************************************************
+*
+* forwarded_for_parser - http mime header parser for "X-Forwarded-For"
+*
+*/
+static void
+forwarded_for_parser(http_mime_header_t * mime, const char *value, int len)
+{
+	mime->forwarded_for = value;
+	mime->forwarded_for_len = len;
+}
+
+
 /****************************************************************************
 *
 * set_cookie_parser - http mime header parser for "Set-Cookie"
@@ -876,7 +1370,7 @@ content_type_parser(http_mime_header_t * mime, char *buffer)
 *
 */
 static void
-set_cookie_parser(http_mime_header_t * mime, char *buf)
+set_cookie_parser(http_mime_header_t * mime, const char *buf, int len)
 {
 	http_cookie_t *ck;
 	char* buffer;
@@ -885,7 +1379,8 @@ set_cookie_parser(http_mime_header_t * mime, char *buf)
 
 	EnterFunction(6);
 
-	buffer = strdup(buf);
+	if ((buffer = mime_value_dup(buf, len)) == NULL)
+		goto out;
 	TCP_VS_DBG(5, "Set-Cookie:%s", buffer);
 
 	mime->set_cookie2 = 0;
@@ -983,7 +1478,7 @@ set_cookie_parser(http_mime_header_t * mime, char *buf)
 *
 */
 static void
-set_cookie2_parser(http_mime_header_t * mime, char *buf)
+set_cookie2_parser(http_mime_header_t * mime, const char *buf, int len)
 {
 	http_cookie_t *ck;
 	char *attribute, *value, *s;
@@ -992,7 +1487,8 @@ set_cookie2_parser(http_mime_header_t * mime, char *buf)
 
 	EnterFunction(6);
 
-	buffer = strdup(buf);
+	if ((buffer = mime_value_dup(buf, len)) == NULL)
+		goto out;
 	TCP_VS_DBG(5, "Set-Cookie2:%s", buffer);
 
 	mime->set_cookie2 = 1;
@@ -1086,7 +1582,7 @@ set_cookie2_parser(http_mime_header_t * mime, char *buf)
 *	      omitted.
 */
 static void
-cookie_parser(http_mime_header_t * mime, char *buf)
+cookie_parser(http_mime_header_t * mime, const char *buf, int len)
 {
 	char *pos, *attribute, *value;
 	char* buffer;
@@ -1094,7 +1590,8 @@ cookie_parser(http_mime_header_t * mime, char *buf)
 
 	EnterFunction(6);
 
-	buffer = strdup(buf);
+	if ((buffer = mime_value_dup(buf, len)) == NULL)
+		goto out;
 	TCP_VS_DBG(5, "\nCookie:%s ", buffer);
 
 	pos = skip_lws(buffer);
@@ -1112,6 +1609,7 @@ cookie_parser(http_mime_header_t * mime, char *buf)
 	}
 
 	kfree(buffer);
+      out:
 	LeaveFunction(6);
 	return;
 }
@@ -1119,7 +1617,9 @@ cookie_parser(http_mime_header_t * mime, char *buf)
 void
 http_mime_parser_init(void)
 {
-	memset(http_mime_parse_table, 0, sizeof(http_mime_parse_table));
+	http_mime_nr_parsers = 0;
+	memset(http_mime_hash_table, 0, sizeof(http_mime_hash_table));
+	http_mime_hash_mask = 0;
 	register_mime_parser(transfer_encoding_parser, "Transfer-Encoding");
 	register_mime_parser(content_length_parser, "Content-Length");
 	register_mime_parser(connection_parser, "Connection");
@@ -1127,6 +1627,9 @@ http_mime_parser_init(void)
 	register_mime_parser(set_cookie_parser, "Set-Cookie");
 	register_mime_parser(set_cookie2_parser, "Set-Cookie2");
 	register_mime_parser(cookie_parser, "Cookie");
+	register_mime_parser(host_parser, "Host");
+	register_mime_parser(user_agent_parser, "User-Agent");
+	register_mime_parser(forwarded_for_parser, "X-Forwarded-For");
 }
 
 /******************************************************************************
@@ -1134,62 +1637,499 @@ http_mime_parser_init(void)
 *
 * This routine parses the MIME line in a buffer.
 *
-* NOTE: Some MIME headers (host, Referer) need be considered again, tbd.
+* NOTE: Some MIME headers (Referer) need be considered again, tbd.
 *
 */
 int
 http_mime_parse(char *buffer, int len, http_mime_header_t * mime)
 {
-	char *pos, c;
-	int l, ret = PARSE_OK;
-	http_mime_parse_t *parse_entry, *pe;
+	const char *pos, *end;
+	http_mime_parse_t *parse_entry;
 
 	assert(buffer != NULL);
 
-	/* terminate string */
-	c = buffer[len];
-	buffer[len] = 0;
+	TCP_VS_DBG(5, "MIME Header: %.*s\n", len, buffer);
 
-	TCP_VS_DBG(5, "MIME Header: %s\n", buffer);
+	end = buffer + len;
+	while (buffer < end && (*buffer == ' ' || *buffer == '\t'))
+		buffer++;
+	if ((pos = memchr(buffer, ':', end - buffer)) == NULL)
+		return PARSE_ERROR;
 
-	buffer = skip_lws(buffer);
-	if ((pos = strchr(buffer, ':')) == NULL) {
-		ret = PARSE_ERROR;
-		goto exit;
-	}
+	if ((parse_entry = http_mime_lookup(buffer, pos - buffer)) == NULL)
+		return PARSE_OK;	/* an unregistered mime header */
 
-	l = pos - buffer;
-	if (l >= MAX_MIME_HEADER_STRING_LEN)
-		goto exit;
+	/* strip the LWS around the value */
+	for (pos++; pos < end && (*pos == ' ' || *pos == '\t'); pos++);
+	while (end > pos && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	parse_entry->parser(mime, pos, end - pos);
+	return PARSE_OK;
+}
+
+
+/*
+ *	States of the incremental http parser
+ */
+enum {
+	s_start = 0,		/* empty lines before the request line */
+	s_method,
+	s_before_uri,
+	s_uri,
+	s_before_version,
+	s_version,
+	s_status_version,	/* response: HTTP-Version */
+	s_before_status,
+	s_status,		/* response: Status-Code */
+	s_reason,		/* response: Reason-Phrase */
+	s_line_lf,		/* CR seen at the end of the first line */
+	s_header_start,
+	s_header_name,
+	s_before_value,
+	s_header_value,
+	s_header_lf,		/* CR seen at the end of a header line */
+	s_headers_lf,		/* CR seen in the empty line */
+	s_done
+};
+
+#define HTTP_IS_EOL(c)	((c) == CR || (c) == LF)
+
+
+/****************************************************************************
+*	get the version number from a "HTTP/x.y" string
+*	return -1 if it is not a http version.
+*/
+static int
+http_version_number(char *ver, int len)
+{
+	int major, minor;
+
+	if (len < HTTP_VERSION_HEADER_LEN
+	    || strnicmp(ver, http_version_header, HTTP_VERSION_HEADER_LEN))
+		return -1;
+
+	ver += HTTP_VERSION_HEADER_LEN;
+	len -= HTTP_VERSION_HEADER_LEN;
+
+	/* Avoid sscanf in the common case */
+	if (len == HTTP_VERSION_NUMBER_LEN
+	    && isdigit(ver[0]) && ver[1] == '.' && isdigit(ver[2]))
+		return HTTP_VERSION(ver[0] - '0', ver[2] - '0');
+	if (2 == sscanf(ver, "%u.%u", &major, &minor)
+	    && (minor < HTTP_VERSION(1, 0)))	/* don't allow HTTP/0.1000 */
+		return HTTP_VERSION(major, minor);
+	return HTTP_VERSION(1, 0);
+}
+
+
+/****************************************************************************
+* http_parser_init - prepare a parser for a new message
+*
+*/
+void
+http_parser_init(http_parser_t * parser, int flags)
+{
+	parser->state = s_start;
+	parser->flags = flags;
+	parser->pos = 0;
+	parser->mark = 0;
+	parser->value_end = 0;
+	parser->line_len = 0;
+	parser->token_len = 0;
+	parser->method = HTTP_M_UNKNOWN;
+	parser->version = 0;
+	parser->nr_headers = 0;
+}
+
+
+/****************************************************************************
+* http_parser_execute - feed the next chunk of a http message header
+*
+*   The chunk starts right after the bytes consumed by the previous call,
+*   i.e. at offset parser->pos of the message. Every byte is looked at
+*   once, the request line and each header field are recorded as offsets
+*   in the parser, method and version are copied into parser->token.
+*
+*   Return:
+*	PARSE_OK		the header is complete, parser->pos is its
+*				length (including the empty line)
+*	PARSE_INCOMPLETE	all bytes consumed, need more data
+*	PARSE_ERROR		malformed request or header too large
+*/
+int
+http_parser_execute(http_parser_t * parser, const char *data,
+		    unsigned int len)
+{
+	const char *p, *q, *e, *end;
+	unsigned int base = parser->pos;
+	int state = parser->state;
+	int ret = PARSE_INCOMPLETE;
+	http_header_idx_t *h;
+	char c;
+
+#define OFFSET(ptr)	(base + ((ptr) - data))
 
-	parse_entry = &http_mime_parse_table[l];
+	EnterFunction(6);
 
-	if (parse_entry->parser == NULL) {	/* an unregistered mime header */
+	if (state == s_done) {
+		ret = PARSE_OK;
 		goto exit;
 	}
 
-	assert(parse_entry->mime_header_string != NULL);
-
-	if (strnicmp(parse_entry->mime_header_string, buffer, l) != 0) {
-		struct list_head *list;
-		int found = 0;
-		list_for_each(list, &parse_entry->plist) {
-			pe = list_entry(list, http_mime_parse_t, plist);
-			if (strnicmp(pe->mime_header_string, buffer, l) ==
-			    0) {
-				parse_entry = pe;
-				found = 1;
+	/* the offsets in the index are 16 bits */
+	if (base + len > HTTP_MAX_HEADER_LEN)
+		len = HTTP_MAX_HEADER_LEN - base;
+	end = data + len;
+
+	for (p = data; p < end; p++) {
+		c = *p;
+		switch (state) {
+		case s_start:
+			/* RFC 2616, 4.1: ignore empty lines before the
+			   Request-Line */
+			if (HTTP_IS_EOL(c))
+				break;
+			parser->method_off = OFFSET(p);
+			parser->token_len = 0;
+			if (parser->flags & HTTP_PARSE_RESPONSE) {
+				state = s_status_version;
+				goto status_version;
+			}
+			state = s_method;
+			/* fall through */
+
+		case s_method:
+			if (HTTP_IS_LWS(c)) {
+				parser->token[parser->token_len] = 0;
+				parser->method_len = parser->token_len;
+				parser->method =
+				    lookup_builtin_method(parser->token,
+							  parser->token_len);
+				if (parser->method == HTTP_M_UNKNOWN) {
+					TCP_VS_DBG(5, "Unknow http method.\n");
+					goto error;
+				}
+				state = s_before_uri;
+				break;
+			}
+			if (HTTP_IS_EOL(c)
+			    || parser->token_len == HTTP_TOKEN_MAXLEN - 1)
+				goto error;
+			parser->token[parser->token_len++] = c;
+			break;
+
+		case s_before_uri:
+			if (HTTP_IS_LWS(c))
+				break;
+			if (HTTP_IS_EOL(c))
+				goto error;
+			parser->uri_off = OFFSET(p);
+			state = s_uri;
+			/* fall through */
+
+		case s_uri:
+			for (q = p; q < end && !HTTP_IS_LWS(*q)
+			     && !HTTP_IS_EOL(*q); q++);
+			if (q == end) {
+				p = end - 1;
 				break;
 			}
+			p = q;
+			/* HTTP/0.9 simple requests are not supported */
+			if (HTTP_IS_EOL(*p))
+				goto error;
+			parser->uri_len = OFFSET(p) - parser->uri_off;
+			state = s_before_version;
+			break;
+
+		case s_before_version:
+			if (HTTP_IS_LWS(c))
+				break;
+			if (HTTP_IS_EOL(c))
+				goto error;
+			parser->version_off = OFFSET(p);
+			parser->token_len = 0;
+			state = s_version;
+			/* fall through */
+
+		case s_version:
+			if (HTTP_IS_EOL(c)) {
+				parser->token[parser->token_len] = 0;
+				parser->version =
+				    http_version_number(parser->token,
+							parser->token_len);
+				if (parser->version < 0)
+					goto error;
+				parser->version_len = parser->token_len;
+				parser->line_len =
+				    OFFSET(p) - parser->method_off;
+				if (c == CR) {
+					state = s_line_lf;
+					break;
+				}
+				goto line_done;
+			}
+			if (HTTP_IS_LWS(c))	/* trailing white space */
+				break;
+			if (parser->token_len == HTTP_TOKEN_MAXLEN - 1)
+				goto error;
+			parser->token[parser->token_len++] = c;
+			break;
+
+		case s_status_version:
+		      status_version:
+			if (HTTP_IS_LWS(c)) {
+				parser->token[parser->token_len] = 0;
+				parser->version =
+				    http_version_number(parser->token,
+							parser->token_len);
+				if (parser->version < 0)
+					goto error;
+				parser->version_off = parser->method_off;
+				parser->version_len = parser->token_len;
+				parser->status_code = 0;
+				state = s_before_status;
+				break;
+			}
+			if (HTTP_IS_EOL(c)
+			    || parser->token_len == HTTP_TOKEN_MAXLEN - 1)
+				goto error;
+			parser->token[parser->token_len++] = c;
+			break;
+
+		case s_before_status:
+			if (HTTP_IS_LWS(c))
+				break;
+			state = s_status;
+			/* fall through */
+
+		case s_status:
+			if (isdigit(c) && parser->status_code < 1000) {
+				parser->status_code =
+				    parser->status_code * 10 + c - '0';
+				break;
+			}
+			if (parser->status_code < 100
+			    || parser->status_code > 999)
+				goto error;
+			state = s_reason;
+			/* fall through */
+
+		case s_reason:
+			if (!(q = http_find_eol(p, end - p))) {
+				p = end - 1;
+				break;
+			}
+			p = q;
+			parser->line_len = OFFSET(p) - parser->method_off;
+			if (*p == CR) {
+				state = s_line_lf;
+				break;
+			}
+			goto line_done;
+
+		case s_line_lf:
+			if (c != LF)
+				goto error;
+		      line_done:
+			state = s_header_start;
+			parser->value_end = 0;
+			if (parser->flags & HTTP_PARSE_LINE_ONLY) {
+				p++;
+				goto done;
+			}
+			break;
+
+		case s_header_start:
+			if (c == CR) {
+				state = s_headers_lf;
+				break;
+			}
+			if (c == LF) {
+				p++;
+				state = s_done;
+				goto done;
+			}
+			if (HTTP_IS_LWS(c) && parser->value_end) {
+				/* continuation of the previous field value */
+				state = s_header_value;
+				break;
+			}
+			parser->mark = OFFSET(p);
+			state = s_header_name;
+			/* fall through */
+
+		case s_header_name:
+			for (q = p; q < end && *q != ':'
+			     && !HTTP_IS_EOL(*q); q++);
+			if (q == end) {
+				p = end - 1;
+				break;
+			}
+			p = q;
+			if (*p != ':') {
+				/* not a header field, ignore the line */
+				parser->value_end = 0;
+				state = (*p == CR) ? s_header_lf : s_header_start;
+				break;
+			}
+			if (parser->nr_headers == HTTP_MAX_HEADERS) {
+				TCP_VS_DBG(5, "Too many http header fields.\n");
+				goto error;
+			}
+			h = &parser->headers[parser->nr_headers++];
+			h->name = parser->mark;
+			for (q = p; q > data && HTTP_IS_LWS(q[-1]); q--);
+			h->name_len = OFFSET(q) - parser->mark;
+			state = s_before_value;
+			break;
+
+		case s_before_value:
+			if (HTTP_IS_LWS(c))
+				break;
+			h = &parser->headers[parser->nr_headers - 1];
+			h->value = OFFSET(p);
+			parser->value_end = h->value;
+			state = s_header_value;
+			/* fall through */
+
+		case s_header_value:
+			if (!(q = http_find_eol(p, end - p)))
+				q = end;
+			/* the value ends at the last non-LWS byte */
+			for (e = q; e > p && HTTP_IS_LWS(e[-1]); e--);
+			if (e > p)
+				parser->value_end = OFFSET(e);
+			if (q == end) {
+				p = end - 1;
+				break;
+			}
+			p = q;
+			h = &parser->headers[parser->nr_headers - 1];
+			h->value_len = parser->value_end - h->value;
+			state = (*p == CR) ? s_header_lf : s_header_start;
+			break;
+
+		case s_header_lf:
+			if (c != LF)
+				goto error;
+			state = s_header_start;
+			break;
+
+		case s_headers_lf:
+			if (c != LF)
+				goto error;
+			p++;
+			state = s_done;
+			goto done;
+
+		default:
+			goto error;
 		}
-		if (!found)	/* an unregistered mime header */
-			goto exit;
 	}
 
-	pos = skip_lws(pos + 1);
-	parse_entry->parser(mime, pos);
+	if (base + (p - data) >= HTTP_MAX_HEADER_LEN) {
+		TCP_VS_DBG(5, "http header is too large.\n");
+		goto error;
+	}
+	goto exit;
+
+      done:
+	ret = PARSE_OK;
+	goto exit;
+
+      error:
+	ret = PARSE_ERROR;
+	p = data;
 
       exit:
-	buffer[len] = c;	/* restore string */
+	parser->pos = base + (p - data);
+	parser->state = state;
+	LeaveFunction(6);
 	return ret;
+#undef OFFSET
+}
+
+
+/****************************************************************************
+* http_parser_mime - call the registered MIME parsers for each field in
+*                    the header index
+*/
+static void
+http_parser_mime(http_parser_t * parser, char *message,
+		 http_mime_header_t * mime)
+{
+	http_mime_parse_t *parse_entry;
+	http_header_idx_t *h;
+	int i;
+
+	for (i = 0; i < parser->nr_headers; i++) {
+		h = &parser->headers[i];
+		parse_entry = http_mime_lookup(message + h->name, h->name_len);
+		if (parse_entry == NULL)
+			continue;
+
+		parse_entry->parser(mime, message + h->value, h->value_len);
+	}
+}
+
+
+/****************************************************************************
+* http_parser_request - fill a request from a parsed message header
+*
+*   message is the start of the message that was fed to the parser. The
+*   registered MIME parsers are called for each field in the index, and
+*   the index is kept in the request, the parser must outlive it.
+*/
+int
+http_parser_request(http_parser_t * parser, char *message,
+		    http_request_t * req)
+{
+	EnterFunction(5);
+
+	req->message = message + parser->method_off;
+	req->message_len = parser->pos - parser->method_off;
+	req->parsed_len = parser->pos;
+
+	req->method = parser->method;
+	req->method_str = message + parser->method_off;
+	req->method_len = parser->method_len;
+
+	req->uri_str = message + parser->uri_off;
+	req->uri_len = parser->uri_len;
+
+	req->version = parser->version;
+	req->version_str = message + parser->version_off;
+	req->version_len = parser->version_len;
+
+	req->header_base = message;
+	req->headers = parser->headers;
+	req->nr_headers = parser->nr_headers;
+
+	http_parser_mime(parser, message, &req->mime);
+
+	LeaveFunction(5);
+	return PARSE_OK;
+}
+
+
+/****************************************************************************
+* http_parser_response - fill a response from a parsed message header
+*
+*   The parser must have been initialized with HTTP_PARSE_RESPONSE.
+*/
+int
+http_parser_response(http_parser_t * parser, char *message,
+		     http_response_t * resp)
+{
+	EnterFunction(5);
+
+	resp->version = parser->version;
+	resp->status_code = parser->status_code;
+	TCP_VS_DBG(6, "Status Code: %d\n", resp->status_code);
+
+	http_parser_mime(parser, message, &resp->mime);
+
+	LeaveFunction(5);
+	return PARSE_OK;
 }
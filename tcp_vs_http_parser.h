@@ -22,6 +22,8 @@
 #define LF	10
 #define SP	' '
 
+#define HTTP_IS_LWS(c)	((c) == SP || (c) == '\t')
+
 
 /**
  * @defgroup Methods List of Methods recognized by the server
@@ -83,8 +85,28 @@ typedef struct http_mime_header_s {
 	int cookie;		/* if there is cookie in the header */
 	int set_cookie2;
 	ulong session_id;
+
+	/* references into the message header, not NUL terminated */
+	const char *host;
+	int host_len;
+	const char *user_agent;
+	int user_agent_len;
+	const char *forwarded_for;
+	int forwarded_for_len;
 } http_mime_header_t;
 
+/* a mime header parser gets the value of the header, without LWS */
+typedef void (*HTTP_MIME_PARSER) (http_mime_header_t * mime,
+				  const char *value, int len);
+
+/* position of a header field, relative to the start of the message */
+typedef struct http_header_idx_s {
+	unsigned short name;
+	unsigned short name_len;
+	unsigned short value;
+	unsigned short value_len;
+} http_header_idx_t;
+
 typedef struct http_request_s {
 	const char *message;
 	unsigned int message_len;
@@ -106,8 +128,80 @@ typedef struct http_request_s {
 
 	/* MIME header */
 	http_mime_header_t mime;
+
+	/* the header index of the parser, offsets from header_base */
+	const char *header_base;
+	const http_header_idx_t *headers;
+	int nr_headers;
 } http_request_t;
 
+/* incremental parser flags */
+#define HTTP_PARSE_LINE_ONLY	0x0001	/* stop after the first line */
+#define HTTP_PARSE_RESPONSE	0x0002	/* parse a response header */
+
+#define HTTP_MAX_HEADERS	64	/* size of the header index */
+#define HTTP_MAX_HEADER_LEN	65535	/* offsets are kept in 16 bits */
+#define HTTP_TOKEN_MAXLEN	16	/* longest method or version string */
+
+/*
+ *	Incremental parser for the http message header. The message is
+ *	fed in arbitrary chunks, the parser keeps its state between calls
+ *	and records offsets only, so the bytes may be moved between calls
+ *	as long as they stay in order.
+ */
+typedef struct http_parser_s {
+	int state;		/* state of the machine */
+	int flags;		/* HTTP_PARSE_* flags */
+	unsigned int pos;	/* bytes consumed so far */
+	unsigned int mark;	/* start of the field being scanned */
+	unsigned int value_end;	/* end of the header value, without LWS */
+	unsigned int line_len;	/* length of the request line, without CRLF */
+
+	/* method and version are short, keep a copy of them */
+	char token[HTTP_TOKEN_MAXLEN];
+	int token_len;
+	int method;
+	int version;
+	int status_code;	/* response only */
+
+	/* request line fields, a status line keeps its start in
+	   method_off and the version */
+	unsigned short method_off;
+	unsigned short method_len;
+	unsigned short uri_off;
+	unsigned short uri_len;
+	unsigned short version_off;
+	unsigned short version_len;
+
+	/* header index */
+	int nr_headers;
+	http_header_idx_t headers[HTTP_MAX_HEADERS];
+} http_parser_t;
+
+/* state of a streaming separator search */
+typedef struct http_sep_s {
+	char *pat;		/* the separator */
+	int len;
+	char *carry;		/* tail of the data scanned so far */
+	int carry_len;
+	unsigned short shift[256];	/* Horspool bad character shifts */
+} http_sep_t;
+
+/* framing state of a chunked message body */
+typedef struct http_chunk_s {
+	int state;
+	int digits;		/* hex digits of the chunk-size so far */
+	unsigned long size;	/* chunk-data bytes left */
+} http_chunk_t;
+
+#define HTTP_CHUNK_DONE		-1
+#define HTTP_CHUNK_DATA		-2
+#define http_chunk_done(chunk)	((chunk)->state == HTTP_CHUNK_DONE)
+
+/* chunk-data bytes that can be passed on without scanning */
+#define http_chunk_data(chunk)	((chunk)->state == HTTP_CHUNK_DATA	\
+				 ? (chunk)->size : 0)
+
 typedef struct http_response_s {
 	/* http verison */
 	int version;
@@ -129,12 +223,40 @@ extern int parse_http_status_line(char *buffer, size_t len,
 
 extern void http_mime_parser_init(void);
 
+extern int register_mime_parser(HTTP_MIME_PARSER parser,
+				const char *mime_str);
+
 extern int http_mime_parse(char *buffer, int len,
 			   http_mime_header_t * mime);
 
+extern void http_parser_init(http_parser_t * parser, int flags);
+
+extern int http_parser_execute(http_parser_t * parser, const char *data,
+			       unsigned int len);
+
+extern int http_parser_request(http_parser_t * parser, char *message,
+			       http_request_t * req);
+
+extern int http_parser_response(http_parser_t * parser, char *message,
+				http_response_t * resp);
+
+extern char *http_find_eol(const char *s, int len);
+
+extern char *http_find_crlf(const char *s, int len);
+
 extern char* search_sep(const char *s, int len, const char *sep);
 
+extern http_sep_t *http_sep_new(const char *sep, int len);
+
+extern int http_sep_scan(http_sep_t * sp, const char *data, int len);
+
 extern long get_chunk_size(char *b);
 
+extern void http_chunk_init(http_chunk_t * chunk);
+
+extern int http_chunk_scan(http_chunk_t * chunk, const char *data, int len);
+
+extern void http_chunk_skip(http_chunk_t * chunk, unsigned long n);
+
 
 #endif		/* _TCP_VS_HTTP_PARSER_H */
@@ -32,6 +32,368 @@
 #include "tcp_vs_http_trans.h"
 
 
+/****************************************************************************
+*	http_xmit - send data behind the header pending in the control block
+*
+*   The pending header and the data go out in one gathered send, the
+*   header has to be sent before the read buffer is reused.
+*/
+static int
+http_xmit(struct socket *dsock, http_read_ctl_block_t * ctl_blk,
+	  const char *buf, int len, int flags)
+{
+	struct iovec iov[HTTP_MAX_PENDING + 1];
+	int n = ctl_blk->nr_pending;
+
+	if (n == 0)
+		return len > 0 ? tcp_vs_xmit(dsock, buf, len, flags) : 0;
+
+	memcpy(iov, ctl_blk->pending, n * sizeof(struct iovec));
+	if (len > 0) {
+		iov[n].iov_base = (void *) buf;
+		iov[n].iov_len = len;
+		n++;
+	}
+	ctl_blk->nr_pending = 0;
+	return tcp_vs_xmitv(dsock, iov, n, flags);
+}
+
+
+/****************************************************************************
+*	http_queue_header - add a piece of message header to be sent with
+*	                    the first bytes of the body
+*
+*   The bytes are not copied, they must stay in place until the header
+*   is sent by the body relay or by http_xmit_pending.
+*/
+int
+http_queue_header(http_read_ctl_block_t * ctl_blk, const char *buf, int len)
+{
+	if (ctl_blk->nr_pending == HTTP_MAX_PENDING)
+		return -1;
+	ctl_blk->pending[ctl_blk->nr_pending].iov_base = (void *) buf;
+	ctl_blk->pending[ctl_blk->nr_pending].iov_len = len;
+	ctl_blk->nr_pending++;
+	return 0;
+}
+
+
+/****************************************************************************
+*	http_xmit_pending - send the pending header of a message without body
+*
+*/
+int
+http_xmit_pending(struct socket *sock, http_read_ctl_block_t * ctl_blk,
+		  int flags)
+{
+	if (http_xmit(sock, ctl_blk, NULL, 0, flags) < 0) {
+		TCP_VS_ERR("Error in xmitting message header\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+*	http_rewrite_init - start an empty list of rewrite operations
+*
+*/
+void
+http_rewrite_init(http_rewrite_t * rw)
+{
+	rw->nr_ops = 0;
+	rw->insert = NULL;
+	rw->insert_len = 0;
+}
+
+
+/****************************************************************************
+*	http_rewrite_add - add an operation on a header field
+*
+*   The operations are kept sorted by field, a field gets one operation,
+*   deleting it overrides anything else.
+*/
+int
+http_rewrite_add(http_rewrite_t * rw, int op, int field,
+		 const char *data, int len)
+{
+	int i, j;
+
+	for (i = 0; i < rw->nr_ops && rw->ops[i].field < field; i++);
+	if (i < rw->nr_ops && rw->ops[i].field == field) {
+		if (op != HTTP_RW_DELETE)
+			return -1;
+	} else {
+		if (rw->nr_ops == HTTP_RW_MAX_OPS)
+			return -1;
+		for (j = rw->nr_ops; j > i; j--)
+			rw->ops[j] = rw->ops[j - 1];
+		rw->nr_ops++;
+	}
+	rw->ops[i].op = op;
+	rw->ops[i].field = field;
+	rw->ops[i].data = data;
+	rw->ops[i].len = len;
+	return 0;
+}
+
+
+static inline void
+http_queue_piece(http_read_ctl_block_t * ctl_blk, const char *from,
+		 const char *to)
+{
+	if (to > from)
+		http_queue_header(ctl_blk, from, to - from);
+}
+
+
+/****************************************************************************
+*	http_queue_rewritten_header - queue a message header with the
+*	                              rewrite operations applied
+*
+*   The header is cut into the pieces around the edited fields, nothing
+*   is copied. Returns -1 and queues nothing if there are not enough
+*   iovecs left.
+*/
+int
+http_queue_rewritten_header(http_read_ctl_block_t * ctl_blk,
+			    http_parser_t * parser, const char *message,
+			    int len, http_rewrite_t * rw)
+{
+	const char *from = message, *end, *eoh;
+	http_header_idx_t *h;
+	int i;
+
+	if (ctl_blk->nr_pending + 2 * rw->nr_ops + 3 > HTTP_MAX_PENDING)
+		return -1;
+
+	/* the empty line ending the header */
+	eoh = message + len - ((len >= 2 && message[len - 2] == CR) ? 2 : 1);
+
+	for (i = 0; i < rw->nr_ops; i++) {
+		h = &parser->headers[rw->ops[i].field];
+		end = message + h->value + h->value_len;
+		switch (rw->ops[i].op) {
+		case HTTP_RW_DELETE:
+			http_queue_piece(ctl_blk, from, message + h->name);
+			/* skip the line and the LWS only lines folded into it */
+			do {
+				end = memchr(end, LF, eoh - end);
+				end = end ? end + 1 : eoh;
+			} while (end < eoh && HTTP_IS_LWS(*end));
+			from = end;
+			break;
+
+		case HTTP_RW_REPLACE:
+			http_queue_piece(ctl_blk, from, message + h->value);
+			http_queue_header(ctl_blk, rw->ops[i].data,
+					  rw->ops[i].len);
+			from = end;
+			break;
+
+		case HTTP_RW_APPEND:
+			http_queue_piece(ctl_blk, from, end);
+			http_queue_header(ctl_blk, rw->ops[i].data,
+					  rw->ops[i].len);
+			from = end;
+			break;
+		}
+	}
+
+	http_queue_piece(ctl_blk, from, eoh);
+	if (rw->insert_len > 0)
+		http_queue_header(ctl_blk, rw->insert, rw->insert_len);
+	http_queue_piece(ctl_blk, eoh, message + len);
+	return 0;
+}
+
+
+/* fields that only make sense on one hop, Transfer-Encoding is kept
+   because the body is relayed as it is */
+static const struct {
+	const char *name;
+	int len;
+} hop_by_hop[] = {
+	{"Keep-Alive", 10},
+	{"Proxy-Connection", 16},
+	{"TE", 2},
+	{"Trailer", 7},
+	{"Upgrade", 7},
+	{NULL, 0}
+};
+
+#define HTTP_RW_MAX_TOKENS	8
+
+#define FIELD_IS(h, s, l)	((h)->name_len == (l)			\
+				 && !strnicmp(message + (h)->name, s, l))
+
+
+/****************************************************************************
+*	http_rewrite_request - build the rewrite operations for a request
+*
+*   flags are the TCP_VS_REWRITE_* flags of the matched rule, client is
+*   the address of the client. The lines made up are written to buf,
+*   which must hold HTTP_RW_BUFLEN bytes and stay until the header is
+*   sent. Returns -1 if the header needs too many operations.
+*/
+int
+http_rewrite_request(http_rewrite_t * rw, http_parser_t * parser,
+		     const char *message, http_request_t * req, int flags,
+		     __u32 client, char *buf)
+{
+	const char *token[HTTP_RW_MAX_TOKENS];
+	int token_len[HTTP_RW_MAX_TOKENS];
+	int nr_tokens = 0, keep_alive = 0;
+	int i, j, op, n, xff = -1;
+	const char *s, *e, *q;
+	http_header_idx_t *h;
+
+	http_rewrite_init(rw);
+
+	/* the tokens of Connection name more hop-by-hop fields */
+	for (i = 0; i < parser->nr_headers; i++) {
+		h = &parser->headers[i];
+		if (!FIELD_IS(h, "Connection", 10))
+			continue;
+		s = message + h->value;
+		e = s + h->value_len;
+		while (s < e) {
+			while (s < e && (*s == ',' || HTTP_IS_LWS(*s)))
+				s++;
+			for (q = s; q < e && *q != ',' && !HTTP_IS_LWS(*q);
+			     q++);
+			if (q - s == 10 && !strnicmp(s, "keep-alive", 10))
+				keep_alive = 1;
+			if (q > s && nr_tokens < HTTP_RW_MAX_TOKENS) {
+				token[nr_tokens] = s;
+				token_len[nr_tokens++] = q - s;
+			}
+			s = q;
+		}
+	}
+
+	for (i = 0; i < parser->nr_headers; i++) {
+		h = &parser->headers[i];
+		op = 0;
+		if ((flags & TCP_VS_REWRITE_CONNECTION)
+		    && (FIELD_IS(h, "Connection", 10)
+			|| FIELD_IS(h, "Proxy-Connection", 16)))
+			op = HTTP_RW_DELETE;
+		if (!op && (flags & TCP_VS_REWRITE_HOPBYHOP)) {
+			for (j = 0; !op && hop_by_hop[j].name; j++)
+				if (FIELD_IS(h, hop_by_hop[j].name,
+					     hop_by_hop[j].len))
+					op = HTTP_RW_DELETE;
+			for (j = 0; !op && j < nr_tokens; j++)
+				if (FIELD_IS(h, token[j], token_len[j]))
+					op = HTTP_RW_DELETE;
+		}
+		if (op) {
+			if (http_rewrite_add(rw, op, i, NULL, 0) < 0)
+				return -1;
+		} else if (FIELD_IS(h, "X-Forwarded-For", 15))
+			xff = i;
+	}
+
+	/* the inserted lines go first in buf, the appended value behind */
+	n = 0;
+	if (flags & TCP_VS_REWRITE_CONNECTION) {
+		if (req->mime.connection_close
+		    || (req->version < HTTP_VERSION(1, 1) && !keep_alive))
+			n += sprintf(buf + n, "Connection: close\r\n");
+		else
+			n += sprintf(buf + n, "Connection: keep-alive\r\n");
+	}
+	if ((flags & TCP_VS_REWRITE_XFF) && xff < 0)
+		n += sprintf(buf + n, "X-Forwarded-For: %u.%u.%u.%u\r\n",
+			     NIPQUAD(client));
+	rw->insert = buf;
+	rw->insert_len = n;
+
+	if ((flags & TCP_VS_REWRITE_XFF) && xff >= 0) {
+		s = buf + n;
+		if (parser->headers[xff].value_len > 0) {
+			op = HTTP_RW_APPEND;
+			j = sprintf(buf + n, ", %u.%u.%u.%u", NIPQUAD(client));
+		} else {
+			op = HTTP_RW_REPLACE;
+			j = sprintf(buf + n, " %u.%u.%u.%u", NIPQUAD(client));
+		}
+		if (http_rewrite_add(rw, op, xff, s, j) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+*	http_queue_request - queue a request header, rewritten as the
+*	                     matched rule asks
+*
+*   rw and buf must stay until the header is sent. The header is queued
+*   unchanged if it cannot be rewritten.
+*/
+void
+http_queue_request(http_read_ctl_block_t * ctl_blk, http_parser_t * parser,
+		   http_request_t * req, int len, int rewrite, __u32 client,
+		   http_rewrite_t * rw, char *buf)
+{
+	if (rewrite
+	    && http_rewrite_request(rw, parser, ctl_blk->info, req, rewrite,
+				    client, buf) == 0
+	    && http_queue_rewritten_header(ctl_blk, parser, ctl_blk->info,
+					   len, rw) == 0)
+		return;
+
+	if (rewrite)
+		TCP_VS_DBG(5, "Too many header fields to rewrite, "
+			   "sent unchanged\n");
+	http_queue_header(ctl_blk, ctl_blk->info, len);
+}
+
+
+/****************************************************************************
+*	relay_skbs - pass len bytes from the socket of the control block to
+*	             the destination socket with tcp_vs_forward
+*
+*   The read buffer must be empty.
+*/
+static int
+relay_skbs(struct socket *dsock, http_read_ctl_block_t * ctl_blk, int len)
+{
+	struct sock *sk = ctl_blk->sock->sk;
+	int w;
+
+	DECLARE_WAITQUEUE(wait, current);
+
+	assert(ctl_blk->remaining == 0 && ctl_blk->flag == 0);
+
+	while (len > 0) {
+		w = tcp_vs_forward(ctl_blk->sock, dsock, len);
+		if (w < 0) {
+			TCP_VS_ERR("Error in relaying bytes\n");
+			return -1;
+		}
+		if (w > 0) {
+			len -= w;
+			continue;
+		}
+
+		if (sk->sk_state != TCP_ESTABLISHED) {
+			TCP_VS_DBG(5, "Connection closed while relaying\n");
+			return -1;
+		}
+		add_wait_queue(sk->sk_sleep, &wait);
+		__set_current_state(TASK_INTERRUPTIBLE);
+		if (skb_queue_empty(&sk->sk_receive_queue))
+			schedule_timeout(HZ);
+		__set_current_state(TASK_RUNNING);
+		remove_wait_queue(sk->sk_sleep, &wait);
+	}
+	return 0;
+}
+
+
 /****************************************************************************
 *	Relay data between source socket and destination socket
 *
@@ -44,11 +406,9 @@ static int
 relay_http_data(struct socket *dsock,
 		http_read_ctl_block_t * ctl_blk, int len)
 {
-	int nbytes, reads, w = 0;
+	int nbytes;
 	int ret = -1;
 
-	DECLARE_WAITQUEUE(wait, current);
-
 	EnterFunction(5);
 
 	assert(ctl_blk->remaining <=
@@ -58,9 +418,9 @@ relay_http_data(struct socket *dsock,
 	/* if there is enough data in read buffer */
 	nbytes = len - ctl_blk->remaining;
 	if (nbytes <= 0) {
-		if (tcp_vs_xmit
-		    (dsock, ctl_blk->cur_buf->buf + ctl_blk->offset, len,
-		     MSG_MORE) < 0) {
+		if (http_xmit
+		    (dsock, ctl_blk, ctl_blk->cur_buf->buf + ctl_blk->offset,
+		     len, MSG_MORE) < 0) {
 			TCP_VS_ERR("Error in xmitting message body\n");
 			goto exit;
 		}
@@ -69,50 +429,22 @@ relay_http_data(struct socket *dsock,
 		goto done;
 	}
 
-	/* xmit the remaining bytes */
-	if (ctl_blk->remaining > 0) {
-		if (tcp_vs_xmit(dsock, ctl_blk->cur_buf->buf + ctl_blk->offset,
-				ctl_blk->remaining, MSG_MORE) < 0) {
+	/* xmit the pending header and the remaining bytes first */
+	if (ctl_blk->remaining > 0 || ctl_blk->nr_pending) {
+		if (http_xmit(dsock, ctl_blk,
+			      ctl_blk->cur_buf->buf + ctl_blk->offset,
+			      ctl_blk->remaining, MSG_MORE) < 0) {
 			TCP_VS_ERR("Error in xmitting remaining bytes\n");
 			goto exit;
 		}
 	}
+	ctl_blk->offset = 0;
+	ctl_blk->remaining = 0;
 
-	do {
-		reads =
-		    tcp_vs_recvbuffer(ctl_blk->sock, ctl_blk->cur_buf->buf,
-				      ctl_blk->buf_size, ctl_blk->flag);
-		if (reads == 0) {
-			TCP_VS_DBG(5, "Reads 0 bytes while relay\n");
-			add_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
-			__set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
-			__set_current_state(TASK_RUNNING);
-			remove_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
-			continue;
-		}
-
-		if (reads < 0) {
-			TCP_VS_ERR("Error in reading while relaying\n");
-			goto exit;
-		}
-
-		w = MIN(nbytes, reads);
-
-		if (tcp_vs_xmit(dsock, ctl_blk->cur_buf->buf, w, MSG_MORE)
-		    < 0) {
-			TCP_VS_ERR("Error in relaying bytes\n");
-			goto exit;
-		}
-
-		nbytes -= w;
-	} while (nbytes > 0);
-
-	ctl_blk->offset = w;
-	ctl_blk->remaining = reads - w;
-
-	assert(ctl_blk->remaining >= 0);
-	assert(ctl_blk->offset < ctl_blk->buf_size);
+	/* the rest is passed on skb by skb, without copying it through
+	   the read buffer */
+	if (relay_skbs(dsock, ctl_blk, nbytes) < 0)
+		goto exit;
 
       done:
 	ret = 0;
@@ -142,6 +474,7 @@ http_read_init(http_read_ctl_block_t * ctl_blk, struct socket *sock)
 	INIT_LIST_HEAD(&buf->b_list);
 	buf->buf = page;
 	buf->data_len = 0;
+	buf->order = 0;
 
 	INIT_LIST_HEAD(&ctl_blk->buf_entry_list);
 	list_add_tail(&buf->b_list, &ctl_blk->buf_entry_list);
@@ -152,6 +485,7 @@ http_read_init(http_read_ctl_block_t * ctl_blk, struct socket *sock)
 	ctl_blk->sock = sock;
 	ctl_blk->buf_size = PAGE_SIZE;
 	ctl_blk->flag = 0;
+	ctl_blk->nr_pending = 0;
 
 	return 0;
 }
@@ -171,7 +505,7 @@ http_read_free(http_read_ctl_block_t * read_ctl)
 	list_for_each_safe(l, temp, &read_ctl->buf_entry_list) {
 		list_del(l);
 		buf_entry = list_entry(l, http_buf_t, b_list);
-		free_page((unsigned long) buf_entry->buf);
+		free_pages((unsigned long) buf_entry->buf, buf_entry->order);
 		kfree(buf_entry);
 	}
 
@@ -179,6 +513,120 @@ http_read_free(http_read_ctl_block_t * read_ctl)
 }
 
 
+/****************************************************************************
+*
+* http_read_release - free the buffers grown by http_read_header for a
+*                     control block set up on a buffer of the caller,
+*                     the first buffer of the list is left alone.
+*
+*/
+void
+http_read_release(http_read_ctl_block_t * ctl_blk)
+{
+	struct list_head *l, *temp;
+	http_buf_t *buf_entry;
+
+	list_for_each_safe(l, temp, &ctl_blk->buf_entry_list) {
+		if (l == ctl_blk->buf_entry_list.next)
+			continue;
+		list_del(l);
+		buf_entry = list_entry(l, http_buf_t, b_list);
+		free_pages((unsigned long) buf_entry->buf, buf_entry->order);
+		kfree(buf_entry);
+	}
+	ctl_blk->cur_buf = list_entry(ctl_blk->buf_entry_list.next,
+				      http_buf_t, b_list);
+}
+
+
+/****************************************************************************
+*	http_read_grow - move the unread bytes into a buffer twice as large
+*
+*   A header must be in one piece for the parser offsets, so a header
+*   longer than the buffer gets a larger one, up to HTTP_READ_BUF_MAX.
+*   The buffer it replaces is freed unless it is the first one of the
+*   list, which belongs to whoever set up the control block. Returns -1
+*   if the buffer cannot grow.
+*/
+static int
+http_read_grow(http_read_ctl_block_t * ctl_blk)
+{
+	http_buf_t *old = ctl_blk->cur_buf;
+	http_buf_t *hdr;
+	char *page;
+	int size, order;
+
+	if (ctl_blk->buf_size >= HTTP_READ_BUF_MAX)
+		return -1;
+	size = min(ctl_blk->buf_size * 2, HTTP_READ_BUF_MAX);
+	order = get_order(size);
+
+	hdr = (http_buf_t *) kmalloc(sizeof(http_buf_t), GFP_KERNEL);
+	page = (char *) __get_free_pages(GFP_KERNEL, order);
+	if (!hdr || !page) {
+		TCP_VS_ERR("Out of memory.\n");
+		if (hdr)
+			kfree(hdr);
+		if (page)
+			free_pages((unsigned long) page, order);
+		return -1;
+	}
+	INIT_LIST_HEAD(&hdr->b_list);
+	hdr->buf = page;
+	hdr->order = order;
+	memcpy(page, old->buf + ctl_blk->offset, ctl_blk->remaining);
+	hdr->data_len = ctl_blk->remaining;
+	list_add_tail(&hdr->b_list, &ctl_blk->buf_entry_list);
+
+	if (&old->b_list != ctl_blk->buf_entry_list.next) {
+		list_del(&old->b_list);
+		free_pages((unsigned long) old->buf, old->order);
+		kfree(old);
+	}
+	ctl_blk->cur_buf = hdr;
+	ctl_blk->offset = 0;
+	ctl_blk->buf_size = PAGE_SIZE << order;
+	TCP_VS_DBG(5, "read buffer grown to %d bytes\n", ctl_blk->buf_size);
+	return 0;
+}
+
+
+/****************************************************************************
+*	http_read_wrap - make room behind the unread bytes of the buffer
+*
+*   Consumed bytes are only skipped by the offset, so the buffer is used
+*   like a ring: it wraps to its start for free once everything has been
+*   consumed, and only a message running into the end of the buffer has
+*   its own bytes moved to the start. Returns -1 if no room can be made.
+*/
+static int
+http_read_wrap(http_read_ctl_block_t * ctl_blk)
+{
+	char *buf = ctl_blk->cur_buf->buf;
+
+	if (ctl_blk->offset == 0 || ctl_blk->flag == MSG_PEEK)
+		return -1;
+	if (ctl_blk->remaining > 0)
+		memmove(buf, buf + ctl_blk->offset, ctl_blk->remaining);
+	ctl_blk->offset = 0;
+	return 0;
+}
+
+
+/****************************************************************************
+*	http_read_reset - start reading the next message
+*
+*   The buffer wraps only if all of it has been consumed, the unread
+*   bytes of a pipelined message stay where they are.
+*/
+void
+http_read_reset(http_read_ctl_block_t * ctl_blk)
+{
+	if (ctl_blk->remaining == 0 && ctl_blk->flag != MSG_PEEK)
+		ctl_blk->offset = 0;
+}
+
+
 /****************************************************************************
 *
 * http_read_line - read a line of http header from socket.
@@ -207,17 +655,21 @@ http_read_line(http_read_ctl_block_t * ctl_blk, int grow)
 
 	ctl_blk->info = NULL;
 
+	/* the lines read before stay in place when growing */
+	if (!grow)
+		http_read_reset(ctl_blk);
+
 	offset = ctl_blk->offset;
 	buf = ctl_blk->cur_buf->buf + offset;
 	buf_size = ctl_blk->buf_size;
 
 	/* try to get a line from the remaining bytes */
-	for (i = 0; i < ctl_blk->remaining - 1; i++) {
-		if ((buf[i] == CR) && (buf[i + 1] == LF)) {
-			len = i;
-			goto done;
-		}
+	if ((pos = http_find_crlf(buf, ctl_blk->remaining)) != NULL) {
+		len = pos - buf;
+		goto done;
 	}
+	/* a CR at the end may be followed by LF in the next read */
+	i = ctl_blk->remaining > 0 ? ctl_blk->remaining - 1 : 0;
 
 	move = 0;
 
@@ -264,16 +716,16 @@ http_read_line(http_read_ctl_block_t * ctl_blk, int grow)
 		ctl_blk->remaining += reads;
 
 		/* try to get a line from the remaing bytes */
-		for (; i < ctl_blk->remaining - 1; i++) {
-			if ((buf[i] == CR) && (buf[i + 1] == LF)) {
-				len = i;
-				goto done;
-			}
+		if ((pos = http_find_crlf(buf + i, ctl_blk->remaining - i))
+		    != NULL) {
+			len = pos - buf;
+			goto done;
 		}
+		i = ctl_blk->remaining - 1;
 		nbytes -= reads;
 	}
 
-	/* memmove and read again */
+	/* make room and read again */
 	if ((len < 0) && (move == 0)) {
 		char *page;
 		if (grow) {
@@ -289,14 +741,20 @@ http_read_line(http_read_ctl_block_t * ctl_blk, int grow)
 			INIT_LIST_HEAD(&hdr->b_list);
 			hdr->buf = page;
 			hdr->data_len = 0;
+			hdr->order = 0;
 			list_add_tail(&hdr->b_list,
 				      &ctl_blk->buf_entry_list);
 			ctl_blk->cur_buf = hdr;
+			memmove(page, buf, ctl_blk->remaining);
+			ctl_blk->offset = 0;
 		} else {
+			if (http_read_wrap(ctl_blk) < 0) {
+				TCP_VS_ERR("Buffer is too small while "
+					   "reading a line.\n");
+				goto exit;
+			}
 			page = ctl_blk->cur_buf->buf;
 		}
-		memmove(page, buf, ctl_blk->remaining);
-		ctl_blk->offset = 0;
 		buf = page;
 		move = 1;
 		goto get_a_line;
@@ -318,12 +776,134 @@ http_read_line(http_read_ctl_block_t * ctl_blk, int grow)
 }
 
 
+/****************************************************************************
+*
+* http_read_header - read a http message header and parse it on the fly.
+*
+*   Bytes are read behind the remaining bytes of the current buffer, and
+*   only the bytes the parser has not seen are fed to it, so the header
+*   is scanned exactly once. With MSG_PEEK the data is left in the socket
+*   and each read returns the queue from its head, then the header must
+*   start at the beginning of the buffer.
+*
+*   A header that fills the whole buffer is moved into a larger one, so
+*   the caller finds it by ctl_blk->info rather than in its own buffer,
+*   and frees the grown buffer with http_read_release if it set up the
+*   control block itself.
+*
+*   On success, ctl_blk->info points to the header, and the header is
+*   consumed from the control block unless the read flag is MSG_PEEK.
+*
+*   Return the length of the header, or -1 if failed.
+*
+*/
+int
+http_read_header(http_read_ctl_block_t * ctl_blk, http_parser_t * parser)
+{
+	char *buf;
+	int nbytes, reads, ret;
+	int len = -1;
+
+	DECLARE_WAITQUEUE(wait, current);
+
+	EnterFunction(5);
+
+	http_read_reset(ctl_blk);
+	buf = ctl_blk->cur_buf->buf + ctl_blk->offset;
+	ctl_blk->info = buf;
+
+	for (;;) {
+		/* feed the new bytes to the parser */
+		if (ctl_blk->remaining > parser->pos) {
+			ret = http_parser_execute(parser, buf + parser->pos,
+						  ctl_blk->remaining -
+						  parser->pos);
+			if (ret == PARSE_OK)
+				break;
+			if (ret == PARSE_ERROR) {
+				TCP_VS_ERR_RL("Cannot parse http header\n");
+				goto exit;
+			}
+		}
+
+		nbytes = ctl_blk->buf_size - ctl_blk->offset -
+		    ctl_blk->remaining;
+		if (nbytes == 0) {
+			/* the parser keeps offsets, so the partial header
+			   can be moved to the head of the buffer, or into
+			   a larger one if it fills the whole buffer */
+			if (http_read_wrap(ctl_blk) < 0
+			    && http_read_grow(ctl_blk) < 0) {
+				TCP_VS_ERR_RL("Header is larger than %d bytes "
+					      "or no memory\n",
+					      ctl_blk->buf_size);
+				goto exit;
+			}
+			buf = ctl_blk->info = ctl_blk->cur_buf->buf;
+			continue;
+		}
+
+		/* go out if the connection is closed */
+		if (ctl_blk->sock->sk->sk_state != TCP_ESTABLISHED
+		    && ctl_blk->sock->sk->sk_state != TCP_CLOSE_WAIT)
+			goto exit;
+
+		if (ctl_blk->flag == MSG_PEEK) {
+			reads = tcp_vs_recvbuffer(ctl_blk->sock, buf,
+						  ctl_blk->buf_size -
+						  ctl_blk->offset, MSG_PEEK);
+			if (reads > ctl_blk->remaining) {
+				ctl_blk->remaining = reads;
+				continue;
+			}
+		} else {
+			reads = tcp_vs_recvbuffer(ctl_blk->sock,
+						  buf + ctl_blk->remaining,
+						  nbytes, ctl_blk->flag);
+			if (reads > 0) {
+				ctl_blk->remaining += reads;
+				continue;
+			}
+		}
+
+		if (reads < 0) {
+			TCP_VS_ERR("Error in reading a header\n");
+			goto exit;
+		}
+
+		/* the peer has closed, no more data will come */
+		if (ctl_blk->sock->sk->sk_state == TCP_CLOSE_WAIT)
+			goto exit;
+
+		TCP_VS_DBG(5, "Read 0 bytes while reading a header\n");
+		add_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
+		__set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(HZ);
+		__set_current_state(TASK_RUNNING);
+		remove_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
+	}
+
+	len = parser->pos;
+	if (ctl_blk->flag != MSG_PEEK) {
+		ctl_blk->offset += len;
+		ctl_blk->remaining -= len;
+	}
+	ctl_blk->cur_buf->data_len = ctl_blk->offset;
+
+      exit:
+	LeaveFunction(5);
+	return len;
+}
+
+
 /****************************************************************************
 * relay_multiparts: relay multipart/byteranges body
 *
 *  relay all data until "CRLF--THIS_STRING_SEPARATES--CRLF" is found.
-*
-*  Note: there may be a endless loop if the separate string is not found, tbd.
+*  Each buffer is sent as soon as it is scanned, the bytes behind the
+*  separator stay in the read buffer. The relay fails if the separator
+*  does not show up within sysctl_ktcpvs_multipart_limit bytes or
+*  before the peer closes.
 *
 */
 static int
@@ -331,10 +911,12 @@ relay_multiparts(struct socket *dsock,
 		 http_read_ctl_block_t * ctl_blk,
 		 http_mime_header_t * mime)
 {
-	int len, sep_len, l, reads;
+	struct sock *sk = ctl_blk->sock->sk;
+	int len, sep_len, n, w, total = 0;
 	int ret = -1;
-	char *buf, *pos;
+	char *buf;
 	char *sep = NULL;
+	http_sep_t *sp = NULL;
 
 	DECLARE_WAITQUEUE(wait, current);
 
@@ -346,67 +928,63 @@ relay_multiparts(struct socket *dsock,
 	}
 
 	snprintf(sep, sep_len + 1, "\r\n--%s--\r\n", mime->sep);
-
-	/* deal with the remaining bytes */
-	buf = ctl_blk->cur_buf->buf + ctl_blk->offset;
-	len = ctl_blk->remaining;
-
-	if ((len > 0) && (tcp_vs_xmit(dsock, buf, len, MSG_MORE) < 0)) {
-		TCP_VS_ERR("Error in xmitting multiparts (remaining)\n");
+	if ((sp = http_sep_new(sep, sep_len)) == NULL) {
 		goto exit;
 	}
 
-	pos = search_sep(buf, len, sep);
-	if (pos != NULL) {
-		goto done;
-	}
-
-	l = MIN(len, sep_len);
-	memmove(ctl_blk->cur_buf->buf, buf + len - l, l);
+	/* start with the remaining bytes */
+	buf = ctl_blk->cur_buf->buf + ctl_blk->offset;
+	len = ctl_blk->remaining;
 
 	/* search for CRLF--THIS_STRING_SEPARATES--CRLF */
 	while (1) {
-		reads =
-		    tcp_vs_recvbuffer(ctl_blk->sock,
-				      ctl_blk->cur_buf->buf + l,
-				      ctl_blk->buf_size - l, 0);
-		if (reads == 0) {
-			TCP_VS_DBG(5, "Reads 0 bytes while relaying "
-				   "multiparts\n");
-			add_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
-			__set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
-			__set_current_state(TASK_RUNNING);
-			remove_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
-			continue;
+		n = http_sep_scan(sp, buf, len);
+		w = n < 0 ? len : n;
+		if (http_xmit(dsock, ctl_blk, buf, w, MSG_MORE) < 0) {
+			TCP_VS_ERR("Error in xmitting multiparts\n");
+			goto exit;
 		}
-
-		if (reads < 0) {
-			TCP_VS_ERR("Error in receiving multiparts\n");
+		ctl_blk->offset = buf + w - ctl_blk->cur_buf->buf;
+		ctl_blk->remaining = len - w;
+		if (n >= 0)
+			break;
+
+		total += w;
+		if (sysctl_ktcpvs_multipart_limit > 0
+		    && total > sysctl_ktcpvs_multipart_limit) {
+			TCP_VS_ERR_RL("No multipart separator in %d bytes\n",
+				      total);
 			goto exit;
 		}
 
-		if (tcp_vs_xmit
-		    (dsock, ctl_blk->cur_buf->buf + l, reads,
-		     MSG_MORE) < 0) {
-			TCP_VS_ERR("Error in xmitting multiparts\n");
+		buf = ctl_blk->cur_buf->buf;
+		len = tcp_vs_recvbuffer(ctl_blk->sock, buf,
+					ctl_blk->buf_size, 0);
+		if (len < 0) {
+			TCP_VS_ERR("Error in receiving multiparts\n");
 			goto exit;
 		}
+		if (len > 0)
+			continue;
 
-		len = l + reads;
-		pos = search_sep(ctl_blk->cur_buf->buf, len, sep);
-		if (pos != NULL) {
-			goto done;
+		if (sk->sk_state != TCP_ESTABLISHED) {
+			TCP_VS_DBG(5, "Connection closed while relaying "
+				   "multiparts\n");
+			goto exit;
 		}
-
-		l = MIN(len, sep_len);
-		memmove(ctl_blk->cur_buf->buf,
-			ctl_blk->cur_buf->buf + len - l, l);
+		add_wait_queue(sk->sk_sleep, &wait);
+		__set_current_state(TASK_INTERRUPTIBLE);
+		if (skb_queue_empty(&sk->sk_receive_queue))
+			schedule_timeout(HZ);
+		__set_current_state(TASK_RUNNING);
+		remove_wait_queue(sk->sk_sleep, &wait);
 	}
 
-      done:
 	ret = 0;
       exit:
+	if (sp) {
+		kfree(sp);
+	}
 	if (sep) {
 		kfree(sep);
 	}
@@ -416,6 +994,87 @@ relay_multiparts(struct socket *dsock,
 }
 
 
+/****************************************************************************
+*	relay_chunked_body - relay a body in the chunked transfer-coding
+*
+*   The data is relayed in the buffers it is read in, the framing is
+*   tracked by http_chunk_scan, so small chunks do not cost a send each.
+*   The data of a chunk that goes on beyond the buffer is forwarded
+*   skb by skb. Bytes behind the end of the body stay in the read
+*   buffer.
+*/
+static int
+relay_chunked_body(struct socket *dsock, http_read_ctl_block_t * ctl_blk)
+{
+	http_chunk_t chunk;
+	char *buf;
+	int n, reads;
+	int ret = -1;
+
+	DECLARE_WAITQUEUE(wait, current);
+
+	EnterFunction(5);
+
+	http_chunk_init(&chunk);
+
+	/* the remaining bytes go out with the pending header */
+	buf = ctl_blk->cur_buf->buf + ctl_blk->offset;
+	reads = ctl_blk->remaining;
+	for (;;) {
+		n = http_chunk_scan(&chunk, buf, reads);
+		if (n < 0) {
+			TCP_VS_ERR("Bad chunk framing while relaying\n");
+			goto exit;
+		}
+		if (http_xmit(dsock, ctl_blk, buf, n, MSG_MORE) < 0) {
+			TCP_VS_ERR("Error in relaying chunked body\n");
+			goto exit;
+		}
+		ctl_blk->offset = buf + n - ctl_blk->cur_buf->buf;
+		ctl_blk->remaining = reads - n;
+		if (http_chunk_done(&chunk))
+			break;
+
+		/* the buffer is empty now, chunk-data is passed on skb
+		   by skb and only the framing is read into the buffer */
+		buf = ctl_blk->cur_buf->buf;
+		if (http_chunk_data(&chunk) > 0) {
+			n = tcp_vs_forward(ctl_blk->sock, dsock,
+					   http_chunk_data(&chunk));
+			if (n < 0) {
+				TCP_VS_ERR("Error in relaying chunk data\n");
+				goto exit;
+			}
+			if (n > 0) {
+				http_chunk_skip(&chunk, n);
+				reads = 0;
+				continue;
+			}
+		}
+
+		reads =
+		    tcp_vs_recvbuffer(ctl_blk->sock, buf, ctl_blk->buf_size,
+				      ctl_blk->flag);
+		if (reads == 0) {
+			TCP_VS_DBG(5, "Reads 0 bytes while relay\n");
+			add_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
+			__set_current_state(TASK_INTERRUPTIBLE);
+			schedule();
+			__set_current_state(TASK_RUNNING);
+			remove_wait_queue(ctl_blk->sock->sk->sk_sleep, &wait);
+		} else if (reads < 0) {
+			TCP_VS_ERR("Error in reading while relaying\n");
+			goto exit;
+		}
+	}
+
+	ret = 0;
+      exit:
+	LeaveFunction(5);
+	return ret;
+}
+
+
 /****************************************************************************
 * transfer http message body.
 *
@@ -500,51 +1159,7 @@ relay_http_message_body(struct socket *dsock,
 		 *   Content-Length := length
 		 *   Remove "chunked" from Transfer-Encoding
 		 */
-		int len, chunk_size;
-		do {
-			len = http_read_line(ctl_blk, 0);
-			if (len < 0) {
-				TCP_VS_ERR("Error in reading chunk "
-					   "size from client\n");
-				goto exit;
-			}
-
-			if (tcp_vs_xmit
-			    (dsock, ctl_blk->info, len + 2, MSG_MORE) < 0) {
-				TCP_VS_ERR("Error in xmitting chunk "
-					   "size & extension\n");
-				goto exit;
-			}
-
-			ctl_blk->info[len] = 0;
-			chunk_size = get_chunk_size(ctl_blk->info);
-
-			TCP_VS_DBG(5, "Chunked line: %s\n", ctl_blk->info);
-
-			if (chunk_size > 0) {
-				if (relay_http_data
-				    (dsock, ctl_blk, chunk_size + 2) < 0) {
-					TCP_VS_ERR("Error in xmitting "
-						   "chunk data\n");
-					goto exit;
-				}
-			}
-		} while (chunk_size > 0);
-
-		/* relay the trailer */
-		do {
-			len = http_read_line(ctl_blk, 0);
-			if (len < 0) {
-				TCP_VS_ERR("Error in reading trailer.\n");
-				goto exit;
-			}
-			if (tcp_vs_xmit
-			    (dsock, ctl_blk->info, len + 2, MSG_MORE) < 0) {
-				TCP_VS_ERR("Error in xmitting trailer\n");
-				goto exit;
-			}
-		} while (len != 0);
-		ret = 0;
+		ret = relay_chunked_body(dsock, ctl_blk);
 	} else if (mime->content_length) {
 		ret =
 		    relay_http_data(dsock, ctl_blk, mime->content_length);
@@ -554,7 +1169,10 @@ relay_http_message_body(struct socket *dsock,
 		ret = 0;	/* ? */
 	}
 
-      exit:
+	/* a message without body still has its header pending */
+	if (ctl_blk->nr_pending && http_xmit_pending(dsock, ctl_blk, 0) < 0)
+		ret = -1;
+
 	LeaveFunction(5);
 	return ret;
 }
@@ -19,8 +19,17 @@ typedef struct http_buf_s {
 	struct list_head	b_list;
 	char			*buf;
 	int			data_len;
+	int			order;	/* of the pages of a buffer grown
+					   by http_read_header */
 } http_buf_t;
 
+/* the read buffer grows for a long header up to the size the header
+   index can take */
+#define HTTP_READ_BUF_MAX	(HTTP_MAX_HEADER_LEN + 1)
+
+/* pieces of a message header waiting to go out with the body */
+#define HTTP_MAX_PENDING	16
+
 /*
  *	Control block to read data from socket
  */
@@ -33,8 +42,91 @@ typedef struct http_read_ctl_block_s {
 	int remaining;		/* remaining bytes not return */
 	int buf_size;		/* buffer size */
 	int flag;		/* read flag */
+	int nr_pending;		/* number of pending iovecs */
+	struct iovec pending[HTTP_MAX_PENDING];	/* header to be sent */
 } http_read_ctl_block_t;
 
+/* header rewrite operations */
+#define HTTP_RW_DELETE		1	/* remove the field line */
+#define HTTP_RW_REPLACE		2	/* replace the field value */
+#define HTTP_RW_APPEND		3	/* append to the field value */
+
+/* each operation takes two iovecs, the tail three */
+#define HTTP_RW_MAX_OPS		((HTTP_MAX_PENDING - 3) / 2)
+
+/* room for the lines and values made up by http_rewrite_request */
+#define HTTP_RW_BUFLEN		96
+
+/*
+ *	Edits to a parsed message header, sorted by field. The header is
+ *	queued in place, only the inserted strings come from elsewhere.
+ */
+typedef struct http_rewrite_s {
+	int nr_ops;
+	struct {
+		int op;		/* HTTP_RW_* */
+		int field;	/* index into the header index */
+		const char *data;
+		int len;
+	} ops[HTTP_RW_MAX_OPS];
+	const char *insert;	/* field lines added at the end */
+	int insert_len;
+} http_rewrite_t;
+
+/* most requests of a client connection waiting for responses */
+#define HTTP_MAX_PIPELINE	16
+
+/* only requests without side effects are sent ahead of the responses
+   to earlier ones */
+#define HTTP_PIPELINE_SAFE(method)	((method) == HTTP_M_GET		\
+					 || (method) == HTTP_M_HEAD)
+
+/* a request sent to a server, waiting for its response */
+typedef struct http_inflight_s {
+	server_conn_t *sc;	/* server connection of the request */
+	int method;
+	ulong session_id;
+} http_inflight_t;
+
+/*
+ *	Requests of a client connection in the order they came in, their
+ *	responses are returned to the client in the same order.
+ */
+typedef struct http_pipeline_s {
+	int depth;		/* most requests in flight */
+	int head;		/* oldest request */
+	int count;		/* requests in flight */
+	http_inflight_t q[HTTP_MAX_PIPELINE];
+} http_pipeline_t;
+
+static inline void
+http_pipeline_init(http_pipeline_t * pl)
+{
+	pl->depth = sysctl_ktcpvs_pipeline_depth;
+	if (pl->depth < 1)
+		pl->depth = 1;
+	if (pl->depth > HTTP_MAX_PIPELINE)
+		pl->depth = HTTP_MAX_PIPELINE;
+	pl->head = 0;
+	pl->count = 0;
+}
+
+static inline http_inflight_t *
+http_pipeline_push(http_pipeline_t * pl)
+{
+	return &pl->q[(pl->head + pl->count++) % pl->depth];
+}
+
+static inline http_inflight_t *
+http_pipeline_pop(http_pipeline_t * pl)
+{
+	http_inflight_t *rq = &pl->q[pl->head];
+
+	pl->head = (pl->head + 1) % pl->depth;
+	pl->count--;
+	return rq;
+}
+
 
 /* HTTP transport function prototypes */
 extern int relay_http_message_body(struct socket *dsock,
@@ -45,8 +137,40 @@ extern int http_read_init(http_read_ctl_block_t *ctl_blk, struct socket *sock);
 
 extern void http_read_free(http_read_ctl_block_t *read_ctl);
 
+extern void http_read_release(http_read_ctl_block_t * ctl_blk);
+
 extern int data_available(http_read_ctl_block_t * ctl_blk);
 
+extern void http_read_reset(http_read_ctl_block_t * ctl_blk);
+
 extern int http_read_line(http_read_ctl_block_t * ctl_blk, int grow);
 
+extern int http_read_header(http_read_ctl_block_t * ctl_blk,
+			    http_parser_t * parser);
+
+extern int http_queue_header(http_read_ctl_block_t * ctl_blk,
+			     const char *buf, int len);
+
+extern int http_xmit_pending(struct socket *sock,
+			     http_read_ctl_block_t * ctl_blk, int flags);
+
+extern void http_rewrite_init(http_rewrite_t * rw);
+
+extern int http_rewrite_add(http_rewrite_t * rw, int op, int field,
+			    const char *data, int len);
+
+extern int http_queue_rewritten_header(http_read_ctl_block_t * ctl_blk,
+				       http_parser_t * parser,
+				       const char *message, int len,
+				       http_rewrite_t * rw);
+
+extern int http_rewrite_request(http_rewrite_t * rw, http_parser_t * parser,
+				const char *message, http_request_t * req,
+				int flags, __u32 client, char *buf);
+
+extern void http_queue_request(http_read_ctl_block_t * ctl_blk,
+			       http_parser_t * parser, http_request_t * req,
+			       int len, int rewrite, __u32 client,
+			       http_rewrite_t * rw, char *buf);
+
 #endif
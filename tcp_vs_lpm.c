@@ -0,0 +1,249 @@
+/*
+ * KTCPVS       An implementation of the TCP Virtual Server daemon inside
+ *              kernel for the LINUX operating system. KTCPVS can be used
+ *              to build a moderately scalable and highly available server
+ *              based on a cluster of servers, with more flexibility.
+ *
+ * tcp_vs_lpm.c: longest prefix match on the address of the client
+ *
+ * Version:     $Id: tcp_vs_lpm.c,v 1.1 2005/03/02 10:14:21 wensong Exp $
+ *
+ * Authors:     Wensong Zhang <wensong@linuxvirtualserver.org>
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/in.h>
+
+#include "tcp_vs.h"
+
+
+/*
+ * A service may have a table of client prefixes, loaded at once by
+ * tcpvsadm, each prefix carrying a tag. The rules on the client
+ * address can name a tag instead of a prefix, they match the clients
+ * whose longest prefix in the table carries it.
+ *
+ * The table is expanded into three levels indexed by 16, 8 and 8 bits
+ * of the address, so a lookup is three array reads whatever the number
+ * of prefixes. A slot holds the tag of the longest prefix covering it,
+ * 0 for none, or the number of the chunk of 256 slots of the next
+ * level when longer prefixes start below it. The first level always
+ * takes 256K, every /16 with prefixes longer than /16 in it takes a 1K
+ * chunk, and so does every /24 with prefixes longer than /24.
+ *
+ * The table is never changed once built. Loading a new one publishes
+ * it and frees the old one after an RCU grace period, just like the
+ * routing data of the service.
+ */
+#define LPM_CHUNK		0x80000000U	/* the slot is a chunk */
+#define LPM_L1_SIZE		65536
+#define LPM_CHUNK_SIZE		256
+
+struct tcp_vs_lpm {
+	__u32 *l1;		/* by the first 16 bits */
+	__u32 *l2;		/* chunks by the next 8 bits */
+	__u32 *l3;		/* chunks by the last 8 bits */
+	int n2, n3;		/* number of chunks */
+};
+
+
+static inline __u32
+lpm_mask(int bits)
+{
+	return bits ? ~0U << (32 - bits) : 0;
+}
+
+/* set a slot of the second level and the chunk below it */
+static void
+lpm_fill2(struct tcp_vs_lpm *lpm, int i, __u32 tag)
+{
+	__u32 *c;
+	int j;
+
+	if (!(lpm->l2[i] & LPM_CHUNK)) {
+		lpm->l2[i] = tag;
+		return;
+	}
+	c = lpm->l3 + (lpm->l2[i] & ~LPM_CHUNK) * LPM_CHUNK_SIZE;
+	for (j = 0; j < LPM_CHUNK_SIZE; j++)
+		c[j] = tag;
+}
+
+/* set a slot of the first level and the chunks below it */
+static void
+lpm_fill1(struct tcp_vs_lpm *lpm, int i, __u32 tag)
+{
+	int j, c;
+
+	if (!(lpm->l1[i] & LPM_CHUNK)) {
+		lpm->l1[i] = tag;
+		return;
+	}
+	c = (lpm->l1[i] & ~LPM_CHUNK) * LPM_CHUNK_SIZE;
+	for (j = 0; j < LPM_CHUNK_SIZE; j++)
+		lpm_fill2(lpm, c + j, tag);
+}
+
+/*
+ *	Set the slots of a prefix, a, in host order, is masked already.
+ *	The prefixes are set from the shortest to the longest, so a prefix
+ *	simply takes over everything it covers.
+ */
+static void
+lpm_set(struct tcp_vs_lpm *lpm, __u32 a, int bits, __u32 tag)
+{
+	int i, c, first;
+
+	if (bits <= 16) {
+		first = a >> 16;
+		for (i = 0; i < 1 << (16 - bits); i++)
+			lpm_fill1(lpm, first + i, tag);
+	} else if (bits <= 24) {
+		c = (lpm->l1[a >> 16] & ~LPM_CHUNK) * LPM_CHUNK_SIZE;
+		first = (a >> 8) & 0xff;
+		for (i = 0; i < 1 << (24 - bits); i++)
+			lpm_fill2(lpm, c + first + i, tag);
+	} else {
+		c = (lpm->l1[a >> 16] & ~LPM_CHUNK) * LPM_CHUNK_SIZE;
+		c = (lpm->l2[c + ((a >> 8) & 0xff)] & ~LPM_CHUNK)
+		    * LPM_CHUNK_SIZE;
+		first = a & 0xff;
+		for (i = 0; i < 1 << (32 - bits); i++)
+			lpm->l3[c + first + i] = tag;
+	}
+}
+
+
+/****************************************************************************
+*	Build the table of n prefixes, the caller has checked that the
+*	lengths are at most 32 and the tags are not 0. Of two equal
+*	prefixes the last one wins. Returns NULL if there is no memory.
+*/
+struct tcp_vs_lpm *
+tcp_vs_lpm_build(const struct tcp_vs_prefix_u *p, int n)
+{
+	struct tcp_vs_lpm *lpm;
+	int count[33 + 1];
+	int *order = NULL;
+	__u32 a, *s;
+	int i, bits;
+
+	EnterFunction(5);
+
+	if (!(lpm = kmalloc(sizeof(*lpm), GFP_KERNEL)))
+		return NULL;
+	memset(lpm, 0, sizeof(*lpm));
+	if (!(order = vmalloc(n * sizeof(*order)))
+	    || !(lpm->l1 = vmalloc(LPM_L1_SIZE * sizeof(__u32))))
+		goto err;
+	memset(lpm->l1, 0, LPM_L1_SIZE * sizeof(__u32));
+
+	/* sort the prefixes by length, keeping the order of equal ones */
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[p[i].bits + 1]++;
+	for (bits = 0; bits < 33; bits++)
+		count[bits + 1] += count[bits];
+	for (i = 0; i < n; i++)
+		order[count[p[i].bits]++] = i;
+
+	/* the chunks of the second level, then of the third one */
+	for (i = 0; i < n; i++) {
+		if (p[i].bits <= 16)
+			continue;
+		s = &lpm->l1[ntohl(p[i].addr) >> 16];
+		if (!(*s & LPM_CHUNK))
+			*s = LPM_CHUNK | lpm->n2++;
+	}
+	if (lpm->n2) {
+		if (!(lpm->l2 = vmalloc(lpm->n2 * LPM_CHUNK_SIZE
+					* sizeof(__u32))))
+			goto err;
+		memset(lpm->l2, 0, lpm->n2 * LPM_CHUNK_SIZE * sizeof(__u32));
+	}
+	for (i = 0; i < n; i++) {
+		if (p[i].bits <= 24)
+			continue;
+		a = ntohl(p[i].addr);
+		s = &lpm->l2[(lpm->l1[a >> 16] & ~LPM_CHUNK) * LPM_CHUNK_SIZE
+			     + ((a >> 8) & 0xff)];
+		if (!(*s & LPM_CHUNK))
+			*s = LPM_CHUNK | lpm->n3++;
+	}
+	if (lpm->n3) {
+		if (!(lpm->l3 = vmalloc(lpm->n3 * LPM_CHUNK_SIZE
+					* sizeof(__u32))))
+			goto err;
+		memset(lpm->l3, 0, lpm->n3 * LPM_CHUNK_SIZE * sizeof(__u32));
+	}
+
+	for (i = 0; i < n; i++) {
+		bits = p[order[i]].bits;
+		lpm_set(lpm, ntohl(p[order[i]].addr) & lpm_mask(bits), bits,
+			p[order[i]].tag);
+	}
+
+	TCP_VS_DBG(3, "%d prefixes in the table, %d+%d chunks\n",
+		   n, lpm->n2, lpm->n3);
+	vfree(order);
+	LeaveFunction(5);
+	return lpm;
+
+      err:
+	TCP_VS_ERR("no memory for the prefix table\n");
+	if (order)
+		vfree(order);
+	tcp_vs_lpm_free(lpm);
+	LeaveFunction(5);
+	return NULL;
+}
+
+
+/* it calls vfree, not in atomic context */
+void tcp_vs_lpm_free(struct tcp_vs_lpm *lpm)
+{
+	if (lpm == NULL)
+		return;
+	if (lpm->l1)
+		vfree(lpm->l1);
+	if (lpm->l2)
+		vfree(lpm->l2);
+	if (lpm->l3)
+		vfree(lpm->l3);
+	kfree(lpm);
+}
+
+
+/*
+ *	The tag of the longest prefix of the table that covers the address
+ *	addr, in network order, or 0.
+ */
+int
+tcp_vs_lpm_lookup(const struct tcp_vs_lpm *lpm, __u32 addr)
+{
+	__u32 a = ntohl(addr);
+	__u32 v;
+
+	v = lpm->l1[a >> 16];
+	if (v & LPM_CHUNK) {
+		v = lpm->l2[(v & ~LPM_CHUNK) * LPM_CHUNK_SIZE
+			    + ((a >> 8) & 0xff)];
+		if (v & LPM_CHUNK)
+			v = lpm->l3[(v & ~LPM_CHUNK) * LPM_CHUNK_SIZE
+				    + (a & 0xff)];
+	}
+	return v;
+}
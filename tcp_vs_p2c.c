@@ -0,0 +1,183 @@
+/*
+ * KTCPVS       An implementation of the TCP Virtual Server daemon inside
+ *              kernel for the LINUX operating system. KTCPVS can be used
+ *              to build a moderately scalable and highly available server
+ *              based on a cluster of servers, with more flexibility.
+ *
+ * Version:     $Id: tcp_vs_p2c.c,v 1.1 2005/03/02 10:14:21 wensong Exp $
+ *
+ * Authors:     Wensong Zhang <wensong@linuxvirtualserver.org>
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * tcp_vs_p2c.c: power of two choices scheduling
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/smp.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+
+#include "tcp_vs.h"
+
+
+/*
+ * The scheduler takes two servers of the service at random and sends
+ * the connection to the one with the lower conns/weight, which spreads
+ * the load nearly as evenly as weighted least connection while looking
+ * at two servers only. The connections are counted per CPU, see
+ * tcp_vs_dest_inc_cpu, so starting and ending them touches nothing
+ * shared, and the random numbers come from a generator of each CPU.
+ */
+static DEFINE_PER_CPU(__u32, p2c_seed);
+
+/* xorshift, the state is never 0 */
+static inline __u32
+p2c_random(void)
+{
+	__u32 *seed = &get_cpu_var(p2c_seed);
+	__u32 x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	put_cpu_var(p2c_seed);
+	return x;
+}
+
+/* the first server of weight above 0 from i on, wrapping around */
+static inline int
+p2c_eligible(tcp_vs_dest_t **dests, int n, int i)
+{
+	int j;
+
+	for (j = 0; j < n; j++, i = (i + 1 == n) ? 0 : i + 1)
+		if (dests[i]->weight > 0)
+			return i;
+	return -1;
+}
+
+
+static int
+tcp_vs_p2c_init_svc(struct tcp_vs_service *svc)
+{
+	return 0;
+}
+
+
+static int
+tcp_vs_p2c_done_svc(struct tcp_vs_service *svc)
+{
+	return 0;
+}
+
+
+static int
+tcp_vs_p2c_update_svc(struct tcp_vs_service *svc)
+{
+	return 0;
+}
+
+
+/*
+ *    Power of two choices scheduling
+ */
+static int
+tcp_vs_p2c_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
+{
+	struct tcp_vs_route *route;
+	tcp_vs_dest_t *a, *b;
+	int i, j, n;
+
+	TCP_VS_DBG(5, "tcp_vs_p2c_schedule(): Scheduling...\n");
+
+	rcu_read_lock();
+	route = tcp_vs_route_get(svc);
+	n = route->ndests;
+	i = n ? p2c_eligible(route->dests, n, p2c_random() % n) : -1;
+	if (i < 0) {
+		rcu_read_unlock();
+		return -1;
+	}
+	a = route->dests[i];
+
+	/* another place than the first one, the server of weight 0 there
+	   may lead to the first server again */
+	if (n > 1) {
+		j = p2c_random() % (n - 1);
+		if (j >= i)
+			j++;
+		b = route->dests[p2c_eligible(route->dests, n, j)];
+
+		/* c1/w1 > c2/w2 as c1*w2 > c2*w1 */
+		if (tcp_vs_dest_conns(a) * b->weight
+		    > tcp_vs_dest_conns(b) * a->weight)
+			a = b;
+	}
+	rcu_read_unlock();
+
+	TCP_VS_DBG(5, "P2C: server %d.%d.%d.%d:%d "
+		   "conns %d refcnt %d weight %d\n",
+		   NIPQUAD(a->addr), ntohs(a->port),
+		   tcp_vs_dest_conns(a), atomic_read(&a->refcnt), a->weight);
+
+	conn->dsock = tcp_vs_connect2dest(a);
+	if (!conn->dsock) {
+		TCP_VS_ERR_RL("The destination is not available\n");
+		return -1;
+	}
+	tcp_vs_dest_inc_cpu(a);
+	conn->flags |= TCP_VS_CONN_F_CPU;
+	conn->dest = a;
+
+	return 0;
+}
+
+
+static struct tcp_vs_scheduler tcp_vs_p2c_scheduler = {
+	{0},			/* n_list */
+	"p2c",			/* name */
+	THIS_MODULE,		/* this module */
+	tcp_vs_p2c_init_svc,	/* initializer */
+	tcp_vs_p2c_done_svc,	/* done */
+	tcp_vs_p2c_update_svc,	/* update */
+	tcp_vs_p2c_schedule,	/* select a server from the destination list */
+};
+
+
+static int __init
+tcp_vs_p2c_init(void)
+{
+	__u32 seed;
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		do {
+			get_random_bytes(&seed, sizeof(seed));
+		} while (seed == 0);
+		per_cpu(p2c_seed, cpu) = seed;
+	}
+	INIT_LIST_HEAD(&tcp_vs_p2c_scheduler.n_list);
+	return register_tcp_vs_scheduler(&tcp_vs_p2c_scheduler);
+}
+
+static void __exit
+tcp_vs_p2c_cleanup(void)
+{
+	unregister_tcp_vs_scheduler(&tcp_vs_p2c_scheduler);
+}
+
+module_init(tcp_vs_p2c_init);
+module_exit(tcp_vs_p2c_cleanup);
+MODULE_LICENSE("GPL");
@@ -59,129 +59,72 @@ tcp_vs_phttp_update_svc(struct tcp_vs_service *svc)
 }
 
 
-static inline tcp_vs_dest_t *
-__tcp_vs_phttp_wlc_schedule(struct list_head *destinations)
-{
-	register struct list_head *e;
-	tcp_vs_dest_t *dest, *least;
-
-	list_for_each(e, destinations) {
-		least = list_entry(e, tcp_vs_dest_t, r_list);
-		if (least->weight > 0) {
-			goto nextstage;
-		}
-	}
-	return NULL;
-
-	/*
-	 *      Find the destination with the least load.
-	 */
-      nextstage:
-	for (e = e->next; e != destinations; e = e->next) {
-		dest = list_entry(e, tcp_vs_dest_t, r_list);
-		if (atomic_read(&least->conns) * dest->weight >
-		    atomic_read(&dest->conns) * least->weight) {
-			least = dest;
-		}
-	}
-
-	return least;
-}
-
-
 static tcp_vs_dest_t *
-tcp_vs_hhttp_matchrule(struct tcp_vs_service *svc, http_request_t * req)
+tcp_vs_hhttp_matchrule(struct tcp_vs_service *svc, struct tcp_vs_conn *conn,
+		       http_request_t * req, int *rewrite)
 {
-	struct list_head *l;
+	struct tcp_vs_route_rule *rr;
 	struct tcp_vs_rule *r;
 	tcp_vs_dest_t *dest = NULL;
-	char *uri;
 	regmatch_t matches[10];
-	int hashvalue, num_dest;
 	int reg_err;
-	regoff_t start, end, p;
-	register struct list_head *e;
+	regoff_t start, end;
+	const char *s;
+	int len;
 
-	if (!(uri = kmalloc(req->uri_len + 1, GFP_KERNEL))) {
-		TCP_VS_ERR("No memory!\n");
-		return NULL;
+	TCP_VS_DBG(5, "matching request URI: %.*s\n",
+		   (int) req->uri_len, req->uri_str);
+
+	rcu_read_lock();
+	/* find the rule first, then get the submatches of that rule only */
+	rr = tcp_vs_match_rule(svc, conn, req);
+	if (rr == NULL)
+		goto found;
+	r = rr->rule;
+	*rewrite = r->rewrite;
+	/* a rule on the client address has no match, hash the address */
+	s = tcp_vs_rule_subject(r, conn, req, &len);
+	if (s == NULL) {
+		dest = tcp_vs_hash_addr(rr, conn->addr);
+		goto found;
 	}
-	memcpy(uri, req->uri_str, req->uri_len);
-	uri[req->uri_len] = '\0';
-	TCP_VS_DBG(5, "matching request URI: %s\n", uri);
-
-	read_lock(&svc->lock);
-	list_for_each(l, &svc->rule_list) {
-		r = list_entry(l, struct tcp_vs_rule, list);
-		memset(matches, 0, sizeof(regmatch_t) * 10); /* initialise the values */
-		reg_err = regexec(&r->rx, uri, 10, matches, 0); 
-		if (!reg_err) {
-			/* HIT */
-			TCP_VS_DBG(5, "URI matched pattern %s\n", r->pattern);
-			start = matches[r->match_num].rm_so;
-			end = matches[r->match_num].rm_eo;
-			if (start && end) {
-				num_dest = 0;
-				list_for_each(e, &r->destinations) {
-					num_dest++;
-				}
-				hashvalue = 0;
-				for (p = start; p < end; p++) {
-					hashvalue += uri[p];
-				}
-				TCP_VS_DBG(5, "hash value %d (c=%d)\n", hashvalue, num_dest);
-				if (num_dest) {
-					hashvalue %= num_dest;
-					list_for_each(e, &r->destinations) {
-						if (hashvalue == 0) {
-							dest = list_entry(e, tcp_vs_dest_t,  r_list);
-							goto found;
-						}
-						hashvalue--;
-					}
-				}
-			}
-			break;
-		} else {
-			TCP_VS_DBG(6,"regexec return code is <%d>\n", reg_err);
-		}
+	memset(matches, 0, sizeof(regmatch_t) * 10); /* initialise the values */
+	reg_err = tcp_vs_rule_exec(r, s, len, 10, matches);
+	if (!reg_err) {
+		/* HIT */
+		TCP_VS_DBG(5, "request matched pattern %s\n", r->pattern);
+		start = matches[r->match_num].rm_so;
+		end = matches[r->match_num].rm_eo;
+		/* rm_so is -1 if the subexpression took no part */
+		if (start >= 0)
+			dest = tcp_vs_hash_key(rr, s + start, end - start);
+	} else {
+		TCP_VS_DBG(6,"regexec return code is <%d>\n", reg_err);
 	}
   found:
-	read_unlock(&svc->lock);
+	rcu_read_unlock();
 
-	kfree(uri);
 	return dest;
 }
 
 static tcp_vs_dest_t *
-tcp_vs_phttp_matchrule(struct tcp_vs_service *svc, http_request_t * req)
+tcp_vs_phttp_matchrule(struct tcp_vs_service *svc, struct tcp_vs_conn *conn,
+		       http_request_t * req)
 {
-	struct list_head *l;
-	struct tcp_vs_rule *r;
+	struct tcp_vs_route_rule *rr;
 	tcp_vs_dest_t *dest = NULL;
-	char *uri;
 
-	if (!(uri = kmalloc(req->uri_len + 1, GFP_KERNEL))) {
-		TCP_VS_ERR("No memory!\n");
-		return NULL;
-	}
-	memcpy(uri, req->uri_str, req->uri_len);
-	uri[req->uri_len] = '\0';
-	TCP_VS_DBG(5, "matching request URI: %s\n", uri);
-
-	read_lock(&svc->lock);
-	list_for_each(l, &svc->rule_list) {
-		r = list_entry(l, struct tcp_vs_rule, list);
-		if (!regexec(&r->rx, uri, 0, NULL, 0)) {
-			/* HIT */
-			dest =
-			    __tcp_vs_phttp_wlc_schedule(&r->destinations);
-			break;
-		}
+	TCP_VS_DBG(5, "matching request URI: %.*s\n",
+		   (int) req->uri_len, req->uri_str);
+
+	rcu_read_lock();
+	rr = tcp_vs_match_rule(svc, conn, req);
+	if (rr) {
+		/* HIT */
+		dest = tcp_vs_rule_dest(rr);
 	}
-	read_unlock(&svc->lock);
+	rcu_read_unlock();
 
-	kfree(uri);
 	return dest;
 }
 
@@ -189,10 +132,11 @@ tcp_vs_phttp_matchrule(struct tcp_vs_service *svc, http_request_t * req)
 *	get response from the specified server
 */
 static int
-http_get_response(struct socket *csock, struct socket *dsock,
-		  http_request_t * req, char *buffer, int buflen,
+http_get_response(struct socket *csock, http_inflight_t * rq,
+		  http_parser_t * parser, char *buffer, int buflen,
 		  int *close)
 {
+	struct socket *dsock = rq->sc->sock;
 	http_read_ctl_block_t read_ctl_blk;
 	http_buf_t	buff;
 	http_response_t resp;
@@ -223,42 +167,19 @@ http_get_response(struct socket *csock, struct socket *dsock,
 		interruptible_sleep_on_timeout(&dsock->wait, HZ);
 	}
 
-	/* read status line from server */
-	len = http_read_line(&read_ctl_blk, 0);
+	/* read the whole response header from server */
+	http_parser_init(parser, HTTP_PARSE_RESPONSE);
+	len = http_read_header(&read_ctl_blk, parser);
 	if (len < 0) {
-		TCP_VS_ERR("Error in reading status line from server\n");
-		goto exit;
-	}
-
-	/* xmit status line to client (2 more bytes for CRLF) */
-	if (tcp_vs_xmit(csock, read_ctl_blk.info, len + 2, MSG_MORE) < 0) {
-		TCP_VS_ERR("Error in sending status line\n");
+		TCP_VS_ERR("Error in reading response header from server\n");
 		goto exit;
 	}
 
-	/* parse status line */
 	memset(&resp, 0, sizeof(resp));
-	if (parse_http_status_line(read_ctl_blk.info, len, &resp) ==
-	    PARSE_ERROR) {
-		goto exit;
-	}
-
-	/* parse MIME header */
-	do {
-		if ((len = http_read_line(&read_ctl_blk, 0)) < 0) {
-			goto exit;
-		}
-
-		/* xmit MIME header (2 more bytes for CRLF) */
-		if (tcp_vs_xmit
-		    (csock, read_ctl_blk.info, len + 2, MSG_MORE) < 0) {
-			TCP_VS_ERR("Error in sending status line\n");
-			goto exit;
-		}
+	http_parser_response(parser, read_ctl_blk.info, &resp);
 
-		/* http_line_unescape (read_ctl_blk.info, len); */
-		http_mime_parse(read_ctl_blk.info, len, &resp.mime);
-	} while (len != 0);	/* http header end with CRLF,CRLF */
+	/* the header is sent to client with the first bytes of the body */
+	http_queue_header(&read_ctl_blk, read_ctl_blk.info, len);
 
 	*close = resp.mime.connection_close;
 
@@ -269,28 +190,56 @@ http_get_response(struct socket *csock, struct socket *dsock,
 	 * header fields, regardless of the entity-header fields present in
 	 * the message.
 	 */
-	if (req->method != HTTP_M_HEAD) {
-		if ((resp.status_code < 200)
-		    || (resp.status_code == 204
-			|| resp.status_code == 304)) {
-			ret = 0;
-			goto exit;
-		}
+	if (rq->method == HTTP_M_HEAD || resp.status_code < 200
+	    || resp.status_code == 204 || resp.status_code == 304) {
+		ret = http_xmit_pending(csock, &read_ctl_blk, 0);
+		goto exit;
+	}
 
-		ret =
-		    relay_http_message_body(csock, &read_ctl_blk,
-					    &resp.mime);
-		if (resp.mime.sep) {
-			kfree(resp.mime.sep);
-		}
+	ret = relay_http_message_body(csock, &read_ctl_blk, &resp.mime);
+	if (resp.mime.sep) {
+		kfree(resp.mime.sep);
 	}
 
       exit:
+	http_read_release(&read_ctl_blk);
 	LeaveFunction(5);
 	return ret;
 }
 
 
+/****************************************************************************
+*	return the response to the oldest request in flight to the client
+*
+*   The server connection is put back, or freed if the server closes it;
+*   then no more requests are read from the client.
+*/
+static int
+phttp_complete(struct socket *csock, http_pipeline_t * pl,
+	       http_parser_t * parser, char *buffer, int *closing)
+{
+	http_inflight_t *rq = http_pipeline_pop(pl);
+	int close_server;
+
+	if (http_get_response(csock, rq, parser, buffer, PAGE_SIZE,
+			      &close_server) < 0) {
+		tcp_vs_srvconn_free(rq->sc);
+		return -1;
+	}
+
+	if (close_server) {
+		TCP_VS_DBG(5, "Close server connection.\n");
+		tcp_vs_srvconn_free(rq->sc);
+		*closing = 1;	/* close the connection? tbd */
+		return 0;
+	}
+
+	/* have to put back the server connection when it is not used */
+	tcp_vs_srvconn_put(rq->sc);
+	return 0;
+}
+
+
 /****************************************************************************
 *	HTTP content-based scheduling:
 *	1, For http 1.0 request, parse the http request, select a server
@@ -314,15 +263,37 @@ tcp_vs_phttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 	int ret = 1;		/* scheduler has done all the jobs */
 	int len;
 	unsigned long last_read;
-	int close_server = 0;
+	int closing = 0;
 	tcp_vs_dest_t *dest;
 	struct socket *dsock;
 	server_conn_t *sc;
+	http_parser_t *parser, *rparser;
+	http_pipeline_t *pl;
+	http_inflight_t *rq;
+	int rewrite;
+	http_rewrite_t rw;
+	char rwbuf[HTTP_RW_BUFLEN];
 
 	DECLARE_WAITQUEUE(wait, current);
 
 	EnterFunction(5);
 
+	/* the responses get a parser of their own, a request waiting for
+	   the responses before it keeps its header index */
+	if (!(parser = kmalloc(2 * sizeof(http_parser_t), GFP_KERNEL))) {
+		TCP_VS_ERR("Out of memory!\n");
+		LeaveFunction(5);
+		return -2;
+	}
+	if (!(pl = kmalloc(sizeof(http_pipeline_t), GFP_KERNEL))) {
+		TCP_VS_ERR("Out of memory!\n");
+		kfree(parser);
+		LeaveFunction(5);
+		return -2;
+	}
+	http_pipeline_init(pl);
+	rparser = parser + 1;
+
 	/* init buffer for http message header */
 	if (http_read_init(&read_ctl_blk, conn->csock) != 0) {
 		TCP_VS_ERR("Out of memory!\n");
@@ -349,6 +320,20 @@ tcp_vs_phttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 
 	last_read = jiffies;
 	do {
+		/*
+		 * With responses outstanding, only a request that has
+		 * already come in is sent on, else the response to the
+		 * oldest request is returned first.
+		 */
+		if (pl->count > 0
+		    && (pl->count == pl->depth || closing
+			|| data_available(&read_ctl_blk) != 1)) {
+			if (phttp_complete(conn->csock, pl, rparser, buffer,
+					   &closing) < 0)
+				goto out;
+			continue;
+		}
+
 		switch (data_available(&read_ctl_blk)) {
 		case -1:
 			TCP_VS_DBG(5, "Socket error before reading "
@@ -386,27 +371,41 @@ tcp_vs_phttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 			break;
 		}
 
-		/* read request line from client socket */
-		len = http_read_line(&read_ctl_blk, 0);
+		/* read and index the whole http message header */
+		http_parser_init(parser, 0);
+		len = http_read_header(&read_ctl_blk, parser);
 		if (len < 0) {
-			TCP_VS_ERR("Error reading request line from client\n");
+			TCP_VS_ERR("Error reading request header from client\n");
 			ret = -2;
 			goto out;
 		}
 
-		/* parse the http request line */
+		/* fill in the request from the header index */
 		memset(&req, 0, sizeof(req));
-		if (parse_http_request_line(read_ctl_blk.info, len, &req)
+		if (http_parser_request(parser, read_ctl_blk.info, &req)
 		    != PARSE_OK) {
 			TCP_VS_ERR("Cannot parse http request\n");
 			ret = -2;
 			goto out;
 		}
 
+		/* a request with side effects, or one relayed on its own
+		   connection, waits for the responses to the requests
+		   before it; it has been read from the client, so it goes
+		   out even if a server closes meanwhile */
+		while (pl->count > 0 && (!HTTP_PIPELINE_SAFE(req.method)
+					 || req.version <=
+					 HTTP_VERSION(1, 0))) {
+			if (phttp_complete(conn->csock, pl, rparser, buffer,
+					   &closing) < 0)
+				goto out;
+		}
+
 		/* select a server */
-		//dest = tcp_vs_phttp_matchrule(svc, &req);
+		//dest = tcp_vs_phttp_matchrule(svc, conn, &req);
 		/* enable load balance */
-		dest = tcp_vs_hhttp_matchrule(svc, &req);
+		rewrite = 0;
+		dest = tcp_vs_hhttp_matchrule(svc, conn, &req, &rewrite);
 		if (!dest) {
 			TCP_VS_DBG(5, "Can't find a right server\n");
 			if (read_ctl_blk.flag == MSG_PEEK) {
@@ -433,8 +432,29 @@ tcp_vs_phttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 				goto out;
 			}
 
-			atomic_inc(&dest->conns);
+			tcp_vs_dest_inc_conns(dest);
 			conn->dest = dest;
+
+			/* the header of a follow-up request has been read
+			   from the client, pass it on before relaying; the
+			   peeked first request is relayed raw, unchanged */
+			if (read_ctl_blk.flag != MSG_PEEK) {
+				http_queue_request(&read_ctl_blk, parser,
+						   &req, len, rewrite,
+						   inet_sk(conn->csock->sk)->
+						   daddr, &rw, rwbuf);
+				if (read_ctl_blk.remaining > 0)
+					http_queue_header(&read_ctl_blk,
+							  read_ctl_blk.info +
+							  len,
+							  read_ctl_blk.
+							  remaining);
+				if (http_xmit_pending(conn->dsock,
+						      &read_ctl_blk, 0) < 0) {
+					ret = -2;
+					goto out;
+				}
+			}
 			ret = 0;
 			goto out;
 		}
@@ -470,48 +490,27 @@ tcp_vs_phttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 			goto lookup_again;
 		}
 
-		/* re-read the peeked data for the first http request of
+		/* re-read the peeked header for the first http request of
 		   a connection */
 		if (read_ctl_blk.flag == MSG_PEEK) {
 			read_ctl_blk.flag = 0;
-			read_ctl_blk.offset = 0;
+			read_ctl_blk.offset = len;
 			read_ctl_blk.remaining = 0;
+			read_ctl_blk.cur_buf->data_len = len;
 			if (tcp_vs_recvbuffer(conn->csock,
 					      read_ctl_blk.cur_buf->buf,
-					      len + 2, 0) != (len + 2)) {
+					      len, 0) != len) {
 				TCP_VS_ERR("Error in re-reading http "
-					   "request line\n");
+					   "request header\n");
 				tcp_vs_srvconn_put(sc);
 				goto out;
 			}
 		}
 
-		/* xmit request line (2 more bytes for CRLF) */
-		if (tcp_vs_xmit
-		    (dsock, read_ctl_blk.info, len + 2, MSG_MORE) < 0) {
-			TCP_VS_ERR("Error in sending request line\n");
-			goto out_free;
-		}
-
-		/* Process MIME header */
-		do {
-			len = http_read_line(&read_ctl_blk, 0);
-			if (len < 0) {
-				tcp_vs_srvconn_put(sc);
-				goto out;
-			}
-
-			/* xmit MIME header (2 more bytes for CRLF) */
-			if (tcp_vs_xmit
-			    (dsock, read_ctl_blk.info, len + 2,
-			     MSG_MORE) < 0) {
-				TCP_VS_ERR("Error in sending MIME header\n");
-				goto out_free;
-			}
-
-			/* http_line_unescape (read_ctl_blk.info, len); */
-			http_mime_parse(read_ctl_blk.info, len, &req.mime);
-		} while (len != 0);	/* http header end with CRLF,CRLF */
+		/* the message header goes out with the body */
+		http_queue_request(&read_ctl_blk, parser, &req, len, rewrite,
+				   inet_sk(conn->csock->sk)->daddr, &rw,
+				   rwbuf);
 
 		if (relay_http_message_body
 		    (dsock, &read_ctl_blk, &req.mime) != 0) {
@@ -519,25 +518,26 @@ tcp_vs_phttp_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 			goto out_free;
 		}
 
-		if (http_get_response(conn->csock, dsock, &req, buffer,
-				      PAGE_SIZE, &close_server) < 0) {
-			goto out_free;
-		}
-
-		if (close_server) {
-			TCP_VS_DBG(5, "Close server connection.\n");
-			goto out_free;	/* close the connection? tbd */
-		}
+		/* the response is returned when its turn comes */
+		rq = http_pipeline_push(pl);
+		rq->sc = sc;
+		rq->method = req.method;
+		rq->session_id = req.mime.session_id;
 
-		/* have to put back the server connection when
-		   it is not used */
-		tcp_vs_srvconn_put(sc);
-	} while (req.mime.connection_close != 1 && conn->csock->sk->sk_state == TCP_ESTABLISHED);
+		if (req.mime.connection_close == 1
+		    || conn->csock->sk->sk_state != TCP_ESTABLISHED)
+			closing = 1;
+	} while (!closing || pl->count > 0);
 
       out:
+	/* drop the requests whose responses are not returned */
+	while (pl->count > 0)
+		tcp_vs_srvconn_free(http_pipeline_pop(pl)->sc);
 	free_page((unsigned long) buffer);
       out_nobuffer:
+	kfree(pl);
 	http_read_free(&read_ctl_blk);
+	kfree(parser);
 	LeaveFunction(5);
 	return ret;
 
@@ -554,6 +554,7 @@ static struct tcp_vs_scheduler tcp_vs_phttp_scheduler = {
 	tcp_vs_phttp_done_svc,	/* done */
 	tcp_vs_phttp_update_svc,	/* update */
 	tcp_vs_phttp_schedule,	/* select a server by http request */
+	TCP_VS_SCHED_F_RULE_HEAP,	/* flags */
 };
 
 static int __init
@@ -0,0 +1,2010 @@
+/*
+ * KTCPVS       An implementation of the TCP Virtual Server daemon inside
+ *              kernel for the LINUX operating system. KTCPVS can be used
+ *              to build a moderately scalable and highly available server
+ *              based on a cluster of servers, with more flexibility.
+ *
+ * tcp_vs_rule.c: matching the requests against the rules of a service
+ *
+ * Version:     $Id: tcp_vs_rule.c,v 1.1 2005/03/02 10:14:21 wensong Exp $
+ *
+ * Authors:     Wensong Zhang <wensong@linuxvirtualserver.org>
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/ctype.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/percpu.h>
+#include <linux/jhash.h>
+
+#include "tcp_vs.h"
+#include "tcp_vs_http_parser.h"
+
+
+/*
+ * The rules of a service are tried in list order and the first rule
+ * whose pattern matches is used. A rule looks at the URI, the Host or
+ * another header, a cookie or the method of the request, or at the
+ * address of the client, see TCP_VS_RULE_*. Instead of running regexec
+ * for one rule after the other, the patterns of the rules that look at
+ * the same thing are compiled together into a DFA whenever the rule
+ * list changes. Every DFA state knows the first rule that has matched
+ * when it is reached, so the URI is routed in one pass over it, the
+ * Host in one pass over the Host and so on. The first rule found for
+ * each of them wins, and the ones whose rules all come after the rule
+ * found so far are not looked at.
+ *
+ * The compiler understands the extended regular expressions the way
+ * regcomp parses them, except for character classes, collating
+ * elements, word boundaries and 8 bit characters. A rule using them is
+ * still matched by regexec, at its place in the list. A run of rules
+ * that needs too many states is split into several automata, which
+ * are tried in order.
+ *
+ * Most rules are literal paths like ^/static/ or hosts like
+ * ^www\.example\.com$ though. They are kept out of the automata and
+ * looked up in a compressed trie first, then only the rules before the
+ * one found there are tried. The rules on the client address are
+ * tried last, in list order. A rule on a tag of the prefix table of
+ * the service looks the client up in the table, once per request, see
+ * tcp_vs_lpm.c.
+ *
+ * The order of the list only costs time for the rules left to regexec.
+ * When the net.ktcpvs.rule_reorder sysctl is set, a run of them that
+ * can never match the same request is tried by the number of requests
+ * each has routed, and the routes are rebuilt every rule_reorder
+ * seconds when the hits no longer follow that order. Two rules are
+ * known not to overlap if their patterns are anchored literals that
+ * differ before either ends, like ^/shop/ and ^/blog/, or if the admin
+ * marked both of them TCP_VS_RULE_O_ANYORDER. The first rule of such a
+ * run that matches is the only one, so the list order is kept.
+ *
+ * In front of all that, every CPU keeps the rules found for the URIs
+ * and Hosts it has seen last, if the rules look at nothing else. An
+ * entry is good while the routing data of the service is the one it
+ * was made from, see struct tcp_vs_route.
+ */
+#define RULE_NFA_MAX		4096	/* NFA states of one automaton */
+#define RULE_DFA_MAX		4096	/* DFA states of one automaton */
+#define RULE_KEPT_MAX		(256 * 1024)	/* NFA states kept while building */
+#define RULE_SETS_MAX		1024	/* character sets of one automaton */
+#define RULE_DEPTH_MAX		8	/* nesting of the parentheses */
+#define RULE_HASH_SIZE		1024
+#define RULE_NONE		0xffff
+#define RULE_CACHE_SIZE		128	/* entries per CPU, a power of 2 */
+#define RULE_CACHE_KEY		96	/* longer URI and Host not cached */
+#define RULE_REORDER_SLACK	16	/* hits a rule must be ahead by */
+
+/* the rules that may be cached, their result only depends on the key */
+#define RULE_CACHE_TYPES	((1 << TCP_VS_RULE_URI) | (1 << TCP_VS_RULE_HOST))
+
+#define DUP_MAX			255	/* as RE_DUP_MAX of regcomp */
+
+/* parse tree of a pattern */
+enum {
+	RX_SET,			/* one character of a set */
+	RX_CAT,			/* concatenation */
+	RX_ALT,			/* alternation */
+	RX_REP,			/* *, +, ? and the bounds */
+	RX_BOL,			/* ^ */
+	RX_EOL,			/* $ */
+	RX_EMPTY,		/* () */
+};
+
+struct rx_node {
+	int type;
+	int set;		/* RX_SET */
+	int min, max;		/* RX_REP, max < 0 if unbounded */
+	struct rx_node *kid;	/* subexpressions, kept in reverse order */
+	struct rx_node *sib;
+};
+
+/* NFA states */
+enum {
+	NS_SET,			/* consume a character of the set arg */
+	NS_SPLIT,		/* go on to out and arg */
+	NS_BOL,			/* go on to out at the start of the URI */
+	NS_EOL,			/* go on to out at the end of the URI */
+	NS_MATCH,		/* the rule has matched */
+};
+
+struct rule_nstate {
+	int out;
+	int arg;
+	unsigned short rule;
+	unsigned char type;
+};
+
+/* closure flags */
+#define CL_BOL			0x0001
+#define CL_EOL			0x0002
+
+struct rule_dstate {
+	unsigned short accept;		/* first rule matched here */
+	unsigned short accept_eol;	/* first rule matched if the URI ends */
+	unsigned short reach;		/* first rule that may still match */
+	unsigned short next[0];		/* next state by byte class */
+};
+
+struct rule_dfa {
+	unsigned char class[256];
+	int nclasses;
+	int nstates;
+	struct rule_dstate **states;
+};
+
+/* a run of rules matched by one automaton, or rules left to regexec */
+struct rule_seg {
+	int first;		/* in rx of the rule set */
+	int count;
+	int min;		/* its first rule in list order */
+	struct rule_dfa *dfa;
+};
+
+/* the URI and Host to rule cache of a CPU */
+struct rule_centry {
+	unsigned int gen;		/* route->gen when it was made */
+	unsigned int hash;
+	int len;			/* of the URI */
+	int hlen;			/* of the Host, -1 if there is none */
+	int rule;			/* in route->rules, -1 if none */
+	char key[RULE_CACHE_KEY];	/* the URI, then the Host */
+};
+
+struct tcp_vs_rule_cache {
+	unsigned int hits;
+	unsigned int misses;
+	struct rule_centry entries[RULE_CACHE_SIZE];
+};
+
+/* node of the trie of the literal rules */
+struct rule_trie {
+	struct rule_trie *all;	/* list of all nodes, to free them */
+	unsigned short prefix;	/* first rule matching the paths below */
+	unsigned short exact;	/* first rule matching this path only */
+	int nkids;
+	struct rule_trie **kids;	/* by the first byte of their label */
+	int len;
+	unsigned char label[0];	/* the bytes from the parent */
+};
+
+/* the rules that look at the same thing */
+struct rule_subject {
+	int type;
+	const char *name;		/* of the header or cookie */
+	int first;			/* the first of its rules */
+	struct rule_trie *trie;		/* its literal rules */
+	int nrx;
+	int *rx;			/* its other rules */
+	int nsegs;
+	struct rule_seg *segs;
+};
+
+/* a rule on the address of the client */
+struct rule_src {
+	__u32 addr, mask;
+	int tag;
+	int rule;
+};
+
+struct tcp_vs_rule_set {
+	int nrules;
+	struct tcp_vs_rule **rules;	/* in list order */
+	int nsubjects;
+	struct rule_subject *subjects;	/* by their first rule */
+	int nsrc;
+	struct rule_src *src;		/* in list order */
+	int *rx;			/* room for the rx of the subjects */
+	struct rule_seg *segs;		/* and for their segments */
+	int reorder;			/* built with rule_reorder set */
+};
+
+/* scratch space of the compiler */
+struct rule_build {
+	/* pattern parser */
+	const unsigned char *next, *end;
+	int depth;
+	struct rx_node *nodes;
+	int nnodes;
+	int anchors;
+
+	/* character sets, a single character has one set only */
+	__u32 (*sets)[8];
+	int nsets;
+	short single[256];
+
+	/* subject of each rule */
+	int *subject;
+
+	/* NFA of a run of rules */
+	struct rule_nstate *nfa;
+	int nnfa;
+	int *starts;
+	int rule;
+
+	/* subset construction */
+	int *mark;
+	int gen;
+	int *stack;
+	int *buf;
+	short remap[256][2];
+	unsigned char rep[256];
+	int ndfa;
+	int kept;
+	struct rule_dstate **dstates;
+	int **dsets;
+	int *dlen;
+	int *hnext;
+	int htab[RULE_HASH_SIZE];
+};
+
+#define RX_NODES_MAX		(3 * KTCPVS_PATTERN_MAXLEN + 4)
+
+#define RX_MORE(b)		((b)->next < (b)->end)
+#define RX_MORE2(b)		((b)->next + 1 < (b)->end)
+#define RX_PEEK(b)		((b)->next[0])
+#define RX_PEEK2(b)		((b)->next[1])
+
+#define SET_ADD(s, c)		((s)[(c) >> 5] |= 1U << ((c) & 31))
+#define SET_HAS(s, c)		((s)[(c) >> 5] & (1U << ((c) & 31)))
+
+
+/****************************************************************************
+*	Pattern parser, it follows p_ere of regcomp and gives up on
+*	anything that is not handled by the automaton.
+*/
+static struct rx_node *
+rx_new(struct rule_build *b, int type)
+{
+	struct rx_node *n;
+
+	if (b->nnodes >= RX_NODES_MAX)
+		return NULL;
+	n = &b->nodes[b->nnodes++];
+	memset(n, 0, sizeof(*n));
+	n->type = type;
+	return n;
+}
+
+static struct rx_node *
+rx_set(struct rule_build *b, __u32 * set)
+{
+	struct rx_node *n;
+	int i;
+
+	for (i = 0; i < b->nsets; i++)
+		if (!memcmp(b->sets[i], set, sizeof(b->sets[i])))
+			break;
+	if (i == b->nsets) {
+		if (b->nsets >= RULE_SETS_MAX)
+			return NULL;
+		memcpy(b->sets[b->nsets++], set, sizeof(b->sets[i]));
+	}
+
+	if ((n = rx_new(b, RX_SET)))
+		n->set = i;
+	return n;
+}
+
+static struct rx_node *
+rx_char(struct rule_build *b, int c)
+{
+	__u32 set[8];
+	struct rx_node *n;
+
+	if (c == 0 || c >= 0x80)
+		return NULL;
+
+	if (b->single[c] >= 0) {
+		if ((n = rx_new(b, RX_SET)))
+			n->set = b->single[c];
+		return n;
+	}
+
+	memset(set, 0, sizeof(set));
+	SET_ADD(set, c);
+	if ((n = rx_set(b, set)))
+		b->single[c] = n->set;
+	return n;
+}
+
+static struct rx_node *
+rx_bracket(struct rule_build *b)
+{
+	__u32 set[8];
+	int invert = 0;
+	int start, finish, i;
+
+	/* [[:<:]] and [[:>:]] */
+	if (b->end - b->next >= 6
+	    && (!memcmp(b->next, "[:<:]]", 6)
+		|| !memcmp(b->next, "[:>:]]", 6)))
+		return NULL;
+
+	memset(set, 0, sizeof(set));
+	if (RX_MORE(b) && RX_PEEK(b) == '^') {
+		b->next++;
+		invert = 1;
+	}
+	if (RX_MORE(b) && (RX_PEEK(b) == ']' || RX_PEEK(b) == '-')) {
+		SET_ADD(set, RX_PEEK(b));
+		b->next++;
+	}
+
+	while (RX_MORE(b) && RX_PEEK(b) != ']'
+	       && !(RX_PEEK(b) == '-' && RX_MORE2(b)
+		    && RX_PEEK2(b) == ']')) {
+		if (RX_PEEK(b) == '-')
+			return NULL;
+		if (RX_PEEK(b) == '[' && RX_MORE2(b)
+		    && (RX_PEEK2(b) == ':' || RX_PEEK2(b) == '='
+			|| RX_PEEK2(b) == '.'))
+			return NULL;
+		start = finish = *b->next++;
+		if (RX_MORE(b) && RX_PEEK(b) == '-'
+		    && RX_MORE2(b) && RX_PEEK2(b) != ']') {
+			b->next++;
+			if (RX_PEEK(b) == '[' && RX_MORE2(b)
+			    && RX_PEEK2(b) == '.')
+				return NULL;
+			finish = *b->next++;
+		}
+		if (start > finish || finish >= 0x80)
+			return NULL;
+		for (i = start; i <= finish; i++)
+			SET_ADD(set, i);
+	}
+	if (RX_MORE(b) && RX_PEEK(b) == '-') {
+		b->next++;
+		SET_ADD(set, '-');
+	}
+	if (!RX_MORE(b) || RX_PEEK(b) != ']')
+		return NULL;
+	b->next++;
+
+	if (invert)
+		for (i = 0; i < 8; i++)
+			set[i] = ~set[i];
+
+	return rx_set(b, set);
+}
+
+static int
+rx_count(struct rule_build *b)
+{
+	int count = 0, ndigits = 0;
+
+	while (RX_MORE(b) && isdigit(RX_PEEK(b)) && count <= DUP_MAX) {
+		count = count * 10 + (*b->next++ - '0');
+		ndigits++;
+	}
+	if (ndigits == 0 || count > DUP_MAX)
+		return -1;
+	return count;
+}
+
+static struct rx_node *rx_alt(struct rule_build *b);
+
+/* an atom and its repetition */
+static struct rx_node *
+rx_atom(struct rule_build *b)
+{
+	struct rx_node *n, *r;
+	__u32 set[8];
+	int c, wascaret = 0;
+	int anchors = b->anchors;
+
+	c = *b->next++;
+	switch (c) {
+	case '(':
+		if (++b->depth > RULE_DEPTH_MAX)
+			return NULL;
+		if (RX_MORE(b) && RX_PEEK(b) == ')')
+			n = rx_new(b, RX_EMPTY);
+		else
+			n = rx_alt(b);
+		if (!n || !RX_MORE(b) || RX_PEEK(b) != ')')
+			return NULL;
+		b->next++;
+		b->depth--;
+		break;
+	case '^':
+		n = rx_new(b, RX_BOL);
+		b->anchors++;
+		wascaret = 1;
+		break;
+	case '$':
+		n = rx_new(b, RX_EOL);
+		b->anchors++;
+		break;
+	case '.':
+		memset(set, 0xff, sizeof(set));
+		n = rx_set(b, set);
+		break;
+	case '[':
+		n = rx_bracket(b);
+		break;
+	case '\\':
+		if (!RX_MORE(b))
+			return NULL;
+		n = rx_char(b, *b->next++);
+		break;
+	case ')':
+	case '|':
+	case '*':
+	case '+':
+	case '?':
+		return NULL;
+	case '{':
+		if (RX_MORE(b) && isdigit(RX_PEEK(b)))
+			return NULL;
+		/* fall through */
+	default:
+		n = rx_char(b, c);
+		break;
+	}
+
+	if (!n || !RX_MORE(b))
+		return n;
+	c = RX_PEEK(b);
+	if (!(c == '*' || c == '+' || c == '?'
+	      || (c == '{' && RX_MORE2(b) && isdigit(RX_PEEK2(b)))))
+		return n;
+	b->next++;
+	/* regexec tries ^ and $ as often as they are in the pattern, a
+	   repeated one may fail where the automaton would match */
+	if (wascaret || anchors != b->anchors || !(r = rx_new(b, RX_REP)))
+		return NULL;
+	r->kid = n;
+
+	switch (c) {
+	case '*':
+		r->min = 0;
+		r->max = -1;
+		break;
+	case '+':
+		r->min = 1;
+		r->max = -1;
+		break;
+	case '?':
+		r->min = 0;
+		r->max = 1;
+		break;
+	case '{':
+		if ((r->min = rx_count(b)) < 0)
+			return NULL;
+		r->max = r->min;
+		if (RX_MORE(b) && RX_PEEK(b) == ',') {
+			b->next++;
+			r->max = -1;
+			if (RX_MORE(b) && isdigit(RX_PEEK(b))) {
+				r->max = rx_count(b);
+				if (r->max < r->min)
+					return NULL;
+			}
+		}
+		if (!RX_MORE(b) || RX_PEEK(b) != '}')
+			return NULL;
+		b->next++;
+		break;
+	}
+
+	/* a repeated repetition is an error in regcomp */
+	if (RX_MORE(b)) {
+		c = RX_PEEK(b);
+		if (c == '*' || c == '+' || c == '?'
+		    || (c == '{' && RX_MORE2(b) && isdigit(RX_PEEK2(b))))
+			return NULL;
+	}
+	return r;
+}
+
+static struct rx_node *
+rx_cat(struct rule_build *b)
+{
+	struct rx_node *cat, *n;
+
+	if (!(cat = rx_new(b, RX_CAT)))
+		return NULL;
+	while (RX_MORE(b) && RX_PEEK(b) != '|' && RX_PEEK(b) != ')') {
+		if (!(n = rx_atom(b)))
+			return NULL;
+		n->sib = cat->kid;
+		cat->kid = n;
+	}
+	return cat;
+}
+
+static struct rx_node *
+rx_alt(struct rule_build *b)
+{
+	struct rx_node *alt, *n;
+
+	if (!(alt = rx_new(b, RX_ALT)))
+		return NULL;
+	for (;;) {
+		if (!(n = rx_cat(b)))
+			return NULL;
+		n->sib = alt->kid;
+		alt->kid = n;
+		if (!RX_MORE(b) || RX_PEEK(b) != '|')
+			break;
+		b->next++;
+	}
+	return alt;
+}
+
+static struct rx_node *
+rx_parse(struct rule_build *b, const char *pattern)
+{
+	struct rx_node *n;
+
+	b->next = (const unsigned char *) pattern;
+	b->end = b->next + strlen(pattern);
+	b->depth = 0;
+	b->nnodes = 0;
+	b->anchors = 0;
+
+	n = rx_alt(b);
+	if (n == NULL || RX_MORE(b))
+		return NULL;
+	return n;
+}
+
+static int
+rx_supported(struct rule_build *b, const char *pattern)
+{
+	b->nsets = 0;
+	memset(b->single, 0xff, sizeof(b->single));
+	return rx_parse(b, pattern) != NULL;
+}
+
+
+/****************************************************************************
+*	Thompson construction, a node is emitted in front of the state
+*	that follows it.
+*/
+static int
+nfa_new(struct rule_build *b, int type, int out, int arg)
+{
+	struct rule_nstate *s;
+
+	if (b->nnfa >= RULE_NFA_MAX)
+		return -1;
+	s = &b->nfa[b->nnfa];
+	s->type = type;
+	s->out = out;
+	s->arg = arg;
+	s->rule = b->rule;
+	return b->nnfa++;
+}
+
+static int
+rx_emit(struct rule_build *b, struct rx_node *n, int next)
+{
+	struct rx_node *k;
+	int start, s, i;
+
+	switch (n->type) {
+	case RX_SET:
+		return nfa_new(b, NS_SET, next, n->set);
+	case RX_BOL:
+		return nfa_new(b, NS_BOL, next, 0);
+	case RX_EOL:
+		return nfa_new(b, NS_EOL, next, 0);
+	case RX_EMPTY:
+		return next;
+	case RX_CAT:
+		for (k = n->kid; k && next >= 0; k = k->sib)
+			next = rx_emit(b, k, next);
+		return next;
+	case RX_ALT:
+		start = -1;
+		for (k = n->kid; k; k = k->sib) {
+			if ((s = rx_emit(b, k, next)) < 0)
+				return -1;
+			if (start >= 0)
+				s = nfa_new(b, NS_SPLIT, s, start);
+			if ((start = s) < 0)
+				return -1;
+		}
+		return start;
+	case RX_REP:
+		if (n->max < 0) {
+			/* the loop of x* */
+			if ((s = nfa_new(b, NS_SPLIT, -1, next)) < 0)
+				return -1;
+			if ((start = rx_emit(b, n->kid, s)) < 0)
+				return -1;
+			b->nfa[s].out = start;
+			next = s;
+		} else {
+			/* x{0,k} as (x(x(x)?)?)? */
+			start = next;
+			for (i = n->min; i < n->max; i++) {
+				if ((s = rx_emit(b, n->kid, start)) < 0)
+					return -1;
+				if ((start = nfa_new(b, NS_SPLIT, s, next)) < 0)
+					return -1;
+			}
+			next = start;
+		}
+		for (i = 0; i < n->min && next >= 0; i++)
+			next = rx_emit(b, n->kid, next);
+		return next;
+	}
+	return -1;
+}
+
+
+/****************************************************************************
+*	Subset construction
+*/
+static void
+rule_sort(int *a, int n)
+{
+	int gap, i, j, t;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			t = a[i];
+			for (j = i; j >= gap && a[j - gap] > t; j -= gap)
+				a[j] = a[j - gap];
+			a[j] = t;
+		}
+}
+
+/*
+ *	Follow the empty moves from the nsp states on the stack, and
+ *	collect the states that consume a character, match or wait for
+ *	the end of the URI into b->buf, sorted. Returns their number.
+ */
+static int
+rule_closure(struct rule_build *b, int nsp, int flags)
+{
+	struct rule_nstate *ns;
+	int s, n = 0;
+
+	b->gen++;
+	while (nsp > 0) {
+		s = b->stack[--nsp];
+		if (b->mark[s] == b->gen)
+			continue;
+		b->mark[s] = b->gen;
+		ns = &b->nfa[s];
+
+		switch (ns->type) {
+		case NS_SPLIT:
+			b->stack[nsp++] = ns->out;
+			b->stack[nsp++] = ns->arg;
+			break;
+		case NS_BOL:
+			if (flags & CL_BOL)
+				b->stack[nsp++] = ns->out;
+			break;
+		case NS_EOL:
+			if (flags & CL_EOL)
+				b->stack[nsp++] = ns->out;
+			else
+				b->buf[n++] = s;
+			break;
+		default:
+			b->buf[n++] = s;
+			break;
+		}
+	}
+
+	rule_sort(b->buf, n);
+	return n;
+}
+
+/*
+ *	Look up the DFA state of the NFA states in b->buf, add it if it
+ *	is new. Returns the state or -E2BIG if the automaton is too big.
+ */
+static int
+rule_dfa_state(struct rule_build *b, int n, int nclasses, int hashed)
+{
+	struct rule_dstate *ds;
+	unsigned int h = 0;
+	int i, s, *set;
+
+	for (i = 0; i < n; i++)
+		h = h * 31 + b->buf[i];
+	h %= RULE_HASH_SIZE;
+
+	if (hashed)
+		for (s = b->htab[h]; s >= 0; s = b->hnext[s])
+			if (b->dlen[s] == n
+			    && !memcmp(b->dsets[s], b->buf, n * sizeof(int)))
+				return s;
+
+	if (b->ndfa >= RULE_DFA_MAX || b->kept + n > RULE_KEPT_MAX)
+		return -E2BIG;
+
+	ds = kmalloc(sizeof(*ds) + nclasses * sizeof(ds->next[0]),
+		     GFP_KERNEL);
+	set = kmalloc((n ? n : 1) * sizeof(int), GFP_KERNEL);
+	if (!ds || !set) {
+		kfree(ds);
+		kfree(set);
+		return -ENOMEM;
+	}
+	memcpy(set, b->buf, n * sizeof(int));
+
+	ds->accept = ds->accept_eol = ds->reach = RULE_NONE;
+	for (i = 0; i < n; i++) {
+		struct rule_nstate *ns = &b->nfa[set[i]];
+
+		if (ns->type == NS_MATCH && ns->rule < ds->accept)
+			ds->accept = ns->rule;
+		if (ns->rule < ds->reach)
+			ds->reach = ns->rule;
+	}
+
+	s = b->ndfa++;
+	b->dstates[s] = ds;
+	b->dsets[s] = set;
+	b->dlen[s] = n;
+	b->kept += n;
+	b->hnext[s] = -1;
+	if (hashed) {
+		b->hnext[s] = b->htab[h];
+		b->htab[h] = s;
+	}
+	return s;
+}
+
+/*
+ *	Split the bytes into the classes that no character set tells
+ *	apart, the DFA has a column for each class only.
+ */
+static int
+rule_classes(struct rule_build *b, unsigned char *class)
+{
+	int i, c, n = 1;
+
+	memset(class, 0, 256);
+	for (i = 0; i < b->nsets; i++) {
+		memset(b->remap, 0xff, sizeof(b->remap));
+		n = 0;
+		for (c = 0; c < 256; c++) {
+			short *m = &b->remap[class[c]][!!SET_HAS(b->sets[i], c)];
+
+			if (*m < 0)
+				*m = n++;
+			class[c] = *m;
+		}
+	}
+
+	for (c = 255; c >= 0; c--)
+		b->rep[class[c]] = c;
+	return n;
+}
+
+static void
+rule_dfa_free(struct rule_dfa *dfa)
+{
+	int i;
+
+	for (i = 0; i < dfa->nstates; i++)
+		kfree(dfa->states[i]);
+	kfree(dfa->states);
+	kfree(dfa);
+}
+
+/*
+ *	Compile the count rules into one automaton
+ */
+static int
+rule_build_dfa(struct rule_build *b, struct tcp_vs_rule_set *set,
+	       struct rule_subject *sj, int first, int count,
+	       struct rule_dfa **res)
+{
+	struct rule_dfa *dfa;
+	struct rx_node *n;
+	int i, j, k, nsp, cnt, s, m;
+	int ret = 0;
+
+	b->nsets = 0;
+	memset(b->single, 0xff, sizeof(b->single));
+	b->nnfa = 0;
+	for (i = 0; i < count; i++) {
+		b->rule = i;
+		/* the rules parse alone, so it is the set table that is full */
+		if (!(n = rx_parse(b, set->rules[sj->rx[first + i]]->pattern)))
+			return -E2BIG;
+		if ((m = nfa_new(b, NS_MATCH, -1, 0)) < 0
+		    || (b->starts[i] = rx_emit(b, n, m)) < 0)
+			return -E2BIG;
+	}
+
+	if (!(dfa = kmalloc(sizeof(*dfa), GFP_KERNEL)))
+		return -ENOMEM;
+	memset(dfa, 0, sizeof(*dfa));
+	dfa->nclasses = rule_classes(b, dfa->class);
+
+	b->ndfa = 0;
+	b->kept = 0;
+	memset(b->htab, 0xff, sizeof(b->htab));
+
+	/* the start state, the only one where ^ matches */
+	memcpy(b->stack, b->starts, count * sizeof(int));
+	cnt = rule_closure(b, count, CL_BOL);
+	if ((ret = rule_dfa_state(b, cnt, dfa->nclasses, 0)) < 0)
+		goto out;
+
+	for (i = 0; i < b->ndfa; i++) {
+		struct rule_dstate *ds = b->dstates[i];
+		int *set = b->dsets[i];
+		int n = b->dlen[i];
+
+		/* the rules that match if the URI ends here */
+		nsp = 0;
+		for (j = 0; j < n; j++)
+			if (b->nfa[set[j]].type == NS_EOL)
+				b->stack[nsp++] = b->nfa[set[j]].out;
+		cnt = rule_closure(b, nsp, CL_EOL | (i ? 0 : CL_BOL));
+		ds->accept_eol = ds->accept;
+		for (j = 0; j < cnt; j++) {
+			struct rule_nstate *ns = &b->nfa[b->buf[j]];
+
+			if (ns->type == NS_MATCH && ns->rule < ds->accept_eol)
+				ds->accept_eol = ns->rule;
+		}
+
+		/* regexec searches, all the rules start again at every
+		   character */
+		for (k = 0; k < dfa->nclasses; k++) {
+			memcpy(b->stack, b->starts, count * sizeof(int));
+			nsp = count;
+			for (j = 0; j < n; j++) {
+				struct rule_nstate *ns = &b->nfa[set[j]];
+
+				if (ns->type == NS_SET
+				    && SET_HAS(b->sets[ns->arg], b->rep[k]))
+					b->stack[nsp++] = ns->out;
+			}
+			cnt = rule_closure(b, nsp, 0);
+			if ((s = rule_dfa_state(b, cnt, dfa->nclasses, 1)) < 0) {
+				ret = s;
+				goto out;
+			}
+			ds->next[k] = s;
+		}
+	}
+
+	dfa->states = kmalloc(b->ndfa * sizeof(*dfa->states), GFP_KERNEL);
+	if (dfa->states == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(dfa->states, b->dstates, b->ndfa * sizeof(*dfa->states));
+	dfa->nstates = b->ndfa;
+	ret = 0;
+
+      out:
+	for (i = 0; i < b->ndfa; i++) {
+		kfree(b->dsets[i]);
+		if (ret)
+			kfree(b->dstates[i]);
+	}
+	if (ret)
+		kfree(dfa);
+	else
+		*res = dfa;
+	return ret;
+}
+
+/*
+ *	Compile a run of rules, halving it while the automaton gets too
+ *	big. A single rule that is still too big is left to regexec.
+ */
+static int
+rule_build_run(struct rule_build *b, struct tcp_vs_rule_set *set,
+	       struct rule_subject *sj, int first, int count)
+{
+	struct rule_dfa *dfa = NULL;
+	struct rule_seg *seg;
+	int ret, i;
+
+	ret = rule_build_dfa(b, set, sj, first, count, &dfa);
+	if (ret == -E2BIG && count > 1) {
+		ret = rule_build_run(b, set, sj, first, count / 2);
+		if (ret == 0)
+			ret = rule_build_run(b, set, sj, first + count / 2,
+					     count - count / 2);
+		return ret;
+	}
+	if (ret == -E2BIG)
+		ret = 0;
+	if (ret)
+		return ret;
+
+	seg = &sj->segs[sj->nsegs++];
+	seg->first = first;
+	seg->count = count;
+	seg->min = sj->rx[first];
+	seg->dfa = dfa;
+	if (dfa)
+		for (i = first; i < first + count; i++)
+			set->rules[sj->rx[i]]->flags |= TCP_VS_RULE_F_DFA;
+	return 0;
+}
+
+static void
+rule_build_free(struct rule_build *b)
+{
+	kfree(b->nodes);
+	kfree(b->sets);
+	kfree(b->subject);
+	kfree(b->nfa);
+	kfree(b->starts);
+	kfree(b->mark);
+	kfree(b->stack);
+	kfree(b->buf);
+	kfree(b->dstates);
+	kfree(b->dsets);
+	kfree(b->dlen);
+	kfree(b->hnext);
+	kfree(b);
+}
+
+static struct rule_build *
+rule_build_new(int nrules)
+{
+	struct rule_build *b;
+
+	if (!(b = kmalloc(sizeof(*b), GFP_KERNEL)))
+		return NULL;
+	memset(b, 0, sizeof(*b));
+
+	b->nodes = kmalloc(RX_NODES_MAX * sizeof(*b->nodes), GFP_KERNEL);
+	b->sets = kmalloc(RULE_SETS_MAX * sizeof(*b->sets), GFP_KERNEL);
+	b->subject = kmalloc(nrules * sizeof(int), GFP_KERNEL);
+	b->nfa = kmalloc(RULE_NFA_MAX * sizeof(*b->nfa), GFP_KERNEL);
+	b->starts = kmalloc(nrules * sizeof(int), GFP_KERNEL);
+	b->mark = kmalloc(RULE_NFA_MAX * sizeof(int), GFP_KERNEL);
+	/* the starts, a DFA state and two moves per NFA state */
+	b->stack = kmalloc(4 * RULE_NFA_MAX * sizeof(int), GFP_KERNEL);
+	b->buf = kmalloc(RULE_NFA_MAX * sizeof(int), GFP_KERNEL);
+	b->dstates = kmalloc(RULE_DFA_MAX * sizeof(*b->dstates), GFP_KERNEL);
+	b->dsets = kmalloc(RULE_DFA_MAX * sizeof(*b->dsets), GFP_KERNEL);
+	b->dlen = kmalloc(RULE_DFA_MAX * sizeof(int), GFP_KERNEL);
+	b->hnext = kmalloc(RULE_DFA_MAX * sizeof(int), GFP_KERNEL);
+
+	if (!b->nodes || !b->sets || !b->subject || !b->nfa || !b->starts || !b->mark
+	    || !b->stack || !b->buf || !b->dstates || !b->dsets || !b->dlen
+	    || !b->hnext) {
+		rule_build_free(b);
+		return NULL;
+	}
+	memset(b->mark, 0, RULE_NFA_MAX * sizeof(int));
+	return b;
+}
+
+
+/****************************************************************************
+*	Trie of the literal rules
+*/
+static struct rule_trie *
+rule_trie_new(struct rule_trie *root, const unsigned char *label, int len)
+{
+	struct rule_trie *t;
+
+	if (!(t = kmalloc(sizeof(*t) + len, GFP_KERNEL)))
+		return NULL;
+	memset(t, 0, sizeof(*t));
+	t->prefix = t->exact = RULE_NONE;
+	t->len = len;
+	memcpy(t->label, label, len);
+	if (root) {
+		t->all = root->all;
+		root->all = t;
+	}
+	return t;
+}
+
+static void
+rule_trie_free(struct rule_trie *root)
+{
+	struct rule_trie *t;
+
+	while (root) {
+		t = root;
+		root = t->all;
+		kfree(t->kids);
+		kfree(t);
+	}
+}
+
+/* the kid whose label starts with c, or where it would be */
+static int
+rule_trie_find(const struct rule_trie *t, int c)
+{
+	int lo = 0, hi = t->nkids, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->kids[mid]->label[0] < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int
+rule_trie_add(struct rule_trie *root, const unsigned char *path, int n,
+	      int rule, int exact)
+{
+	struct rule_trie *t = root, *kid, *mid, **kids;
+	int i, k;
+
+	while (n > 0) {
+		i = rule_trie_find(t, path[0]);
+		if (i == t->nkids || t->kids[i]->label[0] != path[0]) {
+			/* a new leaf */
+			if (!(kid = rule_trie_new(root, path, n)))
+				return -ENOMEM;
+			kids = kmalloc((t->nkids + 1) * sizeof(*kids),
+				       GFP_KERNEL);
+			if (kids == NULL)
+				return -ENOMEM;
+			memcpy(kids, t->kids, i * sizeof(*kids));
+			kids[i] = kid;
+			memcpy(kids + i + 1, t->kids + i,
+			       (t->nkids - i) * sizeof(*kids));
+			kfree(t->kids);
+			t->kids = kids;
+			t->nkids++;
+			t = kid;
+			break;
+		}
+
+		kid = t->kids[i];
+		for (k = 1; k < kid->len && k < n; k++)
+			if (kid->label[k] != path[k])
+				break;
+		if (k < kid->len) {
+			/* split the label of the kid */
+			if (!(mid = rule_trie_new(root, kid->label, k))
+			    || !(mid->kids = kmalloc(sizeof(*kids),
+						     GFP_KERNEL)))
+				return -ENOMEM;
+			memmove(kid->label, kid->label + k, kid->len - k);
+			kid->len -= k;
+			mid->kids[0] = kid;
+			mid->nkids = 1;
+			t->kids[i] = mid;
+			kid = mid;
+		}
+		t = kid;
+		path += k;
+		n -= k;
+	}
+
+	if (exact) {
+		if (rule < t->exact)
+			t->exact = rule;
+	} else if (rule < t->prefix)
+		t->prefix = rule;
+	return 0;
+}
+
+static int
+rule_trie_lookup(const struct rule_trie *t, const unsigned char *s, int len)
+{
+	int best = t->prefix;
+	int i;
+
+	for (;;) {
+		if (len == 0) {
+			if (t->exact < best)
+				best = t->exact;
+			return best;
+		}
+		i = rule_trie_find(t, *s);
+		if (i == t->nkids)
+			return best;
+		t = t->kids[i];
+		if (t->label[0] != *s || t->len > len
+		    || memcmp(t->label, s, t->len))
+			return best;
+		s += t->len;
+		len -= t->len;
+		if (t->prefix < best)
+			best = t->prefix;
+	}
+}
+
+/*
+ *	A literal path anchored at the start of the URI and followed by
+ *	nothing or .* matches the URIs under the path, followed by $ it
+ *	matches the path only. Copy the path to buf and return its length,
+ *	or -1 if the pattern is something else.
+ */
+static int
+rule_literal(const char *pattern, unsigned char *buf, int *exact)
+{
+	const unsigned char *p = (const unsigned char *) pattern;
+	int n = 0;
+
+	*exact = 0;
+	if (*p++ != '^')
+		/* a pattern matching every URI */
+		return strcmp(pattern, ".*") && strcmp(pattern, ".*$") ? -1 : 0;
+
+	for (; *p; p++) {
+		if (*p >= 0x80)
+			return -1;
+		if (*p == '\\') {
+			if (p[1] == '\0' || p[1] >= 0x80)
+				return -1;
+			p++;
+		} else if (strchr(".[]()*+?{}|^$", *p))
+			break;
+		buf[n++] = *p;
+	}
+	if (*p == '\0' || !strcmp(p, ".*") || !strcmp(p, ".*$"))
+		return n;
+	if (!strcmp(p, "$")) {
+		*exact = 1;
+		return n;
+	}
+	return -1;
+}
+
+
+/*
+ *	The literal text an anchored pattern starts with, that all the
+ *	strings it matches start with. Returns its length, 0 if there is
+ *	none.
+ */
+static int
+rule_lead(const char *pattern, unsigned char *buf)
+{
+	const unsigned char *p = (const unsigned char *) pattern;
+	int n = 0;
+
+	if (*p++ != '^' || strchr(pattern, '|'))
+		return 0;
+	for (; *p; p++) {
+		if (*p == '\\') {
+			if (p[1] == '\0')
+				break;
+			p++;
+		} else if (strchr(".[]()*+?{}|^$", *p))
+			break;
+		buf[n++] = *p;
+	}
+	/* the last character is optional or repeated */
+	if (n > 0 && *p && strchr("*+?{", *p))
+		n--;
+	return n;
+}
+
+/* the two rules never match the same request, see above */
+static int
+rule_disjoint(const struct tcp_vs_rule *a, const struct tcp_vs_rule *b)
+{
+	unsigned char la[KTCPVS_PATTERN_MAXLEN], lb[KTCPVS_PATTERN_MAXLEN];
+	int na, nb;
+
+	if ((a->options & TCP_VS_RULE_O_ANYORDER)
+	    && (b->options & TCP_VS_RULE_O_ANYORDER))
+		return 1;
+	na = rule_lead(a->pattern, la);
+	nb = rule_lead(b->pattern, lb);
+	return na > 0 && nb > 0 && memcmp(la, lb, MIN(na, nb));
+}
+
+/*
+ *	Make the rules of a subject left to regexec from rx[first] on a
+ *	segment, together with the next ones that overlap none of them.
+ *	They are tried by their hits. Returns the number of rules taken.
+ */
+static int
+rule_build_reorder(struct tcp_vs_rule_set *set, struct rule_build *b,
+		   struct rule_subject *sj, int first)
+{
+	struct rule_seg *seg;
+	int i, j, t, n = 1;
+
+	while (set->reorder && first + n < sj->nrx
+	       && !rx_supported(b, set->rules[sj->rx[first + n]]->pattern)) {
+		for (i = first; i < first + n; i++)
+			if (!rule_disjoint(set->rules[sj->rx[i]],
+					   set->rules[sj->rx[first + n]]))
+				break;
+		if (i < first + n)
+			break;
+		n++;
+	}
+
+	seg = &sj->segs[sj->nsegs++];
+	seg->first = first;
+	seg->count = n;
+	seg->min = sj->rx[first];
+	seg->dfa = NULL;
+	if (n == 1)
+		return 1;
+
+	/* insertion sort by hits, the list order among equal ones */
+	for (i = first + 1; i < first + n; i++) {
+		t = sj->rx[i];
+		for (j = i; j > first
+		     && tcp_vs_rule_hits(set->rules[sj->rx[j - 1]])
+		     < tcp_vs_rule_hits(set->rules[t]); j--)
+			sj->rx[j] = sj->rx[j - 1];
+		sj->rx[j] = t;
+	}
+	for (i = first; i < first + n; i++)
+		set->rules[sj->rx[i]]->flags |= TCP_VS_RULE_F_REORDER;
+	return n;
+}
+
+
+/* the rules look at the same thing, header names are not case sensitive */
+static int
+rule_same_subject(int type, const char *name, const struct tcp_vs_rule *r)
+{
+	if (type != r->type)
+		return 0;
+	if (type == TCP_VS_RULE_HEADER)
+		return !strnicmp(name, r->name, KTCPVS_RULE_NAMELEN);
+	if (type == TCP_VS_RULE_COOKIE)
+		return !strncmp(name, r->name, KTCPVS_RULE_NAMELEN);
+	return 1;
+}
+
+
+/****************************************************************************
+*	Compile the rules on the list. The caller keeps the list from
+*	changing. Returns NULL if there are no rules or no memory, the
+*	rules are then matched one by one.
+*/
+struct tcp_vs_rule_set *
+tcp_vs_rule_compile(struct list_head *rule_list)
+{
+	struct tcp_vs_rule_set *set;
+	struct rule_subject *sj;
+	struct rule_build *b = NULL;
+	struct tcp_vs_rule *r;
+	struct list_head *l;
+	unsigned char path[KTCPVS_PATTERN_MAXLEN];
+	int i, j, n = 0, len, exact, off;
+
+	EnterFunction(5);
+
+	list_for_each(l, rule_list) {
+		r = list_entry(l, struct tcp_vs_rule, list);
+		r->flags = 0;
+		n++;
+	}
+	if (n == 0 || n >= RULE_NONE)
+		return NULL;
+
+	if (!(set = kmalloc(sizeof(*set), GFP_KERNEL)))
+		return NULL;
+	memset(set, 0, sizeof(*set));
+	set->reorder = sysctl_ktcpvs_rule_reorder > 0;
+	set->rules = kmalloc(n * sizeof(*set->rules), GFP_KERNEL);
+	set->subjects = kmalloc(n * sizeof(*set->subjects), GFP_KERNEL);
+	set->src = kmalloc(n * sizeof(*set->src), GFP_KERNEL);
+	set->rx = kmalloc(n * sizeof(*set->rx), GFP_KERNEL);
+	set->segs = kmalloc(n * sizeof(*set->segs), GFP_KERNEL);
+	if (!set->rules || !set->subjects || !set->src || !set->rx
+	    || !set->segs || !(b = rule_build_new(n)))
+		goto err;
+
+	/* group the rules by what they look at */
+	list_for_each(l, rule_list) {
+		r = list_entry(l, struct tcp_vs_rule, list);
+		i = set->nrules++;
+		set->rules[i] = r;
+		if (r->type == TCP_VS_RULE_SRC) {
+			set->src[set->nsrc].addr = r->addr;
+			set->src[set->nsrc].mask = r->mask;
+			set->src[set->nsrc].tag = r->tag;
+			set->src[set->nsrc].rule = i;
+			set->nsrc++;
+			continue;
+		}
+		for (j = 0; j < set->nsubjects; j++)
+			if (rule_same_subject(set->subjects[j].type,
+					      set->subjects[j].name, r))
+				break;
+		if (j == set->nsubjects) {
+			sj = &set->subjects[set->nsubjects];
+			memset(sj, 0, sizeof(*sj));
+			sj->type = r->type;
+			sj->name = r->name;
+			sj->first = i;
+			if (!(sj->trie = rule_trie_new(NULL, NULL, 0)))
+				goto err;
+			set->nsubjects++;
+		}
+		b->subject[i] = j;
+		set->subjects[j].nrx++;
+	}
+	for (j = off = 0; j < set->nsubjects; j++) {
+		sj = &set->subjects[j];
+		sj->rx = set->rx + off;
+		sj->segs = set->segs + off;
+		off += sj->nrx;
+		sj->nrx = 0;
+	}
+
+	for (i = 0; i < set->nrules; i++) {
+		r = set->rules[i];
+		if (r->type == TCP_VS_RULE_SRC)
+			continue;
+		sj = &set->subjects[b->subject[i]];
+		len = rule_literal(r->pattern, path, &exact);
+		if (len < 0) {
+			sj->rx[sj->nrx++] = i;
+		} else {
+			if (rule_trie_add(sj->trie, path, len, i, exact))
+				goto err;
+			r->flags |= exact ? TCP_VS_RULE_F_EXACT
+			    : TCP_VS_RULE_F_PREFIX;
+		}
+	}
+
+	/* runs of the rules the automaton understands */
+	for (j = 0; j < set->nsubjects; j++) {
+		sj = &set->subjects[j];
+		i = 0;
+		while (i < sj->nrx) {
+			int first = i;
+
+			while (i < sj->nrx
+			       && rx_supported(b,
+					       set->rules[sj->rx[i]]->pattern))
+				i++;
+			if (i > first
+			    && rule_build_run(b, set, sj, first, i - first))
+				goto err;
+			if (i < sj->nrx) {
+				TCP_VS_DBG(3, "rule %s is matched by regexec\n",
+					   set->rules[sj->rx[i]]->pattern);
+				i += rule_build_reorder(set, b, sj, i);
+			}
+		}
+		TCP_VS_DBG(3, "rules of type %d: %d not literal, "
+			   "%d segments\n", sj->type, sj->nrx, sj->nsegs);
+	}
+
+	TCP_VS_DBG(3, "%d rules compiled, %d subjects, %d source rules\n",
+		   set->nrules, set->nsubjects, set->nsrc);
+	rule_build_free(b);
+	LeaveFunction(5);
+	return set;
+
+      err:
+	TCP_VS_ERR("no memory to compile the rules, "
+		   "matching them one by one\n");
+	list_for_each(l, rule_list) {
+		list_entry(l, struct tcp_vs_rule, list)->flags = 0;
+	}
+	if (b)
+		rule_build_free(b);
+	tcp_vs_rule_free(set);
+	LeaveFunction(5);
+	return NULL;
+}
+
+
+void tcp_vs_rule_free(struct tcp_vs_rule_set *set)
+{
+	struct rule_subject *sj;
+	int i, j;
+
+	if (set == NULL)
+		return;
+	for (j = 0; j < set->nsubjects; j++) {
+		sj = &set->subjects[j];
+		for (i = 0; i < sj->nsegs; i++)
+			if (sj->segs[i].dfa)
+				rule_dfa_free(sj->segs[i].dfa);
+		rule_trie_free(sj->trie);
+	}
+	kfree(set->segs);
+	kfree(set->rx);
+	kfree(set->src);
+	kfree(set->subjects);
+	kfree(set->rules);
+	kfree(set);
+}
+
+
+/****************************************************************************
+*	Build the routing data of a service from its lists, with a new
+*	generation number. The caller keeps the lists from changing.
+*/
+struct tcp_vs_route *
+tcp_vs_route_build(struct tcp_vs_service *svc)
+{
+	struct tcp_vs_route *route;
+	struct tcp_vs_route_rule *rr;
+	struct tcp_vs_rule *r;
+	tcp_vs_dest_t **dests;
+	struct list_head *l, *e;
+	int i, *heaps, nrules = 0, ndests = 0;
+
+	list_for_each(l, &svc->rule_list) {
+		r = list_entry(l, struct tcp_vs_rule, list);
+		nrules++;
+		list_for_each(e, &r->destinations)
+			ndests++;
+	}
+	list_for_each(e, &svc->destinations)
+		ndests++;
+
+	/* one block, the rules, the servers and then their heaps */
+	route = kmalloc(sizeof(*route) + nrules * sizeof(*rr)
+			+ ndests * (sizeof(*dests) + sizeof(*heaps)),
+			GFP_KERNEL);
+	if (route == NULL) {
+		TCP_VS_ERR("no memory for the routes of %s\n",
+			   svc->ident.name);
+		return NULL;
+	}
+	route->rules = (struct tcp_vs_route_rule *) (route + 1);
+	dests = (tcp_vs_dest_t **) (route->rules + nrules);
+	heaps = (int *) (dests + ndests);
+
+	route->nrules = 0;
+	route->types = 0;
+	list_for_each(l, &svc->rule_list) {
+		rr = &route->rules[route->nrules++];
+		rr->rule = list_entry(l, struct tcp_vs_rule, list);
+		route->types |= 1 << rr->rule->type;
+		rr->dests = dests;
+		rr->ndests = 0;
+		list_for_each(e, &rr->rule->destinations)
+			rr->dests[rr->ndests++] =
+			    list_entry(e, tcp_vs_dest_t, r_list);
+		tcp_vs_heap_init(&rr->heap, rr->dests, rr->ndests, heaps);
+		dests += rr->ndests;
+		heaps += rr->ndests;
+		rr->table = NULL;
+		rr->wrr.n = 0;
+		rr->wrr.seq = NULL;
+	}
+	route->dests = dests;
+	route->ndests = 0;
+	list_for_each(e, &svc->destinations)
+		route->dests[route->ndests++] =
+		    list_entry(e, tcp_vs_dest_t, n_list);
+	tcp_vs_heap_init(&route->heap, route->dests, route->ndests, heaps);
+	route->wrr.n = 0;
+	route->wrr.seq = NULL;
+
+	/* its rules are in list order too */
+	route->rule_set = tcp_vs_rule_compile(&svc->rule_list);
+	route->gen = ++svc->route_gen;
+
+	for (i = 0; i < route->nrules; i++) {
+		rr = &route->rules[i];
+		if ((rr->rule->hash == TCP_VS_HASH_MAGLEV
+		     && tcp_vs_hash_build(rr))
+		    || ((rr->rule->options & TCP_VS_RULE_O_RR)
+			&& tcp_vs_wrr_build(&rr->wrr, rr->dests, rr->ndests)))
+			goto err;
+	}
+	if (svc->scheduler && (svc->scheduler->flags & TCP_VS_SCHED_F_RR)
+	    && tcp_vs_wrr_build(&route->wrr, route->dests, route->ndests))
+		goto err;
+	return route;
+
+      err:
+	tcp_vs_route_free(route);
+	return NULL;
+}
+
+
+void tcp_vs_route_free(struct tcp_vs_route *route)
+{
+	int i;
+
+	if (route == NULL)
+		return;
+	for (i = 0; i < route->nrules; i++) {
+		tcp_vs_hash_free(&route->rules[i]);
+		tcp_vs_wrr_free(&route->rules[i].wrr);
+	}
+	tcp_vs_wrr_free(&route->wrr);
+	tcp_vs_rule_free(route->rule_set);
+	kfree(route);
+}
+
+
+/*
+ *	Run the automaton over the URI, return the first rule that
+ *	matches or RULE_NONE.
+ */
+static inline int
+rule_dfa_exec(const struct rule_dfa *dfa, const unsigned char *s, int len)
+{
+	const struct rule_dstate *ds = dfa->states[0];
+	const unsigned char *end = s + len;
+	int best = ds->accept;
+
+	while (s < end) {
+		if (best <= ds->reach)
+			return best;
+		ds = dfa->states[ds->next[dfa->class[*s++]]];
+		if (ds->accept < best)
+			best = ds->accept;
+	}
+	if (ds->accept_eol < best)
+		best = ds->accept_eol;
+	return best;
+}
+
+
+/****************************************************************************
+*	Run the regex of a rule over the len bytes at uri, without a NUL
+*	terminated copy. The offsets in pmatch are from uri.
+*/
+int
+tcp_vs_rule_exec(struct tcp_vs_rule *r, const char *uri, int len,
+		 size_t nmatch, regmatch_t *pmatch)
+{
+	regmatch_t span;
+
+	if (nmatch == 0)
+		pmatch = &span;
+	pmatch[0].rm_so = 0;
+	pmatch[0].rm_eo = len;
+	return regexec(&r->rx, uri, nmatch, pmatch, REG_STARTEND);
+}
+
+
+/*
+ *	Parse the address/bits of a TCP_VS_RULE_SRC rule, a lone address
+ *	is a /32, or the @tag of the prefix table.
+ */
+int
+tcp_vs_rule_prefix(const char *pattern, __u32 *addr, __u32 *mask, int *tag)
+{
+	const char *p = pattern;
+	__u32 a = 0;
+	int i, n, bits = 32;
+
+	*tag = 0;
+	if (*p == '@') {
+		if (!isdigit(*++p))
+			return -EINVAL;
+		for (n = 0; isdigit(*p); p++)
+			if ((n = n * 10 + *p - '0') > 65535)
+				return -EINVAL;
+		if (*p != '\0' || n == 0)
+			return -EINVAL;
+		*addr = *mask = 0;
+		*tag = n;
+		return 0;
+	}
+
+	for (i = 0; i < 4; i++) {
+		if (i > 0 && *p++ != '.')
+			return -EINVAL;
+		if (!isdigit(*p))
+			return -EINVAL;
+		for (n = 0; isdigit(*p); p++)
+			if ((n = n * 10 + *p - '0') > 255)
+				return -EINVAL;
+		a = (a << 8) | n;
+	}
+	if (*p == '/') {
+		if (!isdigit(*++p))
+			return -EINVAL;
+		for (bits = 0; isdigit(*p); p++)
+			if ((bits = bits * 10 + *p - '0') > 32)
+				return -EINVAL;
+	}
+	if (*p != '\0')
+		return -EINVAL;
+
+	*mask = bits ? htonl(~0U << (32 - bits)) : 0;
+	*addr = htonl(a) & *mask;
+	return 0;
+}
+
+
+/*
+ *	The value of the cookie called name in the Cookie headers, it is
+ *	found in the header index without looking at the other fields.
+ */
+static const char *
+rule_cookie(http_request_t * req, const char *name, int *len)
+{
+	const http_header_idx_t *h;
+	const char *p, *end, *v;
+	int i, n = strlen(name);
+
+	for (i = 0; i < req->nr_headers; i++) {
+		h = &req->headers[i];
+		if (h->name_len != 6
+		    || strnicmp(req->header_base + h->name, "Cookie", 6))
+			continue;
+		p = req->header_base + h->value;
+		end = p + h->value_len;
+		while (p < end) {
+			while (p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			if (end - p > n && !memcmp(p, name, n)
+			    && p[n] == '=') {
+				v = p + n + 1;
+				for (p = v; p < end && *p != ';' && *p != ',';
+				     p++);
+				*len = p - v;
+				return v;
+			}
+			while (p < end && *p != ';' && *p != ',')
+				p++;
+			p++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	What the rules of a type look at in the request, NULL if the
+ *	request has none of it.
+ */
+static const char *
+rule_field(int type, const char *name, struct tcp_vs_conn *conn,
+	   http_request_t * req, int *len)
+{
+	const http_header_idx_t *h;
+	int i, n;
+
+	switch (type) {
+	case TCP_VS_RULE_URI:
+		*len = req->uri_len;
+		return req->uri_str;
+	case TCP_VS_RULE_HOST:
+		*len = req->mime.host_len;
+		return req->mime.host;
+	case TCP_VS_RULE_METHOD:
+		*len = req->method_len;
+		return req->method_str;
+	case TCP_VS_RULE_HEADER:
+		n = strlen(name);
+		for (i = 0; i < req->nr_headers; i++) {
+			h = &req->headers[i];
+			if (h->name_len == n
+			    && !strnicmp(req->header_base + h->name, name, n)) {
+				*len = h->value_len;
+				return req->header_base + h->value;
+			}
+		}
+		return NULL;
+	case TCP_VS_RULE_COOKIE:
+		return rule_cookie(req, name, len);
+	}
+	return NULL;
+}
+
+/****************************************************************************
+*	What the rule looks at in the request, to get the submatches of
+*	its pattern. NULL for the rules without a pattern to run, the
+*	TCP_VS_RULE_SRC ones, or if the request has no such field.
+*/
+const char *
+tcp_vs_rule_subject(struct tcp_vs_rule *r, struct tcp_vs_conn *conn,
+		    http_request_t * req, int *len)
+{
+	return rule_field(r->type, r->name, conn, req, len);
+}
+
+
+/* the tag of the client in the prefix table, looked up once */
+static inline int
+rule_client_tag(struct tcp_vs_lpm *lpm, struct tcp_vs_conn *conn, int *tag)
+{
+	if (*tag < 0)
+		*tag = lpm ? tcp_vs_lpm_lookup(lpm, conn->addr) : 0;
+	return *tag;
+}
+
+static inline int
+rule_test(struct tcp_vs_rule *r, struct tcp_vs_lpm *lpm,
+	  struct tcp_vs_conn *conn, http_request_t * req, int *tag)
+{
+	const char *s;
+	int len;
+
+	if (r->type == TCP_VS_RULE_SRC && r->tag)
+		return rule_client_tag(lpm, conn, tag) == r->tag;
+	if (r->type == TCP_VS_RULE_SRC)
+		return (conn->addr & r->mask) == r->addr;
+	if (!(s = rule_field(r->type, r->name, conn, req, &len)))
+		return 0;
+	return !tcp_vs_rule_exec(r, s, len, 0, NULL);
+}
+
+
+/*
+ *	The first rule of a subject that matches s, if it comes before
+ *	best.
+ */
+static int
+rule_match_subject(struct tcp_vs_rule_set *set, struct rule_subject *sj,
+		   const char *s, int len, int best)
+{
+	struct rule_seg *seg;
+	int i, j, m;
+
+	/* the first literal rule, then the other rules before it */
+	m = rule_trie_lookup(sj->trie, (const unsigned char *) s, len);
+	if (m < best)
+		best = m;
+	for (i = 0; i < sj->nsegs; i++) {
+		seg = &sj->segs[i];
+		if (seg->min > best)
+			break;
+		if (seg->dfa == NULL) {
+			/* at most one of them matches, the rules after the
+			   segment come after all of them */
+			for (j = seg->first; j < seg->first + seg->count; j++)
+				if (sj->rx[j] < best
+				    && !tcp_vs_rule_exec(set->rules[sj->rx[j]],
+							 s, len, 0, NULL))
+					return sj->rx[j];
+			continue;
+		}
+		m = rule_dfa_exec(seg->dfa, (const unsigned char *) s, len);
+		if (m != RULE_NONE) {
+			if (sj->rx[seg->first + m] < best)
+				best = sj->rx[seg->first + m];
+			break;
+		}
+	}
+	return best;
+}
+
+/*
+ *	Find the first matching rule without the cache, return its index
+ *	in route->rules or -1.
+ */
+static int
+rule_match(struct tcp_vs_route *route, struct tcp_vs_lpm *lpm,
+	   struct tcp_vs_conn *conn, http_request_t * req)
+{
+	struct tcp_vs_rule_set *set = route->rule_set;
+	struct rule_subject *sj;
+	struct rule_src *src;
+	const char *s;
+	int i, len, best = RULE_NONE, tag = -1;
+
+	if (set == NULL) {
+		for (i = 0; i < route->nrules; i++)
+			if (rule_test(route->rules[i].rule, lpm, conn, req,
+				      &tag))
+				return i;
+		return -1;
+	}
+
+	/* the subjects are in the order of their first rule */
+	for (i = 0; i < set->nsubjects; i++) {
+		sj = &set->subjects[i];
+		if (sj->first >= best)
+			break;
+		if (!(s = rule_field(sj->type, sj->name, conn, req, &len)))
+			continue;
+		best = rule_match_subject(set, sj, s, len, best);
+	}
+	for (i = 0; i < set->nsrc && set->src[i].rule < best; i++) {
+		src = &set->src[i];
+		if (src->tag ? rule_client_tag(lpm, conn, &tag) == src->tag
+		    : (conn->addr & src->mask) == src->addr) {
+			best = src->rule;
+			break;
+		}
+	}
+	return best != RULE_NONE ? best : -1;
+}
+
+
+/* whether the route was built to try its rules left to regexec by hits */
+int
+tcp_vs_route_reordered(struct tcp_vs_route *route)
+{
+	return route->rule_set != NULL && route->rule_set->reorder;
+}
+
+
+/****************************************************************************
+*	Whether the route should be rebuilt to try its rules left to
+*	regexec by their hits: rule_reorder was switched, or a rule of a
+*	reordered segment is well ahead of the one tried before it.
+*/
+int
+tcp_vs_rule_reorder_due(struct tcp_vs_route *route)
+{
+	struct tcp_vs_rule_set *set = route->rule_set;
+	struct rule_subject *sj;
+	struct rule_seg *seg;
+	int i, j, k;
+
+	if (set == NULL)
+		return 0;
+	if (set->reorder != (sysctl_ktcpvs_rule_reorder > 0))
+		return 1;
+	for (i = 0; i < set->nsubjects; i++) {
+		sj = &set->subjects[i];
+		for (j = 0; j < sj->nsegs; j++) {
+			seg = &sj->segs[j];
+			if (seg->dfa)
+				continue;
+			for (k = seg->first + 1; k < seg->first + seg->count;
+			     k++)
+				if (tcp_vs_rule_hits(set->rules[sj->rx[k]]) >
+				    2 * tcp_vs_rule_hits(set->rules
+							 [sj->rx[k - 1]])
+				    + RULE_REORDER_SLACK)
+					return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ *	The hits of a rule are counted by every CPU on its own, so the
+ *	request path writes nothing shared; only the sum means anything.
+ */
+unsigned int
+tcp_vs_rule_hits(struct tcp_vs_rule *r)
+{
+	unsigned int n = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		n += *per_cpu_ptr(r->hits, cpu);
+	}
+	return n;
+}
+
+/* a hit counted on another CPU meanwhile may be lost, they are rough */
+void
+tcp_vs_rule_halve_hits(struct tcp_vs_rule *r)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		*per_cpu_ptr(r->hits, cpu) /= 2;
+	}
+}
+
+static inline void
+rule_hit(struct tcp_vs_rule *r)
+{
+	(*per_cpu_ptr(r->hits, get_cpu()))++;
+	put_cpu();
+}
+
+
+/****************************************************************************
+*	Find the first rule of the service that matches the request from
+*	conn, the fields of req need not be NUL terminated. The caller is
+*	in an RCU read-side section, the rule and its servers stay valid
+*	until it leaves it.
+*/
+struct tcp_vs_route_rule *
+tcp_vs_match_rule(struct tcp_vs_service *svc, struct tcp_vs_conn *conn,
+		  http_request_t * req)
+{
+	struct tcp_vs_route *route = tcp_vs_route_get(svc);
+	struct tcp_vs_lpm *lpm = tcp_vs_lpm_get(svc);
+	struct tcp_vs_rule_cache *cache;
+	struct rule_centry *e;
+	const char *host = NULL;
+	unsigned int hash;
+	int i, len, hlen = -1;
+
+	/* only the rules on the URI and the Host can be cached */
+	if (svc->rule_cache == NULL || (route->types & ~RULE_CACHE_TYPES)) {
+		i = rule_match(route, lpm, conn, req);
+		if (i >= 0 && sysctl_ktcpvs_rule_reorder)
+			rule_hit(route->rules[i].rule);
+		return i >= 0 ? &route->rules[i] : NULL;
+	}
+	len = req->uri_len;
+	if ((route->types & (1 << TCP_VS_RULE_HOST)) && req->mime.host) {
+		host = req->mime.host;
+		hlen = req->mime.host_len;
+	}
+
+	cache = per_cpu_ptr(svc->rule_cache, get_cpu());
+	if (len + (hlen > 0 ? hlen : 0) > RULE_CACHE_KEY) {
+		cache->misses++;
+		i = rule_match(route, lpm, conn, req);
+	} else {
+		hash = jhash(req->uri_str, len, hlen);
+		if (hlen > 0)
+			hash = jhash(host, hlen, hash);
+		e = &cache->entries[hash & (RULE_CACHE_SIZE - 1)];
+		if (e->gen == route->gen && e->hash == hash
+		    && e->len == len && e->hlen == hlen
+		    && !memcmp(e->key, req->uri_str, len)
+		    && (hlen <= 0 || !memcmp(e->key + len, host, hlen))) {
+			cache->hits++;
+			i = e->rule;
+		} else {
+			cache->misses++;
+			i = rule_match(route, lpm, conn, req);
+			e->gen = route->gen;
+			e->hash = hash;
+			e->len = len;
+			e->hlen = hlen;
+			e->rule = i;
+			memcpy(e->key, req->uri_str, len);
+			if (hlen > 0)
+				memcpy(e->key + len, host, hlen);
+		}
+	}
+	put_cpu();
+	if (i < 0)
+		return NULL;
+	if (sysctl_ktcpvs_rule_reorder)
+		rule_hit(route->rules[i].rule);
+	return &route->rules[i];
+}
+
+
+/****************************************************************************
+*	The per CPU rule cache of a service
+*/
+struct tcp_vs_rule_cache *
+tcp_vs_rule_cache_new(void)
+{
+	return alloc_percpu(struct tcp_vs_rule_cache);
+}
+
+void
+tcp_vs_rule_cache_free(struct tcp_vs_rule_cache *cache)
+{
+	if (cache != NULL)
+		free_percpu(cache);
+}
+
+/* sum of the counters of all the CPUs */
+void
+tcp_vs_rule_cache_stats(struct tcp_vs_service *svc,
+			unsigned int *hits, unsigned int *misses)
+{
+	struct tcp_vs_rule_cache *cache;
+	int cpu;
+
+	*hits = *misses = 0;
+	if (svc->rule_cache == NULL)
+		return;
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		cache = per_cpu_ptr(svc->rule_cache, cpu);
+		*hits += cache->hits;
+		*misses += cache->misses;
+	}
+}
@@ -22,6 +22,7 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
+#include <linux/slab.h>
 //#include <asm/softirq.h>	/* for local_bh_* */
 #include <asm/string.h>
 
@@ -254,6 +255,104 @@ tcp_vs_scheduler_get(const char *sched_name)
 }
 
 
+/*
+ * The smooth weighted round robin order of a list is worked out when the
+ * route is built: at every turn each server of weight above 0 earns its
+ * weight, the richest one, the first of equal ones, takes the turn and
+ * pays the sum of the weights. The turns of a server are spread out
+ * rather than bunched, 5,1,1 gives a a b a c a a. One round is as long as
+ * the sum of the weights over their gcd, it is cut to WRR_TURNS_MAX turns
+ * by dividing the weights, every server keeping a turn at least.
+ */
+#define WRR_TURNS_MAX		4096
+
+static int
+wrr_gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+int
+tcp_vs_wrr_build(struct tcp_vs_wrr *wrr, struct tcp_vs_dest **dests, int n)
+{
+	unsigned long total = 0, f;
+	int *w, *cur;
+	int i, t, best, g = 0, live = 0;
+
+	wrr->n = 0;
+	wrr->next = 0;
+	wrr->seq = NULL;
+	for (i = 0; i < n; i++)
+		if (dests[i]->weight > 0) {
+			g = wrr_gcd(dests[i]->weight, g);
+			live++;
+		}
+	if (live == 0)
+		return 0;
+
+	w = kmalloc(n * sizeof(*w), GFP_KERNEL);
+	cur = kmalloc(n * sizeof(*cur), GFP_KERNEL);
+	if (!w || !cur)
+		goto err;
+	for (i = 0; i < n; i++) {
+		w[i] = dests[i]->weight > 0 ? dests[i]->weight / g : 0;
+		total += w[i];
+	}
+	if (total > WRR_TURNS_MAX && total > live) {
+		f = (total + WRR_TURNS_MAX - 1) / WRR_TURNS_MAX;
+		total = 0;
+		for (i = 0; i < n; i++) {
+			if (w[i] > 0)
+				w[i] = max_t(unsigned long, w[i] / f, 1);
+			total += w[i];
+		}
+	}
+
+	wrr->seq = kmalloc(total * sizeof(*wrr->seq), GFP_KERNEL);
+	if (!wrr->seq)
+		goto err;
+	memset(cur, 0, n * sizeof(*cur));
+	for (t = 0; t < total; t++) {
+		best = -1;
+		for (i = 0; i < n; i++) {
+			if (w[i] == 0)
+				continue;
+			cur[i] += w[i];
+			if (best < 0 || cur[i] > cur[best])
+				best = i;
+		}
+		cur[best] -= total;
+		wrr->seq[t] = best;
+	}
+	wrr->n = total;
+	kfree(w);
+	kfree(cur);
+	return 0;
+
+      err:
+	TCP_VS_ERR("no memory for the round robin order\n");
+	kfree(w);
+	kfree(cur);
+	return -ENOMEM;
+}
+
+void
+tcp_vs_wrr_free(struct tcp_vs_wrr *wrr)
+{
+	if (wrr->seq)
+		kfree(wrr->seq);
+	wrr->seq = NULL;
+	wrr->n = 0;
+}
+
+
 /*
 void
 tcp_vs_scheduler_put(struct tcp_vs_scheduler *sched)
@@ -53,8 +53,7 @@ tcp_vs_wlc_update_svc(struct tcp_vs_service *svc)
 static int
 tcp_vs_wlc_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 {
-	register struct list_head *l, *e;
-	tcp_vs_dest_t *dest, *least;
+	tcp_vs_dest_t *least;
 
 	TCP_VS_DBG(5, "tcp_vs_wlc_schedule(): Scheduling...\n");
 
@@ -62,38 +61,18 @@ tcp_vs_wlc_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 	 * We use the following formula to estimate the overhead:
 	 *                dest->conns / dest->weight
 	 *
-	 * Remember -- no floats in kernel mode!!!
-	 * The comparison of h1*w2 > h2*w1 is equivalent to that of
-	 *                h1/w1 > h2/w2
-	 * when each weight is larger than zero.
+	 * The servers of the service are kept in a heap by it, see
+	 * tcp_vs_heap.c, the least loaded on top.
 	 *
 	 * The server with weight=0 is quiesced and will not receive any
 	 * new connection.
 	 */
 
-	read_lock(&svc->lock);
-	l = &svc->destinations;
-	for (e = l->next; e != l; e = e->next) {
-		least = list_entry(e, tcp_vs_dest_t, n_list);
-		if (least->weight > 0) {
-			goto nextstage;
-		}
-	}
-	read_unlock(&svc->lock);
-	return -1;
-
-	/*
-	 *    Find the destination with the least load.
-	 */
-      nextstage:
-	for (e = e->next; e != l; e = e->next) {
-		dest = list_entry(e, tcp_vs_dest_t, n_list);
-		if (atomic_read(&least->conns) * dest->weight
-		    > atomic_read(&dest->conns) * least->weight) {
-			least = dest;
-		}
-	}
-	read_unlock(&svc->lock);
+	rcu_read_lock();
+	least = tcp_vs_heap_least(&tcp_vs_route_get(svc)->heap);
+	rcu_read_unlock();
+	if (least == NULL)
+		return -1;
 
 	TCP_VS_DBG(5, "WLC: server %d.%d.%d.%d:%d "
 		   "conns %d refcnt %d weight %d\n",
@@ -106,7 +85,7 @@ tcp_vs_wlc_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
 		TCP_VS_ERR_RL("The destination is not available\n");
 		return -1;
 	}
-	atomic_inc(&least->conns);
+	tcp_vs_dest_inc_conns(least);
 	conn->dest = least;
 
 	return 0;
@@ -121,6 +100,7 @@ static struct tcp_vs_scheduler tcp_vs_wlc_scheduler = {
 	tcp_vs_wlc_done_svc,	/* done */
 	tcp_vs_wlc_update_svc,	/* update */
 	tcp_vs_wlc_schedule,	/* select a server from the destination list */
+	TCP_VS_SCHED_F_HEAP,	/* flags */
 };
 
 
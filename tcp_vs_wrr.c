@@ -0,0 +1,119 @@
+/*
+ * KTCPVS       An implementation of the TCP Virtual Server daemon inside
+ *              kernel for the LINUX operating system. KTCPVS can be used
+ *              to build a moderately scalable and highly available server
+ *              based on a cluster of servers, with more flexibility.
+ *
+ * Version:     $Id: tcp_vs_wrr.c,v 1.1 2005/03/02 10:14:21 wensong Exp $
+ *
+ * Authors:     Wensong Zhang <wensong@linuxvirtualserver.org>
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * tcp_vs_wrr.c: smooth weighted round-robin scheduling
+ */
+
+#include <linux/config.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+
+#include "tcp_vs.h"
+
+
+static int
+tcp_vs_wrr_init_svc(struct tcp_vs_service *svc)
+{
+	return 0;
+}
+
+
+static int
+tcp_vs_wrr_done_svc(struct tcp_vs_service *svc)
+{
+	return 0;
+}
+
+
+static int
+tcp_vs_wrr_update_svc(struct tcp_vs_service *svc)
+{
+	return 0;
+}
+
+
+/*
+ *    Smooth weighted round-robin scheduling
+ */
+static int
+tcp_vs_wrr_schedule(struct tcp_vs_conn *conn, struct tcp_vs_service *svc)
+{
+	struct tcp_vs_route *route;
+	tcp_vs_dest_t *dest;
+
+	TCP_VS_DBG(5, "tcp_vs_wrr_schedule(): Scheduling...\n");
+
+	/*
+	 * The order of the servers is built with the route, since the
+	 * scheduler asks for it with TCP_VS_SCHED_F_RR, see tcp_vs_sched.c,
+	 * so taking the next server is one read. The servers with weight=0
+	 * are not in it.
+	 */
+	rcu_read_lock();
+	route = tcp_vs_route_get(svc);
+	dest = tcp_vs_wrr_next(&route->wrr, route->dests);
+	rcu_read_unlock();
+	if (dest == NULL)
+		return -1;
+
+	TCP_VS_DBG(5, "WRR: server %d.%d.%d.%d:%d "
+		   "conns %d refcnt %d weight %d\n",
+		   NIPQUAD(dest->addr), ntohs(dest->port),
+		   atomic_read(&dest->conns),
+		   atomic_read(&dest->refcnt), dest->weight);
+
+	conn->dsock = tcp_vs_connect2dest(dest);
+	if (!conn->dsock) {
+		TCP_VS_ERR_RL("The destination is not available\n");
+		return -1;
+	}
+	tcp_vs_dest_inc_conns(dest);
+	conn->dest = dest;
+
+	return 0;
+}
+
+
+static struct tcp_vs_scheduler tcp_vs_wrr_scheduler = {
+	{0},			/* n_list */
+	"wrr",			/* name */
+	THIS_MODULE,		/* this module */
+	tcp_vs_wrr_init_svc,	/* initializer */
+	tcp_vs_wrr_done_svc,	/* done */
+	tcp_vs_wrr_update_svc,	/* update */
+	tcp_vs_wrr_schedule,	/* select a server from the destination list */
+	TCP_VS_SCHED_F_RR,	/* flags */
+};
+
+
+static int __init
+tcp_vs_wrr_init(void)
+{
+	INIT_LIST_HEAD(&tcp_vs_wrr_scheduler.n_list);
+	return register_tcp_vs_scheduler(&tcp_vs_wrr_scheduler);
+}
+
+static void __exit
+tcp_vs_wrr_cleanup(void)
+{
+	unregister_tcp_vs_scheduler(&tcp_vs_wrr_scheduler);
+}
+
+module_init(tcp_vs_wrr_init);
+module_exit(tcp_vs_wrr_cleanup);
+MODULE_LICENSE("GPL");
@@ -20,8 +20,28 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "tcp_vs.h"
 #include "helper.h"
 
+static const struct {
+	const char *name;
+	int flag;
+} rewrite_names[] = {
+	{"xff", TCP_VS_REWRITE_XFF},
+	{"connection", TCP_VS_REWRITE_CONNECTION},
+	{"hopbyhop", TCP_VS_REWRITE_HOPBYHOP},
+	{NULL, 0}
+};
+
+/* by TCP_VS_RULE_* */
+static const char *rule_type_names[] = {
+	"uri", "host", "header", "cookie", "method", "src",
+};
+
+static const char *hash_names[] = {
+	"modulo", "maglev", "rendezvous",
+};
+
 int
 string_to_number(const char *s, int min, int max)
 {
@@ -184,3 +204,142 @@ parse_addrport(char *buf, u_int16_t proto, u_int32_t * addr,
 
 	return 2;
 }
+
+/*
+ * Parse a comma separated list of header rewrites, e.g. "xff,hopbyhop".
+ * Return the TCP_VS_REWRITE_* flags, or -1 if a name is unknown.
+ */
+int
+parse_rewrite(const char *s)
+{
+	const char *end;
+	int i, len, flags = 0;
+
+	while (*s) {
+		end = strchr(s, ',');
+		len = end ? end - s : strlen(s);
+		for (i = 0; rewrite_names[i].name; i++) {
+			if (strlen(rewrite_names[i].name) == len
+			    && !strncasecmp(s, rewrite_names[i].name, len))
+				break;
+		}
+		if (!rewrite_names[i].name)
+			return -1;
+		flags |= rewrite_names[i].flag;
+		s += len;
+		if (*s == ',')
+			s++;
+	}
+	return flags;
+}
+
+/*
+ * Parse a rule type, e.g. "host", "header:X-App" or "cookie:app". The
+ * header and cookie types need a name, the others have none.
+ */
+int
+parse_rule_type(const char *s, int *type, char *name)
+{
+	const char *colon;
+	int i, len;
+
+	colon = strchr(s, ':');
+	len = colon ? colon - s : strlen(s);
+	for (i = 0; i <= TCP_VS_RULE_MAX; i++) {
+		if (strlen(rule_type_names[i]) == len
+		    && !strncasecmp(s, rule_type_names[i], len))
+			break;
+	}
+	if (i > TCP_VS_RULE_MAX)
+		return -1;
+
+	name[0] = '\0';
+	if (i == TCP_VS_RULE_HEADER || i == TCP_VS_RULE_COOKIE) {
+		if (!colon || colon[1] == '\0'
+		    || strlen(colon + 1) >= KTCPVS_RULE_NAMELEN)
+			return -1;
+		strcpy(name, colon + 1);
+	} else if (colon)
+		return -1;
+	*type = i;
+	return 0;
+}
+
+/*
+ * Parse an entry of the prefix table, "address[/bits] tag". Return 0,
+ * or -1 if it is malformed.
+ */
+int
+parse_prefix(const char *s, struct tcp_vs_prefix_u *p)
+{
+	char addr[64], tag[64], *slash;
+	struct in_addr inaddr;
+	int bits = 32, n;
+
+	if (sscanf(s, "%63s %63s", addr, tag) != 2)
+		return -1;
+	if ((slash = strchr(addr, '/'))) {
+		*slash = '\0';
+		if ((bits = string_to_number(slash + 1, 0, 32)) == -1)
+			return -1;
+	}
+	if (inet_aton(addr, &inaddr) == 0)
+		return -1;
+	if ((n = string_to_number(tag, 1, 65535)) == -1)
+		return -1;
+
+	p->addr = inaddr.s_addr;
+	p->bits = bits;
+	p->tag = n;
+	return 0;
+}
+
+const char *
+rule_type_to_string(int type)
+{
+	if (type < 0 || type > TCP_VS_RULE_MAX)
+		return "unknown";
+	return rule_type_names[type];
+}
+
+/*
+ * Parse the hash method of a rule. Return TCP_VS_HASH_*, or -1 if it is
+ * unknown.
+ */
+int
+parse_hash(const char *s)
+{
+	int i;
+
+	for (i = 0; i <= TCP_VS_HASH_MAX; i++)
+		if (!strcasecmp(s, hash_names[i]))
+			return i;
+	return -1;
+}
+
+const char *
+hash_to_string(int hash)
+{
+	if (hash < 0 || hash > TCP_VS_HASH_MAX)
+		return "unknown";
+	return hash_names[hash];
+}
+
+/*
+ * Print the header rewrite flags as a comma separated list into buf.
+ */
+char *
+rewrite_to_string(int flags, char *buf, size_t len)
+{
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; rewrite_names[i].name; i++) {
+		if (!(flags & rewrite_names[i].flag))
+			continue;
+		if (buf[0])
+			strncat(buf, ",", len - strlen(buf) - 1);
+		strncat(buf, rewrite_names[i].name, len - strlen(buf) - 1);
+	}
+	return buf;
+}
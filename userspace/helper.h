@@ -18,5 +18,12 @@ extern char *addrport_to_anyname(struct in_addr *addr, unsigned int port,
 				 unsigned int format);
 extern int parse_addrport(char *buf, u_int16_t proto, u_int32_t * addr,
 			  u_int16_t * port);
+extern int parse_rewrite(const char *s);
+extern char *rewrite_to_string(int flags, char *buf, size_t len);
+extern int parse_rule_type(const char *s, int *type, char *name);
+extern const char *rule_type_to_string(int type);
+extern int parse_prefix(const char *s, struct tcp_vs_prefix_u *p);
+extern int parse_hash(const char *s);
+extern const char *hash_to_string(int hash);
 
 #endif				/* _HELPER_H */
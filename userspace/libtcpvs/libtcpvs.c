@@ -214,6 +214,32 @@ tcpvs_del_rule(struct tcp_vs_ident *id, struct tcp_vs_rule_u *rule)
 }
 
 
+int
+tcpvs_set_prefixes(struct tcp_vs_ident *id,
+		   struct tcp_vs_prefix_u *prefixes, int n)
+{
+	struct tcp_vs_set_prefixes set;
+	size_t len;
+	void *arg;
+	int result;
+
+	set.num_prefixes = n;
+	len = sizeof(*id) + sizeof(set) + n * sizeof(*prefixes);
+	if (!(arg = malloc(len)))
+		return ENOMEM;
+	memcpy(arg, id, sizeof(*id));
+	memcpy((char *) arg + sizeof(*id), &set, sizeof(set));
+	memcpy((char *) arg + sizeof(*id) + sizeof(set), prefixes,
+	       n * sizeof(*prefixes));
+
+	tcpvs_cmd = TCP_VS_SO_SET_PREFIXES;
+	result = setsockopt(sockfd, IPPROTO_IP, TCP_VS_SO_SET_PREFIXES,
+			    arg, len);
+	free(arg);
+	return result;
+}
+
+
 struct tcp_vs_service_u *
 tcpvs_get_service(struct tcp_vs_ident *id)
 {
@@ -315,6 +341,8 @@ tcpvs_strerror(int err)
 		int err;
 		const char *message;
 	} table[] = { {
+	TCP_VS_SO_SET_PREFIXES, EINVAL, "Illegal prefix table"}, {
+	TCP_VS_SO_SET_PREFIXES, ESRCH, "No such service"}, {
 	0, EPERM, "Permission denied (you must be root)"}, {
 	0, EINVAL, "Module is wrong version"}, {
 	0, ENOPROTOOPT, "The ktcpvs module not loaded"}, {
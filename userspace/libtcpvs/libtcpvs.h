@@ -44,6 +44,10 @@ extern int tcpvs_add_rule(struct tcp_vs_ident *id,
 extern int tcpvs_del_rule(struct tcp_vs_ident *id,
 			  struct tcp_vs_rule_u *rule);
 
+/* replace the prefix table of a service, n = 0 drops it */
+extern int tcpvs_set_prefixes(struct tcp_vs_ident *id,
+			      struct tcp_vs_prefix_u *prefixes, int n);
+
 /* get tcpvs service */
 extern struct tcp_vs_service_u *tcpvs_get_service(struct tcp_vs_ident *id);
 
@@ -348,9 +348,28 @@ parse_rule(struct configfile *cf, void *param)
 	rule = svc->rules + i;
 	memset(rule, 0, sizeof(struct tcp_vs_rule_u));
 
+	/* the type, with the name of a header or cookie */
 	GET_TOKEN(cf);
-	if (strcasecmp(cf->token, "pattern"))
-		return -1;
+	if (strcasecmp(cf->token, "pattern")) {
+		if (!strcasecmp(cf->token, "header")
+		    || !strcasecmp(cf->token, "cookie")) {
+			char type[KTCPVS_RULE_NAMELEN + 8];
+
+			strcpy(type, cf->token);
+			GET_TOKEN(cf);
+			if (strlen(cf->token) >= KTCPVS_RULE_NAMELEN)
+				return -1;
+			strcat(type, ":");
+			strcat(type, cf->token);
+			if (parse_rule_type(type, &rule->type, rule->name))
+				return -1;
+		} else if (parse_rule_type(cf->token, &rule->type,
+					   rule->name))
+			return -1;
+		GET_TOKEN(cf);
+		if (strcasecmp(cf->token, "pattern"))
+			return -1;
+	}
 
 	GET_TOKEN(cf);
 	strncpy(rule->pattern, cf->token, KTCPVS_PATTERN_MAXLEN);
@@ -363,6 +382,26 @@ parse_rule(struct configfile *cf, void *param)
 			rule->match_num = 0;
 		GET_TOKEN(cf);
 	}
+	if (!strcasecmp(cf->token, "rewrite")) {
+		GET_TOKEN(cf);
+		if ((rule->rewrite = parse_rewrite(cf->token)) == -1)
+			return -1;
+		GET_TOKEN(cf);
+	}
+	if (!strcasecmp(cf->token, "anyorder")) {
+		rule->options |= TCP_VS_RULE_O_ANYORDER;
+		GET_TOKEN(cf);
+	}
+	if (!strcasecmp(cf->token, "hash")) {
+		GET_TOKEN(cf);
+		if ((rule->hash = parse_hash(cf->token)) == -1)
+			return -1;
+		GET_TOKEN(cf);
+	}
+	if (!strcasecmp(cf->token, "roundrobin")) {
+		rule->options |= TCP_VS_RULE_O_RR;
+		GET_TOKEN(cf);
+	}
 	if (strcasecmp(cf->token, "use"))
 		return -1;
 
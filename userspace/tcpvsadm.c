@@ -69,6 +69,7 @@ static void fail(int err, char *msg, ...);
 static int list_service(struct tcp_vs_ident *id, unsigned int format);
 static int list_all(unsigned int format);
 static int load_configfile(char *cf);
+static int load_prefixes(struct tcp_vs_ident *id, char *pf);
 static int modprobe_ktcpvs(void);
 
 
@@ -86,7 +87,8 @@ static int modprobe_ktcpvs(void);
 #define CMD_START		0x0400U
 #define CMD_STOP		0x0800U
 #define CMD_LOADCF		0x1000U
-#define NUMBER_OF_CMD		13
+#define CMD_PREFIXES		0x2000U
+#define NUMBER_OF_CMD		14
 
 static const char *cmdnames[] = {
 	"add-service",
@@ -102,6 +104,7 @@ static const char *cmdnames[] = {
 	"start",
 	"stop",
 	"load-configfile",
+	"load-prefixes",
 };
 
 #define OPT_NONE	0x00000
@@ -115,7 +118,12 @@ static const char *cmdnames[] = {
 #define OPT_PATTERN	0x00080
 #define OPT_MATCHNUM	0x00100
 #define OPT_LISTEN	0x00200
-#define NUMBER_OF_OPT	11
+#define OPT_REWRITE	0x00400
+#define OPT_TYPE	0x00800
+#define OPT_ANYORDER	0x01000
+#define OPT_HASH	0x02000
+#define OPT_RR		0x04000
+#define NUMBER_OF_OPT	15
 
 static const char *optnames[] = {
 	"numeric",
@@ -128,6 +136,11 @@ static const char *optnames[] = {
 	"pattern",
 	"match",
 	"listen",
+	"rewrite",
+	"type",
+	"any-order",
+	"hash",
+	"round-robin",
 };
 
 /*
@@ -139,20 +152,21 @@ static const char *optnames[] = {
  *  ' '  optional
  */
 static const char commands_v_options[NUMBER_OF_CMD][NUMBER_OF_OPT] = {
-/*             -n   -i   -s   ads  prt  -r   -w   -p   -m   -l */
-/*ADD*/       {'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', ' '},
-/*EDIT*/      {'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x'},
-/*DEL*/       {'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*FLUSH*/     {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*LIST*/      {' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*ADD-SERVER*/{'x', '+', 'x', 'x', 'x', '+', ' ', 'x', 'x', 'x'},
-/*DEL-SERVER*/{'x', '+', 'x', 'x', 'x', '+', 'x', 'x', 'x', 'x'},
-/*EDIT-SRV*/  {'x', '+', 'x', 'x', 'x', '+', ' ', 'x', 'x', 'x'},
-/*ADD-RULE*/  {'x', '+', 'x', 'x', 'x', '+', 'x', '+', ' ', 'x'},
-/*DEL-RULE*/  {'x', '+', 'x', 'x', 'x', '+', 'x', '+', 'x', 'x'},
-/*START*/     {'x', '1', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*STOP*/      {'x', '1', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
-/*LOAD-CF*/   {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*             -n   -i   -s   ads  prt  -r   -w   -p   -m   -l   -x   -t   -o   -H   -R */
+/*ADD*/       {'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', ' ', 'x', 'x', 'x', 'x', 'x'},
+/*EDIT*/      {'x', '+', ' ', ' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*DEL*/       {'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*FLUSH*/     {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*LIST*/      {' ', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*ADD-SERVER*/{'x', '+', 'x', 'x', 'x', '+', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*DEL-SERVER*/{'x', '+', 'x', 'x', 'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*EDIT-SRV*/  {'x', '+', 'x', 'x', 'x', '+', ' ', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*ADD-RULE*/  {'x', '+', 'x', 'x', 'x', '+', 'x', '+', ' ', 'x', ' ', ' ', ' ', ' ', ' '},
+/*DEL-RULE*/  {'x', '+', 'x', 'x', 'x', '+', 'x', '+', 'x', 'x', 'x', ' ', 'x', 'x', 'x'},
+/*START*/     {'x', '1', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*STOP*/      {'x', '1', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*LOAD-CF*/   {'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
+/*PREFIXES*/  {'x', '+', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x'},
 };
 
 static struct option long_options[] = {
@@ -177,8 +191,14 @@ static struct option long_options[] = {
 	{"weight", 1, 0, 'w'},
 	{"pattern", 1, 0, 'p'},
 	{"match", 1, 0, 'm'},
+	{"rewrite", 1, 0, 'x'},
+	{"type", 1, 0, 't'},
+	{"any-order", 0, 0, 'o'},
+	{"hash", 1, 0, 'H'},
+	{"round-robin", 0, 0, 'R'},
 	{"numeric", 0, 0, 'n'},
 	{"load-configfile", 1, 0, 'f'},
+	{"load-prefixes", 1, 0, '5'},
 	{0, 0, 0, 0}
 };
 
@@ -186,7 +206,7 @@ static struct option long_options[] = {
 int
 main(int argc, char **argv)
 {
-	const char *optstring = "AEDFaedLf:hi:s:l:P:r:p:m:n";
+	const char *optstring = "AEDFaedLf:hi:s:l:P:r:p:m:x:t:oH:Rn";
 	int c, parse;
 	char cf[128];
 	unsigned int command = CMD_NONE;
@@ -272,7 +292,13 @@ main(int argc, char **argv)
 		break;
 	case 'f':
 		set_command(&command, CMD_LOADCF);
-		strncpy(cf, optarg, 128);
+		strncpy(cf, optarg, sizeof(cf) - 1);
+		cf[sizeof(cf) - 1] = '\0';
+		break;
+	case '5':
+		set_command(&command, CMD_PREFIXES);
+		strncpy(cf, optarg, sizeof(cf) - 1);
+		cf[sizeof(cf) - 1] = '\0';
 		break;
 	case 'h':
 		usage_exit(0);
@@ -334,6 +360,29 @@ main(int argc, char **argv)
 				fail(2, "illegal match number specified");
 			rule.match_num = parse;
 			break;
+		case 'x':
+			set_option(&options, OPT_REWRITE);
+			if ((rule.rewrite = parse_rewrite(optarg)) == -1)
+				fail(2, "illegal header rewrite specified");
+			break;
+		case 't':
+			set_option(&options, OPT_TYPE);
+			if (parse_rule_type(optarg, &rule.type, rule.name))
+				fail(2, "illegal rule type specified");
+			break;
+		case 'o':
+			set_option(&options, OPT_ANYORDER);
+			rule.options |= TCP_VS_RULE_O_ANYORDER;
+			break;
+		case 'H':
+			set_option(&options, OPT_HASH);
+			if ((rule.hash = parse_hash(optarg)) == -1)
+				fail(2, "illegal hash method specified");
+			break;
+		case 'R':
+			set_option(&options, OPT_RR);
+			rule.options |= TCP_VS_RULE_O_RR;
+			break;
 		case 'n':
 			set_option(&options, OPT_NUMERIC);
 			format |= FMT_NUMERIC;
@@ -395,6 +444,9 @@ main(int argc, char **argv)
 	case CMD_LOADCF:
 		result = load_configfile(cf);
 		break;
+	case CMD_PREFIXES:
+		result = load_prefixes(&ident, cf);
+		break;
 	}
 
 	if (result)
@@ -468,6 +520,49 @@ load_configfile(char *cf)
 }
 
 
+/*
+ * Replace the prefix table of a service with the one in the file pf,
+ * one "address[/bits] tag" per line. An empty file drops the table.
+ */
+static int
+load_prefixes(struct tcp_vs_ident *id, char *pf)
+{
+	struct tcp_vs_prefix_u *prefixes = NULL, *p;
+	char line[256], *s;
+	int n = 0, size = 0, lineno = 0;
+	FILE *f;
+	int rc;
+
+	if (!(f = fopen(pf, "r")))
+		fail(2, "cannot open %s: %s", pf, strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		for (s = line; isspace(*s); s++);
+		if (*s == '\0' || *s == '#')
+			continue;
+		if (n == KTCPVS_PREFIXES_MAX)
+			fail(2, "%s: more than %d prefixes", pf,
+			     KTCPVS_PREFIXES_MAX);
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			p = realloc(prefixes, size * sizeof(*prefixes));
+			if (!p)
+				fail(2, "%s", strerror(errno));
+			prefixes = p;
+		}
+		if (parse_prefix(s, &prefixes[n]))
+			fail(2, "%s:%d: illegal prefix", pf, lineno);
+		n++;
+	}
+	fclose(f);
+
+	rc = tcpvs_set_prefixes(id, prefixes, n);
+	free(prefixes);
+	return rc;
+}
+
+
 static void
 print_service(struct tcp_vs_service_u *svc, unsigned int format)
 {
@@ -477,6 +572,7 @@ print_service(struct tcp_vs_service_u *svc, unsigned int format)
 	char *listen;
 	struct in_addr daddr;
 	char *dname;
+	char rwbuf[64];
 	int i;
 
 	if (!(d = tcpvs_get_dests(svc)))
@@ -536,13 +632,43 @@ print_service(struct tcp_vs_service_u *svc, unsigned int format)
 						  IPPROTO_TCP, format)))
 			fail(2, "addrport_to_anyname: %s",
 			     strerror(errno));
-		printf("    rule = pattern \"%s\" ",
-		       e->pattern);
+		printf("    rule = ");
+		if (e->type == TCP_VS_RULE_HEADER
+		    || e->type == TCP_VS_RULE_COOKIE)
+			printf("%s \"%s\" ", rule_type_to_string(e->type),
+			       e->name);
+		else if (e->type != TCP_VS_RULE_URI)
+			printf("%s ", rule_type_to_string(e->type));
+		printf("pattern \"%s\" ", e->pattern);
 		if (!strcasecmp(svc->conf.sched_name, "hhttp"))
 			printf("match %d ", e->match_num);
-		printf("use server %s\n", dname);
+		if (e->rewrite)
+			printf("rewrite %s ", rewrite_to_string(e->rewrite,
+								rwbuf,
+								sizeof(rwbuf)));
+		if (e->options & TCP_VS_RULE_O_ANYORDER)
+			printf("anyorder ");
+		if (e->hash != TCP_VS_HASH_MODULO)
+			printf("hash %s ", hash_to_string(e->hash));
+		if (e->options & TCP_VS_RULE_O_RR)
+			printf("roundrobin ");
+		printf("use server %s", dname);
+		if (e->flags & TCP_VS_RULE_F_PREFIX)
+			printf("\t# prefix trie");
+		else if (e->flags & TCP_VS_RULE_F_EXACT)
+			printf("\t# exact trie");
+		else if (e->flags & TCP_VS_RULE_F_DFA)
+			printf("\t# dfa");
+		else if (e->flags & TCP_VS_RULE_F_REORDER)
+			printf("\t# reordered, %u hits", e->hits);
+		printf("\n");
 		free(dname);
 	}
+	if (svc->rule_hits || svc->rule_misses)
+		printf("    # rule cache: %u hits, %u misses\n",
+		       svc->rule_hits, svc->rule_misses);
+	if (svc->num_prefixes)
+		printf("    # %u client prefixes\n", svc->num_prefixes);
 
 	printf("}\n");
 	free(listen);
@@ -677,15 +803,18 @@ usage_exit(const int status)
 		"  %s -F\n"
 		"  %s -a|e -i ident -r server-address [-w weight]\n"
 		"  %s -d -i ident -r server-address\n"
-		"  %s --add-rule -i ident -p pattern -r server-address [-m match-num]\n"
-		"  %s --del-rule -i ident -p pattern -r server-address\n"
+		"  %s --add-rule -i ident [-t type] -p pattern -r server-address\n"
+		"                [-m match-num] [-x rewrite[,rewrite...]] [-o]\n"
+		"                [-H method] [-R]\n"
+		"  %s --del-rule -i ident [-t type] -p pattern -r server-address\n"
 		"  %s -L [-n]\n"
 		"  %s -f config-file\n"
+		"  %s --load-prefixes prefix-file -i ident\n"
 		"  %s --start|stop [-i ident]\n"
 		"  %s -h\n\n",
 		program, program_version, program, program, program,
 		program, program, program, program, program, program,
-		program, program);
+		program, program, program);
 
 	fprintf(stream,
 		"Commands:\n"
@@ -701,6 +830,8 @@ usage_exit(const int status)
 		"  --del-rule                  del rule into virtual service\n"
 		"  --list            -L        list the table\n"
 		"  --load-configfile -f        load a config file\n"
+		"  --load-prefixes             replace the client prefix table\n"
+		"                              of a virtual service\n"
 		"  --start                     start the virtual services\n"
 		"  --stop                      stop the virtual services\n"
 		"  --help            -h        display this help message\n\n");
@@ -712,6 +843,18 @@ usage_exit(const int status)
 		"                                      the default scheduler is %s.\n"
 		"  --port         -p port              service port number\n"
 		"  --match        -m match-num         match number to hash (hhttp only)\n"
+		"  --rewrite      -x rewrite,...       request header rewrites of a rule,\n"
+		"                                      xff, connection and/or hopbyhop\n"
+		"  --type         -t type              what a rule matches: uri (default),\n"
+		"                                      host, method, header:name,\n"
+		"                                      cookie:name or src (address/bits\n"
+		"                                      or @tag of the prefix table)\n"
+		"  --any-order    -o                   the rule overlaps no other such rule\n"
+		"  --hash         -H method            how a rule spreads its matches,\n"
+		"                                      modulo (default), maglev or\n"
+		"                                      rendezvous\n"
+		"  --round-robin  -R                   take the servers of a rule by\n"
+		"                                      weighted round robin\n"
 		"  --real-server  -r server-address    server-address is host (and port)\n"
 		"  --listen       -l server-address    server-address is host (and port)\n"
 		"  --weight       -w weight            capacity of real server\n"